@@ -0,0 +1,177 @@
+# -*- coding: utf-8 -*-
+"""Benchmarks for pyblossom.
+
+Sweeps filter sizes from L1 resident up to --max-size and key lengths from
+8 bytes to 1 KB, and prints a JSON document with ops/s, ns/op and bytes/s
+per measurement:
+
+    python bench.py --max-size 8M --output bench.json
+
+libbloom counts the bits of a filter in an int, so no filter reaches 256 MB
+and the sweep stops at 128 MB, well past the last level cache.
+
+The C level is measured through the entry points closest to it: the
+*_hashed_many calls probe prehashed digests (bloom_add/bloom_check without
+the key hashing), hash_many is the hashing alone, and load(copy=False)
+of a dump is the checksum pass (compute_checksum over crc32).
+"""
+
+import argparse
+import json
+import os
+import platform
+import sys
+import tempfile
+import time
+import pyblossom
+
+SIZES = [32 << 10, 256 << 10, 8 << 20, 128 << 20]
+MAX_SIZE = 256 << 20    # 2^31 bits, libbloom's int bit count stays below it
+KEY_LENGTHS = [8, 16, 64, 256, 1024]
+KEY_BYTES = 16 << 20    # cap on the keys generated per key length
+ERROR = 0.01
+BITS_PER_ENTRY = 9.585  # libbloom's -ln(0.01) / ln(2)^2
+
+
+def parse_size(text):
+    units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+    if text[-1:].upper() in units:
+        return int(float(text[:-1]) * units[text[-1:].upper()])
+    return int(text)
+
+
+def make_keys(count, length):
+    # distinct keys of exactly length bytes: a counter, padded
+    pad = b'k' * (length - 8)
+    return [i.to_bytes(8, 'little') + pad for i in range(count)]
+
+
+def make_filter(size, layout):
+    entries = max(1, int(size * 8 / BITS_PER_ENTRY))
+    return pyblossom.Filter(entries=entries, error=ERROR, layout=layout)
+
+
+class Bench(object):
+
+    def __init__(self, repeat, min_time, only):
+        self.repeat = repeat
+        self.min_time = min_time
+        self.only = only
+        self.results = []
+
+    def run(self, name, fn, ops, nbytes, **params):
+        """times fn, which performs ops operations over nbytes bytes, best of repeat"""
+        if self.only and not any(word in name for word in self.only):
+            return
+        best = None
+        for _ in range(self.repeat):
+            loops = 0
+            start = time.perf_counter()
+            while True:
+                fn()
+                loops += 1
+                elapsed = time.perf_counter() - start
+                if elapsed >= self.min_time:
+                    break
+            elapsed /= loops
+            if best is None or elapsed < best:
+                best = elapsed
+        result = dict(name=name, ops=ops, bytes=nbytes, seconds=best,
+                      ns_per_op=best * 1e9 / ops, ops_per_s=ops / best,
+                      bytes_per_s=nbytes / best)
+        result.update(params)
+        self.results.append(result)
+        sys.stderr.write('%-22s %-40s %10.1f ns/op %12.0f ops/s %10.1f MB/s\n' % (
+            name, ' '.join('%s=%s' % item for item in sorted(params.items())),
+            result['ns_per_op'], result['ops_per_s'], result['bytes_per_s'] / 1e6))
+
+
+def bench_keys(bench, bf, keys, **params):
+    count = len(keys)
+    nbytes = sum(len(key) for key in keys)
+    digests = pyblossom.hash_many(keys)
+
+    def add():
+        for key in keys:
+            bf.add(key)
+
+    def contains():
+        for key in keys:
+            bf.contains(key)
+
+    bench.run('add', add, count, nbytes, **params)
+    bench.run('contains', contains, count, nbytes, **params)
+    bench.run('add_many', lambda: bf.add_many(keys), count, nbytes, **params)
+    bench.run('contains_many', lambda: bf.contains_many(keys), count, nbytes, **params)
+    bench.run('hash_many', lambda: pyblossom.hash_many(keys), count, nbytes, **params)
+    bench.run('add_hashed_many', lambda: bf.add_hashed_many(digests), count, len(digests),
+              **params)
+    bench.run('contains_hashed_many', lambda: bf.contains_hashed_many(digests), count,
+              len(digests), **params)
+
+
+def bench_serialize(bench, bf, **params):
+    size = len(bf.get_buffer())
+    data = pyblossom.dump(bf)
+
+    bench.run('dump', lambda: pyblossom.dump(bf), 1, size, **params)
+    bench.run('dump_ex', lambda: pyblossom.dump_ex(bf), 1, size, **params)
+    bench.run('load', lambda: pyblossom.load(data), 1, size, **params)
+    bench.run('load_noverify', lambda: pyblossom.load(data, verify=False), 1, size, **params)
+    bench.run('checksum', lambda: pyblossom.load(data, copy=False), 1, size, **params)
+    bench.run('merge', lambda: bf.__ior__(bf), 1, size, **params)
+    del data
+
+    fd, path = tempfile.mkstemp(prefix='pyblossom-bench-')
+    try:
+        with os.fdopen(fd, 'wb') as f:
+            pyblossom.dump_to(bf, f, align=4096)
+        bench.run('open_mmap', lambda: pyblossom.open_mmap(path), 1, size, **params)
+        bench.run('open_mmap_verify', lambda: pyblossom.open_mmap(path, verify=True), 1, size,
+                  **params)
+    finally:
+        os.unlink(path)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--max-size', type=parse_size, default=128 << 20,
+                        help='largest filter in bytes, K/M/G suffixes allowed, below 256M (default 128M)')
+    parser.add_argument('--keys', type=int, default=100000,
+                        help='keys per run, fewer for long keys (default 100000)')
+    parser.add_argument('--layouts', default='standard',
+                        help='comma separated layouts to sweep (default standard)')
+    parser.add_argument('--repeat', type=int, default=3, help='runs per measurement, best is kept')
+    parser.add_argument('--min-time', type=float, default=0.1,
+                        help='seconds each run loops for at least (default 0.1)')
+    parser.add_argument('--only', action='append',
+                        help='only run benchmarks whose name contains this, may be repeated')
+    parser.add_argument('--output', help='write the JSON there instead of stdout')
+    args = parser.parse_args()
+    if args.max_size >= MAX_SIZE:
+        sys.stderr.write('filters stay below 256M, the largest size run is %dM\n' % (SIZES[-1] >> 20))
+
+    bench = Bench(args.repeat, args.min_time, args.only)
+    keysets = dict((length, make_keys(min(args.keys, KEY_BYTES // length), length))
+                   for length in KEY_LENGTHS)
+    for layout in args.layouts.split(','):
+        for size in [size for size in SIZES if size <= args.max_size]:
+            bf = make_filter(size, layout)
+            params = dict(layout=layout, filter_bytes=len(bf.get_buffer()))
+            for length in KEY_LENGTHS:
+                bench_keys(bench, bf, keysets[length], key_bytes=length, **params)
+            bench_serialize(bench, bf, **params)
+            del bf
+
+    report = dict(python=platform.python_version(), machine=platform.machine(),
+                  simd=pyblossom.simd, results=bench.results)
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=1)
+    else:
+        json.dump(report, sys.stdout, indent=1)
+        sys.stdout.write('\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,197 @@
+/*
+ * Word-wide kernels over whole bit arrays, used to combine filters and
+ * count their set bits. They take inputs of any alignment and length.
+ */
+
+#define BITS_OR 0
+#define BITS_AND 1
+
+static void
+bits_or_words(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    uint64_t a, b;
+
+    for (; len >= 8; dst += 8, src += 8, len -= 8) {
+        memcpy(&a, dst, 8);
+        memcpy(&b, src, 8);
+        a |= b;
+        memcpy(dst, &a, 8);
+    }
+    while (len--)
+        *dst++ |= *src++;
+}
+
+static void
+bits_and_words(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    uint64_t a, b;
+
+    for (; len >= 8; dst += 8, src += 8, len -= 8) {
+        memcpy(&a, dst, 8);
+        memcpy(&b, src, 8);
+        a &= b;
+        memcpy(dst, &a, 8);
+    }
+    while (len--)
+        *dst++ &= *src++;
+}
+
+#ifdef SPLIT_X86
+__attribute__((target("avx2")))
+static void
+bits_or_avx2(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    __m256i a, b;
+
+    for (; len >= 32; dst += 32, src += 32, len -= 32) {
+        a = _mm256_loadu_si256((const __m256i *)dst);
+        b = _mm256_loadu_si256((const __m256i *)src);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_or_si256(a, b));
+    }
+    bits_or_words(dst, src, len);
+}
+
+__attribute__((target("avx2")))
+static void
+bits_and_avx2(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    __m256i a, b;
+
+    for (; len >= 32; dst += 32, src += 32, len -= 32) {
+        a = _mm256_loadu_si256((const __m256i *)dst);
+        b = _mm256_loadu_si256((const __m256i *)src);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_and_si256(a, b));
+    }
+    bits_and_words(dst, src, len);
+}
+#endif
+
+static int
+popcount64(uint64_t x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static uint64_t
+bits_count_words(const unsigned char *src, size_t len)
+{
+    uint64_t a, total = 0;
+
+    for (; len >= 8; src += 8, len -= 8) {
+        memcpy(&a, src, 8);
+        total += popcount64(a);
+    }
+    while (len--)
+        total += popcount64(*src++);
+    return total;
+}
+
+#ifdef SPLIT_X86
+/* the same loop, with __builtin_popcountll compiled to the popcnt instruction */
+__attribute__((target("popcnt")))
+static uint64_t
+bits_count_popcnt(const unsigned char *src, size_t len)
+{
+    uint64_t a, total = 0;
+
+    for (; len >= 8; src += 8, len -= 8) {
+        memcpy(&a, src, 8);
+        total += __builtin_popcountll(a);
+    }
+    while (len--)
+        total += __builtin_popcountll(*src++);
+    return total;
+}
+
+/* Mula's nibble lookup: per byte counts add up in 8 bit lanes for at most
+ * 31 rounds of up to 8 each, then fold into 64 bit lanes with sad */
+__attribute__((target("avx2")))
+static uint64_t
+bits_count_avx2(const unsigned char *src, size_t len)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256(), counts, v;
+    int round;
+
+    while (len >= 32) {
+        counts = _mm256_setzero_si256();
+        for (round = 0; round < 31 && len >= 32; round++, src += 32, len -= 32) {
+            v = _mm256_loadu_si256((const __m256i *)src);
+            counts = _mm256_add_epi8(counts, _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)));
+            counts = _mm256_add_epi8(counts,
+                _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    return (uint64_t)_mm256_extract_epi64(total, 0) + (uint64_t)_mm256_extract_epi64(total, 1) +
+        (uint64_t)_mm256_extract_epi64(total, 2) + (uint64_t)_mm256_extract_epi64(total, 3) +
+        bits_count_popcnt(src, len);
+}
+#endif
+
+/* Shared arrays take each byte's change as a fetch-or on it, or a fetch-and
+ * on its aligned word, so concurrent adds are never undone. */
+static void
+bits_or_atomic(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] & ~dst[i])
+            atomic_test_set(dst + i, src[i]);
+    }
+}
+
+static void
+bits_and_atomic(unsigned char *dst, const unsigned char *src, size_t len)
+{
+    uint64_t *word;
+    union {
+        uint64_t word;
+        unsigned char bytes[8];
+    } mask;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if ((dst[i] & src[i]) == dst[i])
+            continue;
+        word = (uint64_t *)((uintptr_t)(dst + i) & ~(uintptr_t)7);
+        mask.word = ~(uint64_t)0;
+        mask.bytes[(uintptr_t)(dst + i) & 7] = src[i];
+#if defined(_MSC_VER)
+        _InterlockedAnd64((volatile __int64 *)word, (__int64)mask.word);
+#else
+        __atomic_fetch_and(word, mask.word, __ATOMIC_RELAXED);
+#endif
+    }
+}
+
+static void (*bits_or)(unsigned char *dst, const unsigned char *src, size_t len) = bits_or_words;
+static void (*bits_and)(unsigned char *dst, const unsigned char *src, size_t len) = bits_and_words;
+static uint64_t (*bits_count)(const unsigned char *src, size_t len) = bits_count_words;
+
+static void
+select_bitops_kernel(void)
+{
+#ifdef SPLIT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        bits_count = bits_count_popcnt;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        bits_or = bits_or_avx2;
+        bits_and = bits_and_avx2;
+        if (__builtin_cpu_supports("popcnt"))
+            bits_count = bits_count_avx2;
+    }
+#endif
+}
@@ -0,0 +1,96 @@
+/*
+ * Counting filter kernels. Every bit of a standard layout filter becomes a
+ * 4 bit counter, two per byte with the even counter in the low nibble, and
+ * probe i of a key hits counter (a + i * b) % bits exactly as it would hit
+ * that bit. Counters saturate at COUNTER_MAX and then stay there, so a
+ * removal can never clear a bit another key still needs.
+ */
+
+#define COUNTER_BITS 4
+#define COUNTER_MAX 15
+
+/* bytes holding one counter per bit of a bits sized filter */
+static size_t
+counter_bytes(unsigned int bits)
+{
+    return ((size_t)bits + 1) / 2;
+}
+
+static unsigned int
+counter_get(const unsigned char *counters, unsigned int x)
+{
+    return (counters[x >> 1] >> ((x & 1) * COUNTER_BITS)) & COUNTER_MAX;
+}
+
+static void
+counter_set(unsigned char *counters, unsigned int x, unsigned int value)
+{
+    int shift = (x & 1) * COUNTER_BITS;
+
+    counters[x >> 1] = (counters[x >> 1] & ~(COUNTER_MAX << shift)) | (value << shift);
+}
+
+/* returns 1 if every counter of the key is non-zero */
+static int
+counting_check(const unsigned char *counters, unsigned int bits, int hashes,
+    const struct digest *digest)
+{
+    unsigned int i;
+
+    for (i = 0; i < (unsigned int)hashes; i++) {
+        if (counter_get(counters, (digest->a + i * digest->b) % bits) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+static void
+counting_add(unsigned char *counters, unsigned int bits, int hashes,
+    const struct digest *digest)
+{
+    unsigned int i, x, value;
+
+    for (i = 0; i < (unsigned int)hashes; i++) {
+        x = (digest->a + i * digest->b) % bits;
+        value = counter_get(counters, x);
+        if (value < COUNTER_MAX)
+            counter_set(counters, x, value + 1);
+    }
+}
+
+/* Decrements the counters of a key, leaving saturated ones alone. Returns 0
+ * without touching anything if the key is not in the filter. */
+static int
+counting_remove(unsigned char *counters, unsigned int bits, int hashes,
+    const struct digest *digest)
+{
+    unsigned int i, x, value;
+
+    if (!counting_check(counters, bits, hashes, digest))
+        return 0;
+    for (i = 0; i < (unsigned int)hashes; i++) {
+        x = (digest->a + i * digest->b) % bits;
+        value = counter_get(counters, x);
+        if (value > 0 && value < COUNTER_MAX)
+            counter_set(counters, x, value - 1);
+    }
+    return 1;
+}
+
+/* sets bit x of the zeroed standard layout array bf for every counter x above 0 */
+static void
+counting_collapse(const unsigned char *counters, unsigned int bits, unsigned char *bf)
+{
+    unsigned int x;
+    size_t i;
+
+    for (i = 0; i < counter_bytes(bits); i++) {
+        if (counters[i] == 0)
+            continue;
+        x = i * 2;
+        if (counters[i] & COUNTER_MAX)
+            bf[x >> 3] |= 1 << (x & 7);
+        if ((counters[i] >> COUNTER_BITS) && x + 1 < bits)
+            bf[(x + 1) >> 3] |= 1 << ((x + 1) & 7);
+    }
+}
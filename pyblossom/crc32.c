@@ -46,6 +46,7 @@
     #include "pstdint.h"
 #endif
 #include <stdlib.h>
+#include <string.h>
 
 static uint32_t crc32_tab[] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -93,16 +94,212 @@ static uint32_t crc32_tab[] = {
 	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
 };
 
-uint32_t
-crc32(uint32_t crc, const void *buf, size_t size)
+/*
+ * Slice-by-8: crc32_slice_tab[k][n] is the CRC of byte n followed by k zero
+ * bytes, so eight input bytes fold into the CRC with eight independent table
+ * lookups instead of a chain of eight dependent ones. The tables derive from
+ * crc32_tab in crc32_init().
+ */
+static uint32_t crc32_slice_tab[8][256];
+
+static uint32_t
+crc32_bytes(uint32_t crc, const uint8_t *p, size_t size)
+{
+	while (size--)
+		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static uint32_t
+crc32_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	uint32_t lo, hi;
+
+	while (size >= 8) {
+		lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+		    (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = crc32_slice_tab[7][lo & 0xFF] ^
+		    crc32_slice_tab[6][(lo >> 8) & 0xFF] ^
+		    crc32_slice_tab[5][(lo >> 16) & 0xFF] ^
+		    crc32_slice_tab[4][lo >> 24] ^
+		    crc32_slice_tab[3][hi & 0xFF] ^
+		    crc32_slice_tab[2][(hi >> 8) & 0xFF] ^
+		    crc32_slice_tab[1][(hi >> 16) & 0xFF] ^
+		    crc32_slice_tab[0][hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+	return crc32_bytes(crc, p, size);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC32_PCLMUL 1
+#include <immintrin.h>
+
+/*
+ * Carry-less multiplication folding after Gopal et al., "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Intel,
+ * 2009): four 128 bit lanes fold 64 bytes per iteration, then collapse to
+ * 128 bits, 64 bits, and a Barrett reduction to the 32 bit CRC. The
+ * constants are for the bit-reflected polynomial 0xedb88320. Takes len >= 64
+ * and a multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+crc32_pclmul_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	static const uint64_t k1k2[] = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+	static const uint64_t k3k4[] = { 0x01751997d0ULL, 0x00ccaa009eULL };
+	static const uint64_t k5k0[] = { 0x0163cd6124ULL, 0x0000000000ULL };
+	static const uint64_t poly[] = { 0x01db710641ULL, 0x01f7011641ULL };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_loadu_si128((const __m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		len -= 64;
+	}
+
+	/* fold the four lanes into one */
+	x0 = _mm_loadu_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_loadu_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t
+crc32_pclmul(uint32_t crc, const uint8_t *p, size_t size)
 {
-	const uint8_t *p;
+	size_t chunk;
+
+	if (size >= 64) {
+		chunk = size & ~(size_t)15;
+		crc = crc32_pclmul_fold(crc, p, chunk);
+		p += chunk;
+		size -= chunk;
+	}
+	return crc32_slice8(crc, p, size);
+}
+#endif
 
-	p = buf;
-	crc = crc ^ ~0U;
+#if defined(__ARM_FEATURE_CRC32)
+#define CRC32_ARM 1
+#include <arm_acle.h>
 
+/* the ARMv8 CRC32 instructions implement this same reflected polynomial */
+static uint32_t
+crc32_arm(uint32_t crc, const uint8_t *p, size_t size)
+{
+	uint64_t word;
+
+	while (size >= 8) {
+		memcpy(&word, p, sizeof(word));
+		crc = __crc32d(crc, word);
+		p += 8;
+		size -= 8;
+	}
 	while (size--)
-		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		crc = __crc32b(crc, *p++);
+	return crc;
+}
+#endif
 
-	return crc ^ ~0U;
+static uint32_t (*crc32_update)(uint32_t crc, const uint8_t *p, size_t size) = crc32_bytes;
+static const char *crc32_kernel = "bytewise";
+
+/* builds the slice-by-8 tables and picks the fastest kernel for this CPU */
+static void
+crc32_init(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		c = crc32_tab[n];
+		crc32_slice_tab[0][n] = c;
+		for (k = 1; k < 8; k++) {
+			c = crc32_tab[c & 0xFF] ^ (c >> 8);
+			crc32_slice_tab[k][n] = c;
+		}
+	}
+	crc32_update = crc32_slice8;
+	crc32_kernel = "slice-by-8";
+
+#if defined(CRC32_PCLMUL)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+		crc32_update = crc32_pclmul;
+		crc32_kernel = "pclmul";
+	}
+#elif defined(CRC32_ARM)
+	crc32_update = crc32_arm;
+	crc32_kernel = "armv8-crc";
+#endif
+}
+
+uint32_t
+crc32(uint32_t crc, const void *buf, size_t size)
+{
+	return crc32_update(crc ^ ~0U, (const uint8_t *)buf, size) ^ ~0U;
 }
@@ -0,0 +1,188 @@
+/*
+ * Cuckoo filters (Fan et al., "Cuckoo Filter: Practically Better Than
+ * Bloom"), the dynamic counterpart of fuse.c. A key's 16 bit fingerprint
+ * lives in one of two buckets of CUCKOO_SLOTS slots; the second bucket is
+ * the first xored with a hash of the fingerprint, so either bucket can be
+ * found from the other while relocating. Fingerprints are stored little
+ * endian and 0 marks an empty slot.
+ */
+
+#define CUCKOO_SLOTS 4
+#define CUCKOO_MAX_KICKS 500
+#define CUCKOO_BUCKET_BYTES (CUCKOO_SLOTS * 2)
+
+struct cuckoo {
+    unsigned char *table;
+    uint32_t buckets;           /* a power of two */
+    uint32_t count;
+    int victim_used;            /* a fingerprint that found no slot at all */
+    uint32_t victim_bucket;
+    uint16_t victim;
+    uint64_t rng;               /* picks the slot to evict */
+};
+
+/* buckets for capacity keys at up to 96% load */
+static uint32_t
+cuckoo_buckets(uint32_t capacity)
+{
+    uint32_t buckets = 1;
+
+    while ((uint64_t)buckets * CUCKOO_SLOTS * 96 < (uint64_t)capacity * 100 && buckets < 0x80000000U)
+        buckets <<= 1;
+    return buckets;
+}
+
+static size_t
+cuckoo_bytes(uint32_t buckets)
+{
+    return (size_t)buckets * CUCKOO_BUCKET_BYTES;
+}
+
+static uint16_t
+cuckoo_fingerprint(uint64_t digest)
+{
+    uint16_t f = (uint16_t)(digest >> 48);
+
+    return f ? f : 1;
+}
+
+static uint32_t
+cuckoo_other(const struct cuckoo *cuckoo, uint32_t bucket, uint16_t f)
+{
+    return (bucket ^ (f * 0x5bd1e995U)) & (cuckoo->buckets - 1);
+}
+
+static uint16_t
+cuckoo_get(const struct cuckoo *cuckoo, uint32_t bucket, int slot)
+{
+    const unsigned char *p = cuckoo->table + (size_t)bucket * CUCKOO_BUCKET_BYTES + slot * 2;
+
+    return p[0] | (p[1] << 8);
+}
+
+static void
+cuckoo_set(struct cuckoo *cuckoo, uint32_t bucket, int slot, uint16_t f)
+{
+    unsigned char *p = cuckoo->table + (size_t)bucket * CUCKOO_BUCKET_BYTES + slot * 2;
+
+    p[0] = (unsigned char)f;
+    p[1] = (unsigned char)(f >> 8);
+}
+
+static int
+cuckoo_find(const struct cuckoo *cuckoo, uint32_t bucket, uint16_t f)
+{
+    int slot;
+
+    for (slot = 0; slot < CUCKOO_SLOTS; slot++) {
+        if (cuckoo_get(cuckoo, bucket, slot) == f)
+            return slot;
+    }
+    return -1;
+}
+
+static int
+cuckoo_contains(const struct cuckoo *cuckoo, uint64_t digest)
+{
+    uint16_t f = cuckoo_fingerprint(digest);
+    uint32_t i1 = (uint32_t)digest & (cuckoo->buckets - 1);
+    uint32_t i2 = cuckoo_other(cuckoo, i1, f);
+
+    if (cuckoo->victim_used && cuckoo->victim == f &&
+            (cuckoo->victim_bucket == i1 || cuckoo->victim_bucket == i2))
+        return 1;
+    return cuckoo_find(cuckoo, i1, f) >= 0 || cuckoo_find(cuckoo, i2, f) >= 0;
+}
+
+/* Adds a key, relocating fingerprints as needed. Returns -1 without
+ * changing anything if the filter is full; the add that fills it up keeps
+ * its last homeless fingerprint as the victim, so no key is ever lost. */
+static int
+cuckoo_add(struct cuckoo *cuckoo, uint64_t digest)
+{
+    uint16_t f = cuckoo_fingerprint(digest), evicted;
+    uint32_t bucket = (uint32_t)digest & (cuckoo->buckets - 1);
+    int kick, slot;
+
+    if (cuckoo->victim_used)
+        return -1;
+    if ((slot = cuckoo_find(cuckoo, bucket, 0)) < 0) {
+        bucket = cuckoo_other(cuckoo, bucket, f);
+        slot = cuckoo_find(cuckoo, bucket, 0);
+    }
+    if (slot >= 0) {
+        cuckoo_set(cuckoo, bucket, slot, f);
+        cuckoo->count++;
+        return 0;
+    }
+
+    for (kick = 0; kick < CUCKOO_MAX_KICKS; kick++) {
+        cuckoo->rng ^= cuckoo->rng << 13;
+        cuckoo->rng ^= cuckoo->rng >> 7;
+        cuckoo->rng ^= cuckoo->rng << 17;
+        slot = cuckoo->rng % CUCKOO_SLOTS;
+        evicted = cuckoo_get(cuckoo, bucket, slot);
+        cuckoo_set(cuckoo, bucket, slot, f);
+        f = evicted;
+        bucket = cuckoo_other(cuckoo, bucket, f);
+        if ((slot = cuckoo_find(cuckoo, bucket, 0)) >= 0) {
+            cuckoo_set(cuckoo, bucket, slot, f);
+            cuckoo->count++;
+            return 0;
+        }
+    }
+    cuckoo->victim_used = 1;
+    cuckoo->victim_bucket = bucket;
+    cuckoo->victim = f;
+    cuckoo->count++;
+    return 0;
+}
+
+/* Removes one copy of a key's fingerprint, returns 0 if there was none.
+ * Removing a key that was never added may remove another key instead. */
+static int
+cuckoo_remove(struct cuckoo *cuckoo, uint64_t digest)
+{
+    uint16_t f = cuckoo_fingerprint(digest);
+    uint32_t i1 = (uint32_t)digest & (cuckoo->buckets - 1);
+    uint32_t i2 = cuckoo_other(cuckoo, i1, f);
+    int slot;
+
+    if ((slot = cuckoo_find(cuckoo, i1, f)) >= 0) {
+        cuckoo_set(cuckoo, i1, slot, 0);
+    }
+    else if ((slot = cuckoo_find(cuckoo, i2, f)) >= 0) {
+        cuckoo_set(cuckoo, i2, slot, 0);
+    }
+    else if (cuckoo->victim_used && cuckoo->victim == f &&
+            (cuckoo->victim_bucket == i1 || cuckoo->victim_bucket == i2)) {
+        cuckoo->victim_used = 0;
+        cuckoo->count--;
+        return 1;
+    }
+    else {
+        return 0;
+    }
+    cuckoo->count--;
+
+    /* the victim may fit now that a slot is free */
+    if (cuckoo->victim_used) {
+        cuckoo->victim_used = 0;
+        cuckoo->count--;
+        f = cuckoo->victim;
+        i1 = cuckoo->victim_bucket;
+        if ((slot = cuckoo_find(cuckoo, i1, 0)) < 0) {
+            i1 = cuckoo_other(cuckoo, i1, f);
+            slot = cuckoo_find(cuckoo, i1, 0);
+        }
+        if (slot >= 0) {
+            cuckoo_set(cuckoo, i1, slot, f);
+            cuckoo->count++;
+        }
+        else {
+            cuckoo->victim_used = 1;
+            cuckoo->count++;
+        }
+    }
+    return 1;
+}
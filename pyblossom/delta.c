@@ -0,0 +1,78 @@
+/*
+ * Change tracking for shipping filter updates. Once a filter dumps its
+ * first delta, each write marks the DELTA_CHUNK byte chunks of the bit
+ * array it changed in a bitmap, and the next delta carries only those
+ * chunks, as runs of consecutive dirty ones. A chunk is one cache line,
+ * all that a key of the blocked or split layouts ever touches.
+ */
+
+#define DELTA_CHUNK_SHIFT 6
+#define DELTA_CHUNK (1 << DELTA_CHUNK_SHIFT)
+
+static size_t
+delta_chunks(size_t bytes)
+{
+    return (bytes + DELTA_CHUNK - 1) >> DELTA_CHUNK_SHIFT;
+}
+
+static size_t
+delta_bitmap_bytes(size_t bytes)
+{
+    return (delta_chunks(bytes) + 7) / 8;
+}
+
+/* marks the chunk holding byte offset of the bit array, atomically for
+ * the threads of a threads= batch */
+static void
+delta_mark(unsigned char *dirty, size_t offset, int atomic)
+{
+    size_t chunk = offset >> DELTA_CHUNK_SHIFT;
+    unsigned char mask = 1 << (chunk & 7);
+
+    if (!atomic)
+        dirty[chunk >> 3] |= mask;
+    else if (!(dirty[chunk >> 3] & mask))
+#if defined(_MSC_VER)
+        _InterlockedOr8((volatile char *)&dirty[chunk >> 3], (char)mask);
+#else
+        __atomic_fetch_or(&dirty[chunk >> 3], mask, __ATOMIC_RELAXED);
+#endif
+}
+
+/* marks the chunks of every bit standard_check_add probes for digest */
+static void
+delta_mark_standard(unsigned char *dirty, unsigned int bits, int hashes,
+    const struct digest *digest, int atomic)
+{
+    unsigned int i, x;
+
+    for (i = 0; i < (unsigned int)hashes; i++) {
+        x = (digest->a + i * digest->b) % bits;
+        delta_mark(dirty, x >> 3, atomic);
+    }
+}
+
+/* Finds the next run of dirty chunks at or after *chunk, which it moves to
+ * the run's start. Returns the run's length, 0 once there are none left. */
+static size_t
+delta_next_run(const unsigned char *dirty, size_t chunks, size_t *chunk)
+{
+    size_t i = *chunk, start;
+
+    while (i < chunks) {
+        if ((i & 7) == 0 && dirty[i >> 3] == 0) {
+            i += 8;
+            continue;
+        }
+        if (dirty[i >> 3] & (1 << (i & 7)))
+            break;
+        i++;
+    }
+    if (i >= chunks)
+        return 0;
+    start = i;
+    while (i < chunks && (dirty[i >> 3] & (1 << (i & 7))))
+        i++;
+    *chunk = start;
+    return i - start;
+}
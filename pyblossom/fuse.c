@@ -0,0 +1,292 @@
+/*
+ * Binary fuse filters (Graf and Lemire, "Binary Fuse Filters: Fast and
+ * Smaller Than Xor Filters"), for sets that are built once. Each key maps
+ * to three array slots in consecutive segments; the slots are filled so
+ * that the xor of a key's three fingerprints is the key's own fingerprint.
+ * A query reads three slots where a Bloom filter reads k bits, and takes
+ * about 9 bits per key for a 1/256 error with 8 bit fingerprints.
+ *
+ * Keys come in as 64 bit digests and are mixed with the filter's seed, so
+ * a build that fails to peel simply retries with the next seed.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+
+#define FUSE_ARITY 3
+#define FUSE_MAX_SEGMENT_LENGTH 262144
+#define FUSE_MAX_ATTEMPTS 100
+
+struct fuse {
+    uint64_t seed;
+    uint32_t segment_length;
+    uint32_t segment_length_mask;
+    uint32_t segment_count;
+    uint32_t segment_count_length;
+    uint32_t array_length;
+    int fingerprint_bits;       /* 8 or 16 */
+    void *fingerprints;
+};
+
+static uint64_t
+fuse_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t
+fuse_next_seed(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* Sizes the array for size keys. The constants are the ones the paper
+ * tuned for three way filters. */
+static void
+fuse_size(struct fuse *fuse, uint32_t size)
+{
+    double factor;
+    uint32_t capacity;
+
+    if (size == 0)
+        fuse->segment_length = 4;
+    else
+        fuse->segment_length = (uint32_t)1 << (int)floor(log((double)size) / log(3.33) + 2.25);
+    if (fuse->segment_length > FUSE_MAX_SEGMENT_LENGTH)
+        fuse->segment_length = FUSE_MAX_SEGMENT_LENGTH;
+    fuse->segment_length_mask = fuse->segment_length - 1;
+
+    factor = size <= 1 ? 0 : 0.875 + 0.25 * log(1000000.0) / log((double)size);
+    if (factor < 1.125 && size > 1)
+        factor = 1.125;
+    capacity = (uint32_t)floor((double)size * factor + 0.5);
+    fuse->segment_count = (capacity + fuse->segment_length - 1) / fuse->segment_length;
+    if (fuse->segment_count <= FUSE_ARITY - 1)
+        fuse->segment_count = 1;
+    else
+        fuse->segment_count -= FUSE_ARITY - 1;
+    fuse->array_length = (fuse->segment_count + FUSE_ARITY - 1) * fuse->segment_length;
+    fuse->segment_count_length = fuse->segment_count * fuse->segment_length;
+}
+
+static uint32_t
+fuse_slot(const struct fuse *fuse, uint64_t hash, int index)
+{
+    uint64_t lo, h;
+
+    hash_mul128(hash, fuse->segment_count_length, &lo, &h);
+    h += (uint64_t)index * fuse->segment_length;
+    h ^= ((hash & ((1ULL << 36) - 1)) >> (36 - 18 * index)) & fuse->segment_length_mask;
+    return (uint32_t)h;
+}
+
+static uint32_t
+fuse_fingerprint(const struct fuse *fuse, uint64_t hash)
+{
+    if (fuse->fingerprint_bits == 16)
+        return (uint16_t)(hash ^ (hash >> 32));
+    return (uint8_t)(hash ^ (hash >> 32));
+}
+
+/* 16 bit fingerprints are stored little endian, so the array is the same on every host */
+static uint32_t
+fuse_get(const struct fuse *fuse, uint32_t slot)
+{
+    const uint8_t *p = (const uint8_t *)fuse->fingerprints;
+
+    if (fuse->fingerprint_bits == 16)
+        return p[2 * slot] | ((uint32_t)p[2 * slot + 1] << 8);
+    return p[slot];
+}
+
+static void
+fuse_set(struct fuse *fuse, uint32_t slot, uint32_t fingerprint)
+{
+    uint8_t *p = (uint8_t *)fuse->fingerprints;
+
+    if (fuse->fingerprint_bits == 16) {
+        p[2 * slot] = (uint8_t)fingerprint;
+        p[2 * slot + 1] = (uint8_t)(fingerprint >> 8);
+    }
+    else {
+        p[slot] = (uint8_t)fingerprint;
+    }
+}
+
+static size_t
+fuse_bytes(const struct fuse *fuse)
+{
+    return (size_t)fuse->array_length * (fuse->fingerprint_bits / 8);
+}
+
+static int
+fuse_contains(const struct fuse *fuse, uint64_t digest)
+{
+    uint64_t hash = fuse_mix(digest + fuse->seed);
+    uint32_t f = fuse_fingerprint(fuse, hash);
+
+    f ^= fuse_get(fuse, fuse_slot(fuse, hash, 0));
+    f ^= fuse_get(fuse, fuse_slot(fuse, hash, 1));
+    f ^= fuse_get(fuse, fuse_slot(fuse, hash, 2));
+    return f == 0;
+}
+
+static int
+compare_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sorts the digests and drops duplicates, which could never be peeled.
+ * Returns how many distinct ones are left. */
+static uint32_t
+fuse_unique(uint64_t *digests, uint32_t size)
+{
+    uint32_t i, n = 0;
+
+    qsort(digests, size, sizeof(uint64_t), compare_uint64);
+    for (i = 0; i < size; i++) {
+        if (n == 0 || digests[i] != digests[n - 1])
+            digests[n++] = digests[i];
+    }
+    return n;
+}
+
+/*
+ * Fills an allocated, zeroed fuse for size distinct digests (see
+ * fuse_unique). Returns 0 on success, -1 when out of memory and -2 when no
+ * seed peeled, which in practice does not happen.
+ */
+static int
+fuse_build(struct fuse *fuse, const uint64_t *digests, uint32_t size)
+{
+    uint64_t *order, *xors, hash, rng = 0x726b2b9d438b9d4dULL;
+    uint32_t *queue, *start, slots[5], i, slot, other, queued, stacked;
+    uint32_t capacity = fuse->array_length, block_bits = 1, block;
+    uint8_t *counts, *found, which;
+    int attempt, rc = -1, overflow;
+
+    while (((uint32_t)1 << block_bits) < fuse->segment_count)
+        block_bits++;
+    block = (uint32_t)1 << block_bits;
+
+    order = (uint64_t *)calloc(size + 1, sizeof(uint64_t));
+    xors = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+    queue = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+    start = (uint32_t *)malloc(block * sizeof(uint32_t));
+    counts = (uint8_t *)calloc(capacity, 1);
+    found = (uint8_t *)malloc(size + 1);
+    if (order == NULL || xors == NULL || queue == NULL || start == NULL || counts == NULL ||
+            found == NULL)
+        goto done;
+
+    for (attempt = 0; attempt < FUSE_MAX_ATTEMPTS; attempt++) {
+        fuse->seed = fuse_next_seed(&rng);
+        memset(order, 0, size * sizeof(uint64_t));
+        memset(xors, 0, capacity * sizeof(uint64_t));
+        memset(counts, 0, capacity);
+        order[size] = 1;
+
+        /* bucket the hashes by segment for locality while adding them up */
+        for (i = 0; i < block; i++)
+            start[i] = (uint32_t)(((uint64_t)i * size) >> block_bits);
+        for (i = 0; i < size; i++) {
+            uint64_t bucket;
+
+            hash = fuse_mix(digests[i] + fuse->seed);
+            bucket = block_bits ? hash >> (64 - block_bits) : 0;
+            while (order[start[bucket]] != 0)
+                bucket = (bucket + 1) & (block - 1);
+            order[start[bucket]++] = hash;
+        }
+
+        /* counts holds 4 times the keys hitting a slot, plus in its low bits
+         * the xor of which of a key's three slots this was */
+        overflow = 0;
+        for (i = 0; i < size; i++) {
+            hash = order[i];
+            for (which = 0; which < FUSE_ARITY; which++) {
+                slot = fuse_slot(fuse, hash, which);
+                counts[slot] += 4;
+                counts[slot] ^= which;
+                xors[slot] ^= hash;
+                overflow |= counts[slot] < 4;
+            }
+        }
+        if (overflow)
+            continue;
+
+        /* peel slots hit by exactly one key, stacking the keys in order */
+        queued = 0;
+        for (i = 0; i < capacity; i++) {
+            queue[queued] = i;
+            queued += (counts[i] >> 2) == 1;
+        }
+        stacked = 0;
+        while (queued > 0) {
+            slot = queue[--queued];
+            if ((counts[slot] >> 2) != 1)
+                continue;
+            hash = xors[slot];
+            which = counts[slot] & 3;
+            slots[0] = fuse_slot(fuse, hash, 0);
+            slots[1] = fuse_slot(fuse, hash, 1);
+            slots[2] = fuse_slot(fuse, hash, 2);
+            slots[3] = slots[0];
+            slots[4] = slots[1];
+            found[stacked] = which;
+            order[stacked++] = hash;
+            for (i = 1; i < FUSE_ARITY; i++) {
+                other = slots[which + i];
+                queue[queued] = other;
+                queued += (counts[other] >> 2) == 2;
+                counts[other] -= 4;
+                counts[other] ^= (which + i) % FUSE_ARITY;
+                xors[other] ^= hash;
+            }
+        }
+        if (stacked == size)
+            break;
+    }
+    if (attempt == FUSE_MAX_ATTEMPTS) {
+        rc = -2;
+        goto done;
+    }
+
+    /* assign in reverse peeling order, each key owns the slot it was peeled from */
+    for (i = size; i-- > 0;) {
+        uint32_t f;
+
+        hash = order[i];
+        which = found[i];
+        slots[0] = fuse_slot(fuse, hash, 0);
+        slots[1] = fuse_slot(fuse, hash, 1);
+        slots[2] = fuse_slot(fuse, hash, 2);
+        slots[3] = slots[0];
+        slots[4] = slots[1];
+        f = fuse_fingerprint(fuse, hash) ^ fuse_get(fuse, slots[which + 1]) ^
+            fuse_get(fuse, slots[which + 2]);
+        fuse_set(fuse, slots[which], f);
+    }
+    rc = 0;
+
+done:
+    free(order);
+    free(xors);
+    free(queue);
+    free(start);
+    free(counts);
+    free(found);
+    return rc;
+}
@@ -0,0 +1,333 @@
+/*
+ * Key hashes a filter can digest its keys with. murmur2 is what libblossom
+ * and the other inbloom implementations use; xxh3 (XXH3_64bits, default
+ * secret, seed 0) and wyhash (final version 4.2, default secret, seed 0)
+ * give the two 32 bit probe hashes in one pass over the key instead of two.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_MURMUR2 0          /* two seeded runs of MurmurHash2, as in libblossom */
+#define HASH_XXH3 1
+#define HASH_WYHASH 2
+#define HASH_FUNCS 3
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    #define HASH_BIG_ENDIAN 1
+#endif
+
+static uint64_t
+hash_read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+#ifdef HASH_BIG_ENDIAN
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint32_t
+hash_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+#ifdef HASH_BIG_ENDIAN
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint64_t
+hash_rotl64(uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t
+hash_swap64(uint64_t v)
+{
+    return ((v << 56) & 0xff00000000000000ULL) | ((v << 40) & 0x00ff000000000000ULL) |
+           ((v << 24) & 0x0000ff0000000000ULL) | ((v << 8) & 0x000000ff00000000ULL) |
+           ((v >> 8) & 0x00000000ff000000ULL) | ((v >> 24) & 0x0000000000ff0000ULL) |
+           ((v >> 40) & 0x000000000000ff00ULL) | ((v >> 56) & 0x00000000000000ffULL);
+}
+
+/* full 64x64 bit product, low half in *lo and high half in *hi */
+static void
+hash_mul128(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 r = (unsigned __int128)a * b;
+
+    *lo = (uint64_t)r;
+    *hi = (uint64_t)(r >> 64);
+#else
+    uint64_t a_lo = a & 0xFFFFFFFF, a_hi = a >> 32;
+    uint64_t b_lo = b & 0xFFFFFFFF, b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+
+    *hi = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    *lo = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+#endif
+}
+
+static uint64_t
+hash_mul128_fold64(uint64_t a, uint64_t b)
+{
+    uint64_t lo, hi;
+
+    hash_mul128(a, b, &lo, &hi);
+    return lo ^ hi;
+}
+
+/* xxh3 */
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1 0x165667919E3779F9ULL
+#define XXH_PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define XXH_SECRET_SIZE 192
+#define XXH_SECRET_SIZE_MIN 136
+#define XXH_STRIPE_LEN 64
+#define XXH_STRIPES_PER_BLOCK ((XXH_SECRET_SIZE - XXH_STRIPE_LEN) / 8)
+
+static const uint8_t xxh3_secret[XXH_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static uint64_t
+xxh64_avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t
+xxh3_avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t
+xxh3_rrmxmx(uint64_t h, uint64_t len)
+{
+    h ^= hash_rotl64(h, 49) ^ hash_rotl64(h, 24);
+    h *= XXH_PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= XXH_PRIME_MX2;
+    return h ^ (h >> 28);
+}
+
+static uint64_t
+xxh3_mix16(const uint8_t *p, const uint8_t *secret)
+{
+    return hash_mul128_fold64(hash_read64(p) ^ hash_read64(secret),
+        hash_read64(p + 8) ^ hash_read64(secret + 8));
+}
+
+static uint64_t
+xxh3_short(const uint8_t *p, size_t len)
+{
+    const uint8_t *secret = xxh3_secret;
+    uint64_t lo, hi, acc;
+
+    if (len > 8) {
+        lo = hash_read64(p) ^ (hash_read64(secret + 24) ^ hash_read64(secret + 32));
+        hi = hash_read64(p + len - 8) ^ (hash_read64(secret + 40) ^ hash_read64(secret + 48));
+        acc = len + hash_swap64(lo) + hi + hash_mul128_fold64(lo, hi);
+        return xxh3_avalanche(acc);
+    }
+    if (len >= 4) {
+        acc = hash_read32(p + len - 4) + ((uint64_t)hash_read32(p) << 32);
+        acc ^= hash_read64(secret + 8) ^ hash_read64(secret + 16);
+        return xxh3_rrmxmx(acc, len);
+    }
+    if (len > 0) {
+        acc = ((uint32_t)p[0] << 16) | ((uint32_t)p[len >> 1] << 24) | p[len - 1] | ((uint32_t)len << 8);
+        acc ^= hash_read32(secret) ^ hash_read32(secret + 4);
+        return xxh64_avalanche(acc);
+    }
+    return xxh64_avalanche(hash_read64(secret + 56) ^ hash_read64(secret + 64));
+}
+
+static uint64_t
+xxh3_medium(const uint8_t *p, size_t len)
+{
+    const uint8_t *secret = xxh3_secret;
+    uint64_t acc = len * XXH_PRIME64_1, acc_end;
+    size_t i, rounds;
+
+    if (len <= 128) {
+        for (i = (len - 1) / 32 + 1; i-- > 0;) {
+            acc += xxh3_mix16(p + 16 * i, secret + 32 * i);
+            acc += xxh3_mix16(p + len - 16 * (i + 1), secret + 32 * i + 16);
+        }
+        return xxh3_avalanche(acc);
+    }
+
+    rounds = len / 16;
+    for (i = 0; i < 8; i++) {
+        acc += xxh3_mix16(p + 16 * i, secret + 16 * i);
+    }
+    acc_end = xxh3_mix16(p + len - 16, secret + XXH_SECRET_SIZE_MIN - 17);
+    acc = xxh3_avalanche(acc);
+    for (i = 8; i < rounds; i++) {
+        acc_end += xxh3_mix16(p + 16 * i, secret + 16 * (i - 8) + 3);
+    }
+    return xxh3_avalanche(acc + acc_end);
+}
+
+static void
+xxh3_accumulate(uint64_t *acc, const uint8_t *p, const uint8_t *secret)
+{
+    uint64_t value, key;
+    int lane;
+
+    for (lane = 0; lane < 8; lane++) {
+        value = hash_read64(p + lane * 8);
+        key = value ^ hash_read64(secret + lane * 8);
+        acc[lane ^ 1] += value;
+        acc[lane] += (key & 0xFFFFFFFF) * (key >> 32);
+    }
+}
+
+static void
+xxh3_scramble(uint64_t *acc, const uint8_t *secret)
+{
+    int lane;
+
+    for (lane = 0; lane < 8; lane++) {
+        acc[lane] ^= acc[lane] >> 47;
+        acc[lane] ^= hash_read64(secret + lane * 8);
+        acc[lane] *= XXH_PRIME32_1;
+    }
+}
+
+static uint64_t
+xxh3_long(const uint8_t *p, size_t len)
+{
+    const uint8_t *secret = xxh3_secret;
+    uint64_t acc[8] = {XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+                       XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1};
+    size_t block_len = XXH_STRIPE_LEN * XXH_STRIPES_PER_BLOCK;
+    size_t blocks = (len - 1) / block_len, stripes, n, s;
+    uint64_t result;
+
+    for (n = 0; n < blocks; n++) {
+        for (s = 0; s < XXH_STRIPES_PER_BLOCK; s++) {
+            xxh3_accumulate(acc, p + n * block_len + s * XXH_STRIPE_LEN, secret + s * 8);
+        }
+        xxh3_scramble(acc, secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN);
+    }
+    stripes = ((len - 1) - block_len * blocks) / XXH_STRIPE_LEN;
+    for (s = 0; s < stripes; s++) {
+        xxh3_accumulate(acc, p + blocks * block_len + s * XXH_STRIPE_LEN, secret + s * 8);
+    }
+    xxh3_accumulate(acc, p + len - XXH_STRIPE_LEN, secret + XXH_SECRET_SIZE - XXH_STRIPE_LEN - 7);
+
+    result = len * XXH_PRIME64_1;
+    for (n = 0; n < 4; n++) {
+        result += hash_mul128_fold64(acc[2 * n] ^ hash_read64(secret + 11 + 16 * n),
+            acc[2 * n + 1] ^ hash_read64(secret + 11 + 16 * n + 8));
+    }
+    return xxh3_avalanche(result);
+}
+
+static uint64_t
+xxh3_64(const void *key, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)key;
+
+    if (len <= 16)
+        return xxh3_short(p, len);
+    if (len <= 240)
+        return xxh3_medium(p, len);
+    return xxh3_long(p, len);
+}
+
+/* wyhash */
+static const uint64_t wyhash_secret[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static uint64_t
+wyhash_mix(uint64_t a, uint64_t b)
+{
+    return hash_mul128_fold64(a, b);
+}
+
+static uint64_t
+wyhash_64(const void *key, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    const uint64_t *secret = wyhash_secret;
+    uint64_t seed, see1, see2, a, b;
+    size_t i = len;
+
+    seed = wyhash_mix(secret[0], secret[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = ((uint64_t)hash_read32(p) << 32) | hash_read32(p + ((len >> 3) << 2));
+            b = ((uint64_t)hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        if (i >= 48) {
+            see1 = see2 = seed;
+            do {
+                seed = wyhash_mix(hash_read64(p) ^ secret[1], hash_read64(p + 8) ^ seed);
+                see1 = wyhash_mix(hash_read64(p + 16) ^ secret[2], hash_read64(p + 24) ^ see1);
+                see2 = wyhash_mix(hash_read64(p + 32) ^ secret[3], hash_read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wyhash_mix(hash_read64(p) ^ secret[1], hash_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+    hash_mul128(a ^ secret[1], b ^ seed, &a, &b);
+    return wyhash_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
@@ -0,0 +1,125 @@
+/*
+ * A fork-join pool for the batch calls taking threads=. The items are cut
+ * into chunks of grain, every thread starts on an equal, contiguous share
+ * of them, and one that finishes its share steals chunks from the others,
+ * so an uneven share or a descheduled thread does not hold the rest up.
+ * Workers are started per call and never touch Python objects; callers
+ * drop the GIL around pool_run.
+ */
+
+#define POOL_MAX_THREADS 256
+
+struct pool_share {
+    size_t next;                /* next chunk, taken with an atomic fetch-add */
+    size_t end;
+    char pad[64 - 2 * sizeof(size_t)];  /* one cache line per share */
+};
+
+struct pool_task {
+    void (*run)(void *arg, size_t begin, size_t end);
+    void *arg;
+    size_t items, grain;
+    int threads;
+    struct pool_share *shares;
+};
+
+struct pool_worker {
+    struct pool_task *task;
+    int index;
+    PyThread_type_lock done;    /* held until the worker returns */
+};
+
+static size_t
+pool_take(size_t *next)
+{
+#if defined(_MSC_VER)
+    return (size_t)_InterlockedExchangeAdd64((volatile __int64 *)next, 1);
+#else
+    return __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/* drains thread index's share, then steals from the others in turn */
+static void
+pool_work(struct pool_task *task, int index)
+{
+    struct pool_share *share;
+    size_t chunk, begin, end;
+    int i;
+
+    for (i = 0; i < task->threads; i++) {
+        share = &task->shares[(index + i) % task->threads];
+        while ((chunk = pool_take(&share->next)) < share->end) {
+            begin = chunk * task->grain;
+            end = begin + task->grain < task->items ? begin + task->grain : task->items;
+            task->run(task->arg, begin, end);
+        }
+    }
+}
+
+static void
+pool_thread(void *arg)
+{
+    struct pool_worker *worker = (struct pool_worker *)arg;
+
+    pool_work(worker->task, worker->index);
+    PyThread_release_lock(worker->done);
+}
+
+/* Calls run on every range of up to grain of [0, items), on up to threads
+ * threads including the caller's. Shares of threads that fail to start are
+ * stolen by the others, so all of it runs whatever happens. */
+static void
+pool_run(void (*run)(void *arg, size_t begin, size_t end), void *arg, size_t items, size_t grain,
+    int threads)
+{
+    struct pool_task task;
+    struct pool_worker *workers;
+    size_t chunks = (items + grain - 1) / grain;
+    int i, started;
+
+    if ((size_t)threads > chunks)
+        threads = (int)chunks;
+    if (threads <= 1) {
+        run(arg, 0, items);
+        return;
+    }
+
+    task.run = run;
+    task.arg = arg;
+    task.items = items;
+    task.grain = grain;
+    task.threads = threads;
+    task.shares = (struct pool_share *)PyMem_RawMalloc(threads * sizeof(struct pool_share));
+    workers = (struct pool_worker *)PyMem_RawMalloc(threads * sizeof(struct pool_worker));
+    if (task.shares == NULL || workers == NULL) {
+        PyMem_RawFree(task.shares);
+        PyMem_RawFree(workers);
+        run(arg, 0, items);
+        return;
+    }
+    for (i = 0; i < threads; i++) {
+        task.shares[i].next = chunks * i / threads;
+        task.shares[i].end = chunks * (i + 1) / threads;
+    }
+
+    for (started = 1; started < threads; started++) {
+        workers[started].task = &task;
+        workers[started].index = started;
+        workers[started].done = PyThread_allocate_lock();
+        if (workers[started].done == NULL)
+            break;
+        PyThread_acquire_lock(workers[started].done, 1);
+        if (PyThread_start_new_thread(pool_thread, &workers[started]) == PYTHREAD_INVALID_THREAD_ID) {
+            PyThread_free_lock(workers[started].done);
+            break;
+        }
+    }
+    pool_work(&task, 0);
+    for (i = 1; i < started; i++) {
+        PyThread_acquire_lock(workers[i].done, 1);
+        PyThread_free_lock(workers[i].done);
+    }
+    PyMem_RawFree(task.shares);
+    PyMem_RawFree(workers);
+}
@@ -0,0 +1,399 @@
+/*
+ * Probe kernels for filter layouts libblossom does not implement. They work
+ * on a struct bloom's bit array directly and hash keys the same way
+ * libblossom does, unless the filter picked another hash from hash.c, so a
+ * key digest can be shared between layouts.
+ */
+
+#include "murmurhash2.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define SPLIT_X86 1
+    #include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define SPLIT_NEON 1
+    #include <arm_neon.h>
+#endif
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+#define LAYOUT_STANDARD 0       /* libblossom's layout, readable by inbloom */
+#define LAYOUT_BLOCKED 1        /* all probes of a key in one cache line */
+#define LAYOUT_SPLIT 2          /* split-block filter, one bit per 32 bit word */
+#define LAYOUTS 3
+
+/* hints that a probe is about to read (rw 0) or write (rw 1) the line at p */
+#if defined(__GNUC__)
+    #define PREFETCH(p, rw) ((rw) ? __builtin_prefetch((p), 1, 3) : __builtin_prefetch((p), 0, 3))
+#elif defined(_MSC_VER)
+    #define PREFETCH(p, rw) _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#else
+    #define PREFETCH(p, rw) ((void)(p))
+#endif
+
+#define BLOOM_SEED 0x9747b28c   /* first murmur2 seed, as in bloom_check_add */
+
+#define BLOCK_BYTES 64
+#define BLOCK_BITS (BLOCK_BYTES * 8)
+
+#define SPLIT_BLOCK_BYTES 32
+#define SPLIT_BLOCK_BITS (SPLIT_BLOCK_BYTES * 8)
+#define SPLIT_HASHES 8
+
+/* what a kernel does with the bits of a key */
+#define PROBE_CHECK 0
+#define PROBE_ADD 1
+#define PROBE_ATOMIC_ADD 2      /* add with atomic fetch-ors, for shared arrays and threads */
+
+struct digest {
+    uint32_t a;
+    uint32_t b;
+};
+
+/* The two hashes every probe is derived from. murmur2 runs twice, seeded as
+ * in libblossom; the 64 bit hashes supply both halves in one pass. */
+static void
+digest_key(int hash, const void *key, int len, struct digest *digest)
+{
+    uint64_t h;
+
+    switch (hash) {
+    case HASH_XXH3:
+        h = xxh3_64(key, len);
+        break;
+    case HASH_WYHASH:
+        h = wyhash_64(key, len);
+        break;
+    default:
+        digest->a = murmurhash2(key, len, BLOOM_SEED);
+        digest->b = murmurhash2(key, len, digest->a);
+        return;
+    }
+    digest->a = (uint32_t)h;
+    digest->b = (uint32_t)(h >> 32);
+}
+
+/* Maps a 32 bit hash onto [0, range) with a multiply-shift instead of a
+ * division. It uses the high bits of the hash. */
+static uint32_t
+fastrange32(uint32_t hash, uint32_t range)
+{
+    return (uint32_t)(((uint64_t)hash * range) >> 32);
+}
+
+/* Sets a bit with an atomic fetch-or on the byte holding it, so writers in
+ * other processes sharing the array, or threads of a threads= batch, never
+ * lose each other's bits. Returns whether the bit was set before. */
+static int
+atomic_test_set(unsigned char *byte, unsigned char mask)
+{
+#if defined(_MSC_VER)
+    return (_InterlockedOr8((volatile char *)byte, (char)mask) & mask) != 0;
+#else
+    return (__atomic_fetch_or(byte, mask, __ATOMIC_RELAXED) & mask) != 0;
+#endif
+}
+
+/* Returns whether the bit was set, setting it as mode says if it was not. */
+static int
+test_set_bit(unsigned char *byte, unsigned char mask, int mode)
+{
+    if (*byte & mask)
+        return 1;
+    if (mode == PROBE_ATOMIC_ADD)
+        return atomic_test_set(byte, mask);
+    if (mode == PROBE_ADD)
+        *byte |= mask;
+    return 0;
+}
+
+/* x % d for 32 bit x and d, as a multiply-high by the reciprocal from
+ * fastmod_reciprocal instead of a division (Lemire, Kaser and Kurz) */
+static uint64_t
+fastmod_reciprocal(uint32_t d)
+{
+    return UINT64_C(0xFFFFFFFFFFFFFFFF) / d + 1;
+}
+
+static uint32_t
+fastmod32(uint32_t x, uint64_t reciprocal, uint32_t d)
+{
+    uint64_t low = reciprocal * x;
+
+    return (uint32_t)(((low >> 32) * d + (((low & 0xFFFFFFFFU) * d) >> 32)) >> 32);
+}
+
+/* the kernels are instantiated for each constant hash count, unrolled */
+#if defined(__GNUC__)
+    #define PROBE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+    #define PROBE_INLINE __forceinline
+#else
+    #define PROBE_INLINE
+#endif
+#if defined(__clang__)
+    #define PROBE_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+    #define PROBE_UNROLL _Pragma("GCC unroll 16")
+#else
+    #define PROBE_UNROLL
+#endif
+
+/*
+ * libblossom's own probe sequence, for when its non-atomic bloom_add will
+ * not do: probe i tests bit (a + i * b) % bits.
+ */
+static PROBE_INLINE int
+standard_probe(unsigned char *bf, uint32_t bits, uint64_t reciprocal, int hashes,
+    const struct digest *digest, int mode)
+{
+    uint32_t x = digest->a, bit;
+    int i, hits = 0;
+
+    PROBE_UNROLL
+    for (i = 0; i < hashes; i++, x += digest->b) {
+        bit = fastmod32(x, reciprocal, bits);
+        if (test_set_bit(bf + (bit >> 3), 1 << (bit & 7), mode)) {
+            hits++;
+        }
+        else if (mode == PROBE_CHECK) {
+            return 0;
+        }
+    }
+    return hits == hashes;
+}
+
+/*
+ * Blocked layout: the high bits of a pick one 64 byte block, then b and a
+ * step drawn from the low bits of a double hash inside that block. The step
+ * is odd, so up to BLOCK_BITS probes of a key never collide with each other.
+ * Returns 1 if every bit was already set.
+ */
+static PROBE_INLINE int
+blocked_probe(unsigned char *bf, uint32_t bits, int hashes, const struct digest *digest, int mode)
+{
+    unsigned char *block = bf + (size_t)fastrange32(digest->a, bits / BLOCK_BITS) * BLOCK_BYTES;
+    uint32_t x = digest->b;
+    uint32_t step = digest->a | 1;
+    unsigned int bit;
+    int i, hits = 0;
+
+    PROBE_UNROLL
+    for (i = 0; i < hashes; i++, x += step) {
+        bit = x & (BLOCK_BITS - 1);
+        if (test_set_bit(block + (bit >> 3), 1 << (bit & 7), mode)) {
+            hits++;
+        }
+        else if (mode == PROBE_CHECK) {
+            return 0;
+        }
+    }
+    return hits == hashes;
+}
+
+/* Probes digest in an array of bits, reciprocal is fastmod_reciprocal(bits).
+ * Filter_init picks one per filter, specialized for its hash count when
+ * that is between KERNEL_MIN_HASHES and KERNEL_MAX_HASHES. */
+typedef int (*probe_kernel)(unsigned char *bf, uint32_t bits, uint64_t reciprocal, int hashes,
+    const struct digest *digest, int mode);
+
+#define KERNEL_MIN_HASHES 3
+#define KERNEL_MAX_HASHES 12
+
+static int
+standard_check_add(unsigned char *bf, uint32_t bits, uint64_t reciprocal, int hashes,
+    const struct digest *digest, int mode)
+{
+    return standard_probe(bf, bits, reciprocal, hashes, digest, mode);
+}
+
+static int
+blocked_check_add(unsigned char *bf, uint32_t bits, uint64_t reciprocal, int hashes,
+    const struct digest *digest, int mode)
+{
+    return blocked_probe(bf, bits, hashes, digest, mode);
+}
+
+#define PROBE_KERNELS(k) \
+    static int \
+    standard_check_add_##k(unsigned char *bf, uint32_t bits, uint64_t reciprocal, int hashes, \
+        const struct digest *digest, int mode) \
+    { \
+        return standard_probe(bf, bits, reciprocal, k, digest, mode); \
+    } \
+    static int \
+    blocked_check_add_##k(unsigned char *bf, uint32_t bits, uint64_t reciprocal, int hashes, \
+        const struct digest *digest, int mode) \
+    { \
+        return blocked_probe(bf, bits, k, digest, mode); \
+    }
+
+PROBE_KERNELS(3)
+PROBE_KERNELS(4)
+PROBE_KERNELS(5)
+PROBE_KERNELS(6)
+PROBE_KERNELS(7)
+PROBE_KERNELS(8)
+PROBE_KERNELS(9)
+PROBE_KERNELS(10)
+PROBE_KERNELS(11)
+PROBE_KERNELS(12)
+
+static const probe_kernel standard_kernels[KERNEL_MAX_HASHES - KERNEL_MIN_HASHES + 1] = {
+    standard_check_add_3, standard_check_add_4, standard_check_add_5, standard_check_add_6,
+    standard_check_add_7, standard_check_add_8, standard_check_add_9, standard_check_add_10,
+    standard_check_add_11, standard_check_add_12
+};
+
+static const probe_kernel blocked_kernels[KERNEL_MAX_HASHES - KERNEL_MIN_HASHES + 1] = {
+    blocked_check_add_3, blocked_check_add_4, blocked_check_add_5, blocked_check_add_6,
+    blocked_check_add_7, blocked_check_add_8, blocked_check_add_9, blocked_check_add_10,
+    blocked_check_add_11, blocked_check_add_12
+};
+
+/* the kernel for the standard or blocked layout with hashes probes */
+static probe_kernel
+select_probe_kernel(int layout, int hashes)
+{
+    int fixed = hashes >= KERNEL_MIN_HASHES && hashes <= KERNEL_MAX_HASHES;
+
+    if (layout == LAYOUT_BLOCKED)
+        return fixed ? blocked_kernels[hashes - KERNEL_MIN_HASHES] : blocked_check_add;
+    return fixed ? standard_kernels[hashes - KERNEL_MIN_HASHES] : standard_check_add;
+}
+
+/*
+ * Split-block layout: a picks a 256 bit block made of eight little-endian
+ * 32 bit words, and each word gets exactly one bit, chosen by the top five
+ * bits of b multiplied with a per-word odd salt. All eight bit positions
+ * come out of one vector multiply-shift and are tested with one compare.
+ */
+static const uint32_t split_salt[SPLIT_HASHES] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static int
+split_check_add_scalar(unsigned char *bf, uint32_t blocks,
+    const struct digest *digest, int mode)
+{
+    unsigned char *block = bf + (size_t)fastrange32(digest->a, blocks) * SPLIT_BLOCK_BYTES;
+    unsigned int i, bit;
+    int hits = 0;
+
+    for (i = 0; i < SPLIT_HASHES; i++) {
+        bit = (digest->b * split_salt[i]) >> 27;
+        if (test_set_bit(block + i * 4 + (bit >> 3), 1 << (bit & 7), mode)) {
+            hits++;
+        }
+        else if (mode == PROBE_CHECK) {
+            return 0;
+        }
+    }
+    return hits == SPLIT_HASHES;
+}
+
+#ifdef SPLIT_X86
+__attribute__((target("avx2")))
+static int
+split_check_add_avx2(unsigned char *bf, uint32_t blocks,
+    const struct digest *digest, int add)
+{
+    __m256i *block = (__m256i *)(bf + (size_t)fastrange32(digest->a, blocks) * SPLIT_BLOCK_BYTES);
+    __m256i salt = _mm256_loadu_si256((const __m256i *)split_salt);
+    __m256i bits = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(digest->b), salt), 27);
+    __m256i mask = _mm256_sllv_epi32(_mm256_set1_epi32(1), bits);
+    __m256i words = _mm256_loadu_si256(block);
+    int hit = _mm256_testc_si256(words, mask);
+
+    if (add && !hit) {
+        _mm256_storeu_si256(block, _mm256_or_si256(words, mask));
+    }
+    return hit;
+}
+
+/* 1 << bits for each lane, through the float exponent since SSE has no
+ * per-lane shift; 2^31 converts to 0x80000000 as required */
+__attribute__((target("sse4.1")))
+static __m128i
+sse_shift_ones(__m128i bits)
+{
+    __m128i exponent = _mm_add_epi32(_mm_slli_epi32(bits, 23), _mm_set1_epi32(0x3f800000));
+    return _mm_cvttps_epi32(_mm_castsi128_ps(exponent));
+}
+
+__attribute__((target("sse4.1")))
+static int
+split_check_add_sse41(unsigned char *bf, uint32_t blocks,
+    const struct digest *digest, int add)
+{
+    __m128i *block = (__m128i *)(bf + (size_t)fastrange32(digest->a, blocks) * SPLIT_BLOCK_BYTES);
+    __m128i key = _mm_set1_epi32(digest->b);
+    __m128i bits_lo = _mm_srli_epi32(_mm_mullo_epi32(key, _mm_loadu_si128((const __m128i *)split_salt)), 27);
+    __m128i bits_hi = _mm_srli_epi32(_mm_mullo_epi32(key, _mm_loadu_si128((const __m128i *)split_salt + 1)), 27);
+    __m128i mask_lo = sse_shift_ones(bits_lo);
+    __m128i mask_hi = sse_shift_ones(bits_hi);
+    __m128i words_lo = _mm_loadu_si128(block);
+    __m128i words_hi = _mm_loadu_si128(block + 1);
+    int hit = _mm_testc_si128(words_lo, mask_lo) & _mm_testc_si128(words_hi, mask_hi);
+
+    if (add && !hit) {
+        _mm_storeu_si128(block, _mm_or_si128(words_lo, mask_lo));
+        _mm_storeu_si128(block + 1, _mm_or_si128(words_hi, mask_hi));
+    }
+    return hit;
+}
+#endif
+
+#ifdef SPLIT_NEON
+static int
+split_check_add_neon(unsigned char *bf, uint32_t blocks,
+    const struct digest *digest, int add)
+{
+    uint32_t *block = (uint32_t *)(bf + (size_t)fastrange32(digest->a, blocks) * SPLIT_BLOCK_BYTES);
+    uint32x4_t key = vdupq_n_u32(digest->b);
+    uint32x4_t ones = vdupq_n_u32(1);
+    uint32x4_t bits_lo = vshrq_n_u32(vmulq_u32(key, vld1q_u32(split_salt)), 27);
+    uint32x4_t bits_hi = vshrq_n_u32(vmulq_u32(key, vld1q_u32(split_salt + 4)), 27);
+    uint32x4_t mask_lo = vshlq_u32(ones, vreinterpretq_s32_u32(bits_lo));
+    uint32x4_t mask_hi = vshlq_u32(ones, vreinterpretq_s32_u32(bits_hi));
+    uint32x4_t words_lo = vld1q_u32(block);
+    uint32x4_t words_hi = vld1q_u32(block + 4);
+    uint64x2_t missing = vreinterpretq_u64_u32(
+        vorrq_u32(vbicq_u32(mask_lo, words_lo), vbicq_u32(mask_hi, words_hi)));
+    int hit = (vgetq_lane_u64(missing, 0) | vgetq_lane_u64(missing, 1)) == 0;
+
+    if (add && !hit) {
+        vst1q_u32(block, vorrq_u32(words_lo, mask_lo));
+        vst1q_u32(block + 4, vorrq_u32(words_hi, mask_hi));
+    }
+    return hit;
+}
+#endif
+
+/* the SIMD kernels handle PROBE_CHECK and PROBE_ADD, atomic adds always go
+ * through split_check_add_scalar */
+static int (*split_check_add)(unsigned char *bf, uint32_t blocks,
+    const struct digest *digest, int add) = split_check_add_scalar;
+static const char *split_kernel = "scalar";
+
+/* picks the widest split-block kernel the running CPU supports */
+static void
+select_split_kernel(void)
+{
+#if defined(SPLIT_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        split_check_add = split_check_add_avx2;
+        split_kernel = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse4.1")) {
+        split_check_add = split_check_add_sse41;
+        split_kernel = "sse4.1";
+    }
+#elif defined(SPLIT_NEON)
+    split_check_add = split_check_add_neon;
+    split_kernel = "neon";
+#endif
+}
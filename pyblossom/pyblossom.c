@@ -1,4 +1,6 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <pythread.h>
 #ifdef __linux__
     #include <arpa/inet.h>
 #elif _WIN32
@@ -6,67 +8,322 @@
 #endif
 #include "../libblossom/bloom.h"
 #include "crc32.c"
+#include "storage.c"
+#include "hash.c"
+#include "probe.c"
+#include "bitops.c"
+#include "rice.c"
+#include "counting.c"
+#include "fuse.c"
+#include "cuckoo.c"
+#include "delta.c"
+#include "pool.c"
+#include "records.c"
 
 static char module_docstring[] = "Python wrapper for libbloom";
 
+/* merge() combines this many bytes of every input before moving on, so the
+ * output slice stays in cache while all inputs stream past it. */
+#define MERGE_CHUNK (64 * 1024)
+
+/* Below these sizes dropping and re-taking the GIL costs more than the work
+ * it would let other threads overlap with. */
+#define GIL_MINSIZE 2048
+#define GIL_MINKEYS 64
+
 typedef struct {
     PyObject_HEAD
     struct bloom *_bloom_struct;
+    PyThread_type_lock lock;    /* serializes writers to _bloom_struct->bf */
+    int layout;                 /* LAYOUT_* of the bit array */
+    int hash;                   /* HASH_* keys are digested with */
+    probe_kernel probe;         /* probes of the standard and blocked layouts */
+    uint64_t reciprocal;        /* fastmod_reciprocal of the bits */
+    int storage;                /* STORAGE_* owning _bloom_struct->bf */
+    Py_buffer source;           /* buffer a zero-copy filter was loaded from */
+    char *map;                  /* file mapping an open_mmap filter lives in */
+    size_t map_len;
+    int map_writable;
+    int atomic;                 /* bits are shared with other processes, set them atomically */
+    Py_ssize_t exports;         /* buffers exported to other objects, the bit array must stay put */
+    Py_ssize_t busy;            /* calls using the bit array without the GIL, see BEGIN_FILTER_THREADS */
+    uint64_t adds;              /* keys added, probes and results seen through this object, */
+    uint64_t positives;         /* counted while holding the GIL */
+    uint64_t negatives;
+    unsigned char *dirty;       /* delta.c chunks written since the last dump_delta, or NULL */
+    int delta_untracked;        /* the bits were written where dirty cannot see, e.g. through a view */
+    uint64_t delta_token;       /* token of the last delta dumped */
+    uint64_t delta_applied;     /* token of the last delta applied */
+    Py_ssize_t writable_exports;
+    int export_writable;        /* get_buffer is exporting, hand out a writable view whatever the flags */
+    unsigned long dump_owner;   /* thread a dump_to is streaming the filter from, 0 if none */
+    PyThread_type_lock dump_lock;   /* held by that dump_to, created by the first one */
 } Filter;
 
-static PyTypeObject FilterType = {
-    PyObject_HEAD_INIT(NULL)
-    0,                          /*ob_size*/
-    "pyblossom.Filter",         /*tp_name*/
-    sizeof(Filter),             /*tp_basicsize*/
-    0,                          /*tp_itemsize*/
-    0,                          /*tp_dealloc*/
-    0,                          /*tp_print*/
-    0,                          /*tp_getattr*/
-    0,                          /*tp_setattr*/
-    0,                          /*tp_compare*/
-    0,                          /*tp_repr*/
-    0,                          /*tp_as_number*/
-    0,                          /*tp_as_sequence*/
-    0,                          /*tp_as_mapping*/
-    0,                          /*tp_hash */
-    0,                          /*tp_call*/
-    0,                          /*tp_str*/
-    0,                          /*tp_getattro*/
-    0,                          /*tp_setattro*/
-    0,                          /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT,         /*tp_flags*/
-    "Filter objects",           /*tp_doc*/
+/* one Filter in the chain of a ScalableFilter */
+struct scalable_slice {
+    PyObject *filter;
+    uint32_t entries;
+    uint32_t error_rate;        /* 1/N of the slice's false positive rate */
+    uint32_t count;             /* keys added to the slice */
+};
+
+/* A chain of standard layout filters. Once the newest is full, a slice of
+ * growth times its capacity and ratio times its error rate is appended, so
+ * the error rates of all slices sum to at most error. */
+typedef struct {
+    PyObject_HEAD
+    struct scalable_slice *slices;
+    Py_ssize_t nslices;
+    PyThread_type_lock lock;    /* serializes adds, which may append slices */
+    int entries;                /* capacity of the first slice */
+    double error;
+    int growth;
+    double ratio;
+    int hash;                   /* HASH_* keys are digested with */
+} ScalableFilter;
+
+/* Filters a key is routed to one of by its digest, each with a bit array
+ * and a lock of its own, so writers of different shards neither wait for
+ * each other nor share cache lines. */
+typedef struct {
+    PyObject_HEAD
+    PyObject **shards;          /* Filter objects */
+    uint32_t nshards;
+    int entries;                /* capacity of all shards together */
+    double error;
+    int layout;                 /* LAYOUT_* of the shards */
+    int hash;                   /* HASH_* keys are digested with */
+    Py_ssize_t busy;            /* calls using the shards, see sharded_hold */
+} ShardedFilter;
+
+/* Filters of consecutive periods, e.g. the hours of a day: keys go into the
+ * newest, lookups probe them all, and rotating reuses the oldest as the
+ * newest. */
+typedef struct {
+    PyObject_HEAD
+    PyObject **generations;     /* Filter objects */
+    uint32_t ngenerations;
+    uint32_t newest;            /* index of the generation keys are added to */
+    int entries;                /* capacity of each generation */
+    double error;
+    int layout;                 /* LAYOUT_* of the generations */
+    int hash;                   /* HASH_* keys are digested with */
+    Py_ssize_t busy;            /* calls using the generations, see rotating_hold */
+} RotatingFilter;
+
+/* The Filter readers currently query, replaced by swap() while they run.
+ * Every call holds a reference to the filter it started on, so the one
+ * swapped out goes once the last call still probing it returns. */
+typedef struct {
+    PyObject_HEAD
+    PyObject *current;          /* a Filter */
+} FilterHandle;
+
+/* A Bloom filter whose bits are 4 bit counters, so keys can be removed. It
+ * uses the standard layout's sizing and probes, see counting.c. */
+typedef struct {
+    PyObject_HEAD
+    unsigned char *counters;
+    PyThread_type_lock lock;    /* serializes writers to counters */
+    int entries;
+    double error;
+    unsigned int bits;
+    int hashes;
+    int hash;                   /* HASH_* keys are digested with */
+} CountingFilter;
+
+/* An immutable binary fuse filter built from a set of keys, see fuse.c */
+typedef struct {
+    PyObject_HEAD
+    struct fuse fuse;
+    uint32_t count;             /* distinct keys it was built from */
+    int hash;                   /* HASH_* keys are digested with */
+} StaticFilter;
+
+/* A cuckoo filter, which unlike a Bloom filter supports remove(), see cuckoo.c */
+typedef struct {
+    PyObject_HEAD
+    struct cuckoo cuckoo;
+    PyThread_type_lock lock;    /* serializes writers, and batch readers since adds relocate keys */
+    uint32_t capacity;
+    int hash;                   /* HASH_* keys are digested with */
+} CuckooFilter;
+
+static const char *layout_names[] = {"standard", "blocked", "split", NULL};
+static const char *hash_names[] = {"murmur2", "xxh3", "wyhash", NULL};
+
+/* Writers hold the filter lock; readers never take it. A reader racing with
+ * an add sees each byte either before or after the bit was set, which at
+ * worst reports the key being added as absent. */
+#define ENTER_FILTER(obj) \
+    if (!PyThread_acquire_lock((obj)->lock, 0)) { \
+        Py_BEGIN_ALLOW_THREADS \
+        PyThread_acquire_lock((obj)->lock, 1); \
+        Py_END_ALLOW_THREADS \
+    }
+#define LEAVE_FILTER(obj) PyThread_release_lock((obj)->lock)
+
+/* Py_BEGIN/END_ALLOW_THREADS for code using a filter's storage without the
+ * GIL. The filter counts as busy meanwhile, and a busy filter cannot be
+ * re-initialized, which would free that storage. */
+#define BEGIN_FILTER_THREADS(obj) { (obj)->busy++; Py_BEGIN_ALLOW_THREADS
+#define END_FILTER_THREADS(obj) Py_END_ALLOW_THREADS (obj)->busy--; }
+
+/* Everything a module instance owns. Code that only has one of the
+ * module's objects at hand finds it through the object's type. */
+struct module_state {
+    PyObject *error;
+    PyTypeObject *filter_type;
+    PyTypeObject *counting_type;
+    PyTypeObject *scalable_type;
+    PyTypeObject *static_type;
+    PyTypeObject *cuckoo_type;
+    PyTypeObject *sharded_type;
+    PyTypeObject *rotating_type;
+    PyTypeObject *handle_type;
 };
 
+static struct PyModuleDef pyblossom_module;
+
+static struct module_state *
+get_state(PyObject *module)
+{
+    return (struct module_state *)PyModule_GetState(module);
+}
+
+/* the state of the module that created type or the nearest of its bases,
+ * NULL if none of them is one of ours */
+static struct module_state *
+type_state(PyTypeObject *type)
+{
+    PyObject *module;
+
+    for (; type != NULL; type = type->tp_base) {
+        if (!(type->tp_flags & Py_TPFLAGS_HEAPTYPE))
+            continue;
+        module = ((PyHeapTypeObject *)type)->ht_module;
+        if (module != NULL && PyModule_GetDef(module) == &pyblossom_module)
+            return get_state(module);
+    }
+    return NULL;
+}
+
+#define OBJECT_STATE(obj) type_state(Py_TYPE(obj))
+
 struct serialized_filter_header {
     uint16_t checksum;
     uint16_t error_rate;
     uint32_t cardinality;
 };
 
-static PyObject *PyBlossomError;
+/* Filters inbloom readers cannot parse store 0 in the v1 error_rate, which
+ * no v1 writer emits, and carry the real parameters in this extension right
+ * after the v1 header. Their checksum covers the extension as well as the
+ * data. header_len is the offset of the data from the start of the payload.
+ * Version 3 headers are version 2 ones whose data is encoded as well, as
+ * named by the byte reserved in version 2. */
+struct serialized_filter_header_ext {
+    uint8_t version;
+    uint8_t layout;
+    uint8_t hash;
+    uint8_t encoding;
+    uint16_t error_rate;
+    uint16_t header_len;
+};
+
+#define HEADER_V2 2
+#define HEADER_V3 3
+#define HEADER_V2_SIZE (sizeof(struct serialized_filter_header) + sizeof(struct serialized_filter_header_ext))
+#define HEADER_MAX_ALIGN 32768
+
+/* v2 layout ids of payloads that are not a single Filter bit array */
+#define LAYOUT_COUNTING 3       /* CountingFilter counters */
+#define LAYOUT_SCALABLE 4       /* ScalableFilter slice table and slices */
+#define LAYOUT_STATIC 5         /* StaticFilter table and fingerprints */
+#define LAYOUT_CUCKOO 6         /* CuckooFilter table and buckets */
+#define LAYOUT_SHARDED 7        /* ShardedFilter manifest and shard payloads */
+#define LAYOUT_ROTATING 8       /* RotatingFilter manifest and generation payloads */
+#define LAYOUT_KINDS 9
+
+/* v3 encodings of a Filter bit array */
+#define ENCODING_RAW 0
+#define ENCODING_RICE 1         /* set bits u32, length u32, k u8, 3 reserved, rice.c gaps */
+#define ENCODINGS 2
+#define RICE_TABLE_SIZE 12
+
+#define STREAM_CHUNK (1 << 20)  /* default chunk size of dump_to/load_from */
+
+struct filter_header {
+    uint16_t checksum;
+    uint16_t error_rate;
+    uint32_t cardinality;
+    int layout;
+    int hash;
+    int encoding;
+    size_t header_len;
+};
+
+static int filter_borrow(Filter *self, Py_buffer *source, size_t offset);
+static int filter_map(Filter *self, char *map, size_t map_len, size_t offset, int writable);
+static PyObject *instantiate_counting(struct module_state *st, uint32_t cardinality, uint16_t error_rate,
+    int hash, const char *data, Py_ssize_t datalen);
+static PyObject *counting_dump(CountingFilter *self, size_t align);
+static PyObject *load_scalable(struct module_state *st, const struct filter_header *header, const char *data,
+    size_t len);
+static PyObject *scalable_dump(ScalableFilter *self, size_t align);
+static PyObject *load_static(struct module_state *st, const struct filter_header *header, const char *data,
+    size_t len);
+static PyObject *static_dump(StaticFilter *self, size_t align);
+static PyObject *load_cuckoo(struct module_state *st, const struct filter_header *header, const char *data,
+    size_t len);
+static PyObject *cuckoo_dump(CuckooFilter *self, size_t align);
+static PyObject *load_sharded(struct module_state *st, const struct filter_header *header, const char *buffer,
+    size_t buflen, int verify);
+static PyObject *sharded_dump(ShardedFilter *self, size_t align, int compress);
+static PyObject *load_rotating(struct module_state *st, const struct filter_header *header, const char *buffer,
+    size_t buflen, int verify);
+static PyObject *rotating_dump(RotatingFilter *self, size_t align, int compress);
 
 static PyObject *
-instantiate_filter(uint32_t cardinality, uint16_t error_rate, const char *data, int datalen)
+instantiate_filter(struct module_state *st, uint32_t cardinality, uint16_t error_rate, int layout, int hash,
+    const char *data, Py_ssize_t datalen)
 {
-    PyObject *args = Py_BuildValue("(ids#)", cardinality, 1.0 / error_rate, data, datalen);
-    PyObject *obj = FilterType.tp_new(&FilterType, args, NULL);
-    if (FilterType.tp_init(obj, args, NULL) < 0) {
+    PyTypeObject *type = st->filter_type;
+    PyObject *args, *obj;
+
+    if (layout >= LAYOUTS) {
+        PyErr_SetString(st->error, "counting, scalable, static, cuckoo, sharded and rotating filters can "
+            "only be read with load()");
+        return NULL;
+    }
+    args = Py_BuildValue("(idy#sis)", cardinality, 1.0 / error_rate, data, datalen,
+        layout_names[layout], 0, hash_names[hash]);
+    if (args == NULL) {
+        return NULL;
+    }
+    obj = type->tp_new(type, args, NULL);
+    if (obj != NULL && type->tp_init(obj, args, NULL) < 0) {
         Py_DECREF(obj);
         obj = NULL;
     }
+    Py_DECREF(args);
     return obj;
 }
 
 /* helpers */
 static uint16_t
-compute_checksum(const char *buf, size_t len)
+fold_checksum(uint32_t checksum32)
 {
-    uint32_t checksum32 = crc32(0, buf, len);
     return (checksum32 & 0xFFFF) ^ (checksum32 >> 16);
 }
 
+static uint16_t
+compute_checksum(const char *buf, size_t len)
+{
+    return fold_checksum(crc32(0, buf, len));
+}
+
 static uint16_t
 read_uint16(const char **buffer)
 {
@@ -83,234 +340,5869 @@ read_uint32(const char **buffer)
     return ret;
 }
 
+static void
+write_uint16(char **buffer, uint16_t value)
+{
+    value = htons(value);
+    memcpy(*buffer, &value, sizeof(uint16_t));
+    *buffer += sizeof(uint16_t);
+}
 
-/* serialization */
-static PyObject *
-load(PyObject *self, PyObject *args)
+static void
+write_uint32(char **buffer, uint32_t value)
 {
-    struct serialized_filter_header header;
-    const char *data;
-    size_t datalen;
-    uint16_t expected_checksum;
+    value = htonl(value);
+    memcpy(*buffer, &value, sizeof(uint32_t));
+    *buffer += sizeof(uint32_t);
+}
 
-    const char *buffer;
-    Py_ssize_t buflen;
-    if (!PyArg_ParseTuple(args, "s#", &buffer, &buflen)) {
-        return NULL;
-    }
+static uint8_t
+read_uint8(const char **buffer)
+{
+    uint8_t ret = *((uint8_t *)*buffer);
+    *buffer += sizeof(uint8_t);
+    return ret;
+}
 
-    if (buflen < sizeof(struct serialized_filter_header) + 1) {
-        PyErr_SetString(PyBlossomError, "incomplete payload");
-        return NULL;
-    }
+/* Bytes in front of the data. Filters inbloom cannot read and a non-zero
+ * align use the extended header; align pads it so the data starts at a
+ * multiple of align, e.g. on a page boundary of a mapped file. */
+static size_t
+header_size(Filter *filter, size_t align)
+{
+    size_t len = sizeof(struct serialized_filter_header);
 
-    header.checksum = read_uint16(&buffer);
-    header.error_rate = read_uint16(&buffer);
-    header.cardinality = read_uint32(&buffer);
-    data = buffer;
-    datalen = buflen - sizeof(struct serialized_filter_header);
-    expected_checksum = compute_checksum(data, datalen);
-    if (expected_checksum != header.checksum) {
-        PyErr_SetString(PyBlossomError, "checksum mismatch");
-        return NULL;
+    if (filter->layout != LAYOUT_STANDARD || filter->hash != HASH_MURMUR2 || align > 0)
+        len = HEADER_V2_SIZE;
+    if (align > 0)
+        len = (len + align - 1) / align * align;
+    return len;
+}
+
+/* decodes the v1 header */
+static void
+decode_header(const char *buffer, struct filter_header *header)
+{
+    header->checksum = read_uint16(&buffer);
+    header->error_rate = read_uint16(&buffer);
+    header->cardinality = read_uint32(&buffer);
+    header->layout = LAYOUT_STANDARD;
+    header->hash = HASH_MURMUR2;
+    header->encoding = ENCODING_RAW;
+    header->header_len = sizeof(struct serialized_filter_header);
+}
+
+/* decodes the extension following a v1 header whose error_rate is 0 */
+static int
+decode_header_ext(struct module_state *st, const char *buffer, struct filter_header *header)
+{
+    int version = read_uint8(&buffer);
+
+    if (version != HEADER_V2 && version != HEADER_V3) {
+        PyErr_SetString(st->error, "unsupported header version");
+        return -1;
+    }
+    header->layout = read_uint8(&buffer);
+    header->hash = read_uint8(&buffer);
+    header->encoding = read_uint8(&buffer);
+    if (version == HEADER_V2)
+        header->encoding = ENCODING_RAW;
+    header->error_rate = read_uint16(&buffer);
+    header->header_len = read_uint16(&buffer);
+    if (header->layout >= LAYOUT_KINDS) {
+        PyErr_SetString(st->error, "unsupported filter layout");
+        return -1;
+    }
+    if (header->hash >= HASH_FUNCS) {
+        PyErr_SetString(st->error, "unsupported hash function");
+        return -1;
+    }
+    if (header->encoding >= ENCODINGS || (header->encoding != ENCODING_RAW && header->layout >= LAYOUTS)) {
+        PyErr_SetString(st->error, "unsupported encoding");
+        return -1;
     }
-    return instantiate_filter(header.cardinality, header.error_rate, data, datalen);
+    if (header->header_len < HEADER_V2_SIZE) {
+        PyErr_SetString(st->error, "invalid header length");
+        return -1;
+    }
+    if (header->error_rate == 0) {
+        PyErr_SetString(st->error, "invalid error rate");
+        return -1;
+    }
+    return 0;
 }
 
-static PyObject *
-dump(PyObject *self, PyObject *args)
+/* validates and decodes the v1 header and, if present, its extension */
+static int
+parse_header(struct module_state *st, const char *buffer, Py_ssize_t buflen, struct filter_header *header)
 {
-    uint16_t checksum;
-    struct serialized_filter_header header;
-    PyObject *serial_header;
-    PyObject *serial_data;
+    if ((size_t)buflen < sizeof(struct serialized_filter_header) + 1) {
+        PyErr_SetString(st->error, "incomplete payload");
+        return -1;
+    }
+    decode_header(buffer, header);
+    if (header->error_rate != 0) {
+        return 0;
+    }
 
-    Filter *filter;
-    if (!PyArg_ParseTuple(args, "O", &filter)) {
-        return NULL;
+    if ((size_t)buflen < HEADER_V2_SIZE + 1) {
+        PyErr_SetString(st->error, "incomplete payload");
+        return -1;
+    }
+    if (decode_header_ext(st, buffer + sizeof(struct serialized_filter_header), header) < 0) {
+        return -1;
+    }
+    if (header->header_len >= (size_t)buflen) {
+        PyErr_SetString(st->error, "invalid header length");
+        return -1;
     }
+    return 0;
+}
 
-    checksum = compute_checksum((const char *)filter->_bloom_struct->bf, filter->_bloom_struct->bytes);
-    header.checksum = htons(checksum);
-    header.error_rate = htons(1.0 / filter->_bloom_struct->error);
-    header.cardinality = htonl(filter->_bloom_struct->entries);
+struct rice_table {
+    uint32_t count;
+    uint32_t length;
+    int k;
+};
 
-    serial_header = PyString_FromStringAndSize((const char *)&header, sizeof(struct serialized_filter_header));
-    serial_data = PyString_FromStringAndSize((const char *)filter->_bloom_struct->bf, filter->_bloom_struct->bytes);
-    PyString_Concat(&serial_header, serial_data);
-    return serial_header;
+static int
+parse_rice_table(struct module_state *st, const char *buffer, size_t len, struct rice_table *table)
+{
+    if (len < RICE_TABLE_SIZE) {
+        PyErr_SetString(st->error, "incomplete payload");
+        return -1;
+    }
+    table->count = read_uint32(&buffer);
+    table->length = read_uint32(&buffer);
+    table->k = read_uint8(&buffer);
+    if (table->k > RICE_MAX_K) {
+        PyErr_SetString(st->error, "invalid compressed data");
+        return -1;
+    }
+    return 0;
 }
 
-static PyObject *
-dump_ex(PyObject *self, PyObject *args)
+/* decodes the table->length bytes of gaps at data into the fresh filter */
+static int
+decode_compressed(struct module_state *st, Filter *filter, const struct rice_table *table, const char *data,
+    size_t len)
 {
-    Filter *filter;
-    struct bloom *bloom_struct;
-    Py_buffer pybuf;
-    PyObject *memview;
+    struct bloom *bloom_struct = filter->_bloom_struct;
+    int rc;
 
-    if (!PyArg_ParseTuple(args, "O", &filter)) {
-        return NULL;
+    if (len < table->length) {
+        PyErr_SetString(st->error, "incomplete payload");
+        return -1;
+    }
+    if (table->length >= GIL_MINSIZE) {
+        Py_BEGIN_ALLOW_THREADS
+        rc = rice_decode((const unsigned char *)data, table->length, table->count, table->k,
+            bloom_struct->bf, bloom_struct->bytes);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        rc = rice_decode((const unsigned char *)data, table->length, table->count, table->k,
+            bloom_struct->bf, bloom_struct->bytes);
+    }
+    if (rc < 0) {
+        PyErr_SetString(st->error, "invalid compressed data");
+        return -1;
     }
+    return 0;
+}
 
-    bloom_struct = filter->_bloom_struct;
-    PyBuffer_FillInfo(&pybuf, NULL, bloom_struct->bf, bloom_struct->bytes, 1, 
-        PyBUF_CONTIG_RO);
-    memview = PyMemoryView_FromBuffer(&pybuf);
-    return Py_BuildValue("idO", bloom_struct->entries, bloom_struct->error, 
-        memview);
+/* serialization */
+/* checks the checksum of a payload parse_header accepted, unless verify is 0 */
+static int
+verify_payload(struct module_state *st, const char *buffer, Py_ssize_t buflen,
+    const struct filter_header *header, int verify)
+{
+    const char *checked = buffer + sizeof(struct serialized_filter_header);
+    size_t checkedlen = buflen - sizeof(struct serialized_filter_header);
+    uint16_t expected_checksum = header->checksum;
+
+    if (verify && checkedlen >= GIL_MINSIZE) {
+        Py_BEGIN_ALLOW_THREADS
+        expected_checksum = compute_checksum(checked, checkedlen);
+        Py_END_ALLOW_THREADS
+    }
+    else if (verify) {
+        expected_checksum = compute_checksum(checked, checkedlen);
+    }
+    if (expected_checksum != header->checksum) {
+        PyErr_SetString(st->error, "checksum mismatch");
+        return -1;
+    }
+    return 0;
 }
 
-static PyMethodDef module_methods[] = {
-    {"load", (PyCFunction)load, METH_VARARGS,
-     "load a serialized filter"},
-    {"dump", (PyCFunction)dump, METH_VARARGS,
-     "dump a filter into a string"},
-    {"dump_ex", (PyCFunction)dump_ex, METH_VARARGS,
-     "dump a filter and return it as memory view with params (without crc32 check)"},
-    {NULL}
-};
+/* copies len bytes of raw bits into an empty filter, without the GIL if
+ * that takes a while */
+static int
+copy_bits(struct module_state *st, Filter *filter, const char *data, size_t len)
+{
+    struct bloom *bloom_struct = filter->_bloom_struct;
 
-/* Filter methods */
+    if (len != (size_t)bloom_struct->bytes) {
+        PyErr_SetString(st->error, "invalid data length");
+        return -1;
+    }
+    if (len >= GIL_MINSIZE) {
+        Py_BEGIN_ALLOW_THREADS
+        memcpy(bloom_struct->bf, data, len);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        memcpy(bloom_struct->bf, data, len);
+    }
+    return 0;
+}
+
+/* a Filter holding a copy of the len bytes, raw or encoded, after the header */
 static PyObject *
-Filter_add(Filter *self, PyObject *args)
+load_bits(struct module_state *st, const struct filter_header *header, const char *data, size_t len)
 {
-    const char *buffer;
-    Py_ssize_t buflen;
-    if (!PyArg_ParseTuple(args, "s#", &buffer, &buflen)) {
-        return NULL;
-    }
+    struct rice_table table;
+    PyObject *filter;
 
-    bloom_add(self->_bloom_struct, buffer, buflen);
-    Py_RETURN_NONE;
+    /* copied or decoded straight into the bits of an empty filter */
+    filter = instantiate_filter(st, header->cardinality, header->error_rate, header->layout, header->hash,
+        NULL, 0);
+    if (filter != NULL && header->encoding == ENCODING_RAW) {
+        if (copy_bits(st, (Filter *)filter, data, len) < 0)
+            Py_CLEAR(filter);
+        return filter;
+    }
+    if (filter != NULL && (parse_rice_table(st, data, len, &table) < 0 ||
+            decode_compressed(st, (Filter *)filter, &table, data + RICE_TABLE_SIZE,
+                len - RICE_TABLE_SIZE) < 0)) {
+        Py_CLEAR(filter);
+    }
+    return filter;
 }
 
 static PyObject *
-Filter_check(Filter *self, PyObject *args)
+load(PyObject *self, PyObject *args, PyObject *kwargs)
 {
+    static char *kwlist[] = {"data", "copy", "verify", NULL};
+    struct module_state *st = get_state(self);
+    struct filter_header header;
+    int copy = 1, verify = 1;
+
+    PyObject *filter;
+    Py_buffer pybuf;
     const char *buffer;
     Py_ssize_t buflen;
-    if (!PyArg_ParseTuple(args, "s#", &buffer, &buflen)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|ii", kwlist, &pybuf, &copy, &verify)) {
         return NULL;
     }
+    buffer = (const char *)pybuf.buf;
+    buflen = pybuf.len;
 
-    if (bloom_check(self->_bloom_struct, buffer, buflen))
-        Py_RETURN_TRUE;
-    else
-        Py_RETURN_FALSE;
+    if (parse_header(st, buffer, buflen, &header) < 0) {
+        PyBuffer_Release(&pybuf);
+        return NULL;
+    }
+    if (header.layout == LAYOUT_SHARDED || header.layout == LAYOUT_ROTATING) {
+        /* the filters behind the manifest carry checksums of their own */
+        if (header.layout == LAYOUT_SHARDED)
+            filter = load_sharded(st, &header, buffer, buflen, verify);
+        else
+            filter = load_rotating(st, &header, buffer, buflen, verify);
+        PyBuffer_Release(&pybuf);
+        return filter;
+    }
+    if (verify_payload(st, buffer, buflen, &header, verify) < 0) {
+        PyBuffer_Release(&pybuf);
+        return NULL;
+    }
+
+    if (header.layout >= LAYOUTS) {
+        buffer += header.header_len;
+        buflen -= header.header_len;
+        switch (header.layout) {
+        case LAYOUT_COUNTING:
+            filter = instantiate_counting(st, header.cardinality, header.error_rate, header.hash,
+                buffer, buflen);
+            break;
+        case LAYOUT_SCALABLE:
+            filter = load_scalable(st, &header, buffer, buflen);
+            break;
+        case LAYOUT_STATIC:
+            filter = load_static(st, &header, buffer, buflen);
+            break;
+        default:
+            filter = load_cuckoo(st, &header, buffer, buflen);
+            break;
+        }
+        PyBuffer_Release(&pybuf);
+        return filter;
+    }
+    if (copy || header.encoding != ENCODING_RAW) {
+        filter = load_bits(st, &header, buffer + header.header_len, buflen - header.header_len);
+        PyBuffer_Release(&pybuf);
+        return filter;
+    }
+
+    /* let the filter probe the payload in place, it now owns pybuf */
+    filter = instantiate_filter(st, header.cardinality, header.error_rate, header.layout, header.hash,
+        NULL, 0);
+    if (filter == NULL || filter_borrow((Filter *)filter, &pybuf, header.header_len) < 0) {
+        Py_XDECREF(filter);
+        PyBuffer_Release(&pybuf);
+        return NULL;
+    }
+    return filter;
 }
 
-static PyObject *
-Filter_get_buffer(Filter *self, PyObject *args)
+/* Fills in the header_len bytes in front of len bytes of data. The
+ * checksum covers the extension, if any, and the data. */
+static void
+write_header_encoded(char *out, size_t header_len, int entries, double error, int layout, int hash,
+    int encoding, const unsigned char *data, size_t len)
 {
-    Py_buffer pybuf;
-    PyObject *memview;
-    struct bloom *bloom_struct;
+    struct serialized_filter_header header;
+    struct serialized_filter_header_ext ext;
+    uint16_t error_rate = 1.0 / error;
+    uint32_t checksum32;
 
-    bloom_struct = self->_bloom_struct;
-    PyBuffer_FillInfo(&pybuf, NULL, bloom_struct->bf, bloom_struct->bytes, 
-        0, PyBUF_CONTIG);
-    memview = PyMemoryView_FromBuffer(&pybuf);
-    return Py_BuildValue("O", memview);
-}
+    header.error_rate = htons(error_rate);
+    header.cardinality = htonl(entries);
+    if (header_len > sizeof(struct serialized_filter_header)) {
+        memset(out, 0, header_len);
+        memset(&ext, 0, sizeof(struct serialized_filter_header_ext));
+        ext.version = encoding != ENCODING_RAW ? HEADER_V3 : HEADER_V2;
+        ext.layout = layout;
+        ext.hash = hash;
+        ext.encoding = encoding;
+        ext.error_rate = htons(error_rate);
+        ext.header_len = htons(header_len);
+        header.error_rate = 0;
+        memcpy(out + sizeof(struct serialized_filter_header), &ext, sizeof(struct serialized_filter_header_ext));
+    }
 
-static PyMethodDef Filter_methods[] = {
-    {"add", (PyCFunction)Filter_add, METH_VARARGS,
-     "add a member to the filter"},
-    {"contains", (PyCFunction)Filter_check, METH_VARARGS,
-     "check if member exists the filter"},
-    {"get_buffer", (PyCFunction)Filter_get_buffer, METH_NOARGS,
-     "get writable memoryview of the internal buffer"},
-    {NULL}  /* Sentinel */
-};
+    checksum32 = crc32(0, out + sizeof(struct serialized_filter_header),
+        header_len - sizeof(struct serialized_filter_header));
+    checksum32 = crc32(checksum32, data, len);
+    header.checksum = htons(fold_checksum(checksum32));
+    memcpy(out, &header, sizeof(struct serialized_filter_header));
+}
 
 static void
-Filter_dealloc(Filter* self)
+write_header_fields(char *out, size_t header_len, int entries, double error, int layout, int hash,
+    const unsigned char *data, size_t len)
 {
-    bloom_free(self->_bloom_struct);
-    free(self->_bloom_struct);
-    self->ob_type->tp_free((PyObject*)self);
+    write_header_encoded(out, header_len, entries, error, layout, hash, ENCODING_RAW, data, len);
 }
 
-static PyObject *
-Filter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+/* write_header_fields for a filter's bit array */
+static void
+write_header(Filter *filter, char *out, size_t header_len, const unsigned char *data)
 {
-    Filter *self;
+    struct bloom *bloom_struct = filter->_bloom_struct;
 
-    self = (Filter *)type->tp_alloc(type, 0);
-    if (self != NULL) {
-        self->_bloom_struct = (struct bloom *)malloc(sizeof(struct bloom));
-        if (self->_bloom_struct == NULL)
-            return PyErr_NoMemory();
-    }
+    write_header_fields(out, header_len, bloom_struct->entries, bloom_struct->error, filter->layout,
+        filter->hash, data, bloom_struct->bytes);
+}
 
-    return (PyObject *)self;
+/* copies the filter data behind the header and fills in the header fields */
+static void
+serialize_filter(Filter *filter, char *out, size_t header_len)
+{
+    struct bloom *bloom_struct = filter->_bloom_struct;
+
+    /* checksum the copy, writers in other processes may not hold our lock */
+    memcpy(out + header_len, bloom_struct->bf, bloom_struct->bytes);
+    write_header(filter, out, header_len, (const unsigned char *)out + header_len);
 }
 
-static int
-Filter_init(Filter *self, PyObject *args, PyObject *kwargs)
+/* Rice codes the filter's set bits behind a v3 header of header_len bytes,
+ * if that comes to less than raw_len. Returns the length of the payload, 0
+ * when the filter is too full to gain anything. */
+static size_t
+serialize_compressed(Filter *filter, char *out, size_t header_len, size_t raw_len)
 {
-    static char *kwlist[] = {"entries", "error", "data", NULL};
-    int entries, success;
-    double error;
-    PyObject *buf_src = NULL;
-    Py_buffer buf;
-    struct bloom *bloom_struct;
+    struct bloom *bloom_struct = filter->_bloom_struct;
+    uint64_t nbits = (uint64_t)bloom_struct->bytes * 8, set, coded;
+    char *table = out + header_len;
+    size_t len;
+    int k;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "id|O", kwlist, &entries, &error, &buf_src)) {
-        return -1;
-    }
+    set = bits_count(bloom_struct->bf, bloom_struct->bytes);
+    k = rice_parameter(nbits, set);
+    if (set > UINT32_MAX || header_len + RICE_TABLE_SIZE + rice_bound(nbits, set, k) >= raw_len)
+        return 0;
 
-    bloom_struct = self->_bloom_struct;
-    success = bloom_init(bloom_struct, entries, error);
+    /* a writer in another process may set bits past the count */
+    len = rice_encode(bloom_struct->bf, bloom_struct->bytes, set, k,
+        (unsigned char *)table + RICE_TABLE_SIZE, &coded);
+    write_uint32(&table, (uint32_t)coded);
+    write_uint32(&table, (uint32_t)len);
+    memset(table, 0, 4);
+    *table = (char)k;
+    write_header_encoded(out, header_len, bloom_struct->entries, bloom_struct->error, filter->layout,
+        filter->hash, ENCODING_RICE, (const unsigned char *)out + header_len, RICE_TABLE_SIZE + len);
+    return header_len + RICE_TABLE_SIZE + len;
+}
 
-    if (success == 0) {
-        if (buf_src != NULL) {
-            if (!PyObject_CheckBuffer(buf_src)) {
-                PyErr_SetString(PyBlossomError, "buffer interface is not supported by provided data type");
-                return -1;
-            }
+static PyObject *
+filter_dump(Filter *filter, size_t align, int compress)
+{
+    PyObject *serial;
+    struct bloom *bloom_struct = filter->_bloom_struct;
+    size_t header_len, packed_len, len = 0;
 
-            if (PyObject_GetBuffer(buf_src, &buf, PyBUF_CONTIG_RO) < 0) {
-                PyErr_SetString(PyBlossomError, "could not get buffer from provided data type");
-                return -1;
-            }
+    header_len = header_size(filter, align);
+    packed_len = header_len < HEADER_V2_SIZE ? HEADER_V2_SIZE : header_len;
+    serial = PyBytes_FromStringAndSize(NULL, (compress ? packed_len : header_len) + bloom_struct->bytes);
+    if (serial == NULL) {
+        return NULL;
+    }
 
-            if ((int)buf.len != bloom_struct->bytes) {
-                PyErr_SetString(PyBlossomError, "invalid data length");
-                return -1;
-            }
-            memcpy(bloom_struct->bf, (const unsigned char *)buf.buf, 
-                bloom_struct->bytes);
-        }
-        return 0;
+    /* hold off writers so the checksum matches the copied data */
+    ENTER_FILTER(filter);
+    if (bloom_struct->bytes >= GIL_MINSIZE) {
+        BEGIN_FILTER_THREADS(filter)
+        if (compress)
+            len = serialize_compressed(filter, PyBytes_AS_STRING(serial), packed_len,
+                header_len + bloom_struct->bytes);
+        if (len == 0)
+            serialize_filter(filter, PyBytes_AS_STRING(serial), header_len);
+        END_FILTER_THREADS(filter)
     }
     else {
-        PyErr_SetString(PyBlossomError, "internal initialization failed");
-        return -1;
+        if (compress)
+            len = serialize_compressed(filter, PyBytes_AS_STRING(serial), packed_len,
+                header_len + bloom_struct->bytes);
+        if (len == 0)
+            serialize_filter(filter, PyBytes_AS_STRING(serial), header_len);
     }
+    LEAVE_FILTER(filter);
+
+    if (len == 0)
+        len = header_len + bloom_struct->bytes;
+    if ((Py_ssize_t)len != PyBytes_GET_SIZE(serial) && _PyBytes_Resize(&serial, len) < 0) {
+        return NULL;
+    }
+    return serial;
+}
+
+static PyObject *
+dump(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"filter", "align", "compress", NULL};
+    struct module_state *st = get_state(self);
+    Py_ssize_t align = 0;
+    int compress = 0;
+
+    Filter *filter;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|np", kwlist, &filter, &align, &compress)) {
+        return NULL;
+    }
+    if (align < 0 || align > HEADER_MAX_ALIGN) {
+        PyErr_Format(PyExc_ValueError, "align must be between 0 and %d", HEADER_MAX_ALIGN);
+        return NULL;
+    }
+    if (PyObject_TypeCheck((PyObject *)filter, st->counting_type)) {
+        return counting_dump((CountingFilter *)filter, align);
+    }
+    if (PyObject_TypeCheck((PyObject *)filter, st->scalable_type)) {
+        return scalable_dump((ScalableFilter *)filter, align);
+    }
+    if (PyObject_TypeCheck((PyObject *)filter, st->static_type)) {
+        return static_dump((StaticFilter *)filter, align);
+    }
+    if (PyObject_TypeCheck((PyObject *)filter, st->cuckoo_type)) {
+        return cuckoo_dump((CuckooFilter *)filter, align);
+    }
+    if (PyObject_TypeCheck((PyObject *)filter, st->sharded_type)) {
+        return sharded_dump((ShardedFilter *)filter, align, compress);
+    }
+    if (PyObject_TypeCheck((PyObject *)filter, st->rotating_type)) {
+        return rotating_dump((RotatingFilter *)filter, align, compress);
+    }
+    if (!PyObject_TypeCheck((PyObject *)filter, st->filter_type)) {
+        PyErr_SetString(PyExc_TypeError, "expected a pyblossom filter object");
+        return NULL;
+    }
+    return filter_dump(filter, align, compress);
+}
+
+static PyObject *
+dump_ex(PyObject *self, PyObject *args)
+{
+    Filter *filter;
+    struct bloom *bloom_struct;
+    PyObject *memview;
+
+    if (!PyArg_ParseTuple(args, "O!", get_state(self)->filter_type, &filter)) {
+        return NULL;
+    }
+
+    bloom_struct = filter->_bloom_struct;
+    memview = PyMemoryView_FromObject((PyObject *)filter);
+    if (memview == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue("idN", bloom_struct->entries, bloom_struct->error, memview);
+}
+
+/* streaming */
+static PyObject *
+dump_to(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"filter", "fileobj", "chunk_size", "align", NULL};
+    Filter *filter;
+    PyObject *fileobj, *write, *result;
+    Py_ssize_t chunk_size = STREAM_CHUNK, align = 0, offset, len, bytes;
+    struct bloom *bloom_struct;
+    size_t header_len;
+    char *header;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O|nn", kwlist, get_state(self)->filter_type, &filter,
+            &fileobj, &chunk_size, &align)) {
+        return NULL;
+    }
+    if (chunk_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+        return NULL;
+    }
+    if (align < 0 || align > HEADER_MAX_ALIGN) {
+        PyErr_Format(PyExc_ValueError, "align must be between 0 and %d", HEADER_MAX_ALIGN);
+        return NULL;
+    }
+    write = PyObject_GetAttrString(fileobj, "write");
+    if (write == NULL) {
+        return NULL;
+    }
+
+    if (filter->dump_owner == PyThread_get_thread_ident()) {
+        Py_DECREF(write);
+        PyErr_SetString(PyExc_RuntimeError, "dump_to is already streaming this filter");
+        return NULL;
+    }
+    if (filter->dump_lock == NULL && (filter->dump_lock = PyThread_allocate_lock()) == NULL) {
+        Py_DECREF(write);
+        return PyErr_NoMemory();
+    }
+
+    /* The checksum up front has to match the chunks streamed after it, so
+     * writers wait in filter_make_writable until the last one is out. No
+     * lock is held across write(), which may call back into the filter. */
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(filter->dump_lock, 1);
+    Py_END_ALLOW_THREADS
+    ENTER_FILTER(filter);
+    filter->dump_owner = PyThread_get_thread_ident();
+    filter->busy++;
+    bloom_struct = filter->_bloom_struct;
+    bytes = bloom_struct->bytes;
+    header_len = header_size(filter, align);
+    header = (char *)PyMem_Malloc(header_len);
+    if (header == NULL) {
+        PyErr_NoMemory();
+    }
+    else if (bytes >= GIL_MINSIZE) {
+        Py_BEGIN_ALLOW_THREADS
+        write_header(filter, header, header_len, bloom_struct->bf);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        write_header(filter, header, header_len, bloom_struct->bf);
+    }
+    LEAVE_FILTER(filter);
+
+    result = header != NULL ? PyObject_CallFunction(write, "y#", header, (Py_ssize_t)header_len) : NULL;
+    for (offset = 0; result != NULL && offset < bytes; offset += len) {
+        Py_DECREF(result);
+        len = bytes - offset;
+        if (len > chunk_size)
+            len = chunk_size;
+        result = PyObject_CallFunction(write, "y#", (const char *)bloom_struct->bf + offset, len);
+    }
+
+    ENTER_FILTER(filter);
+    filter->dump_owner = 0;
+    filter->busy--;
+    LEAVE_FILTER(filter);
+    PyThread_release_lock(filter->dump_lock);
+
+    PyMem_Free(header);
+    Py_DECREF(write);
+    if (result == NULL) {
+        return NULL;
+    }
+    Py_DECREF(result);
+    Py_RETURN_NONE;
+}
+
+/* reads exactly len bytes through read() into dest and folds them into crc */
+static int
+read_into(struct module_state *st, PyObject *read, char *dest, Py_ssize_t len, Py_ssize_t chunk_size,
+    uint32_t *crc)
+{
+    PyObject *chunk;
+    Py_ssize_t got, want;
+
+    while (len > 0) {
+        want = len < chunk_size ? len : chunk_size;
+        chunk = PyObject_CallFunction(read, "n", want);
+        if (chunk == NULL) {
+            return -1;
+        }
+        if (!PyBytes_Check(chunk)) {
+            Py_DECREF(chunk);
+            PyErr_SetString(PyExc_TypeError, "read() did not return bytes");
+            return -1;
+        }
+        got = PyBytes_GET_SIZE(chunk);
+        if (got == 0 || got > want) {
+            Py_DECREF(chunk);
+            PyErr_SetString(st->error, "incomplete payload");
+            return -1;
+        }
+        if (got >= GIL_MINSIZE) {
+            Py_BEGIN_ALLOW_THREADS
+            memcpy(dest, PyBytes_AS_STRING(chunk), got);
+            *crc = crc32(*crc, dest, got);
+            Py_END_ALLOW_THREADS
+        }
+        else {
+            memcpy(dest, PyBytes_AS_STRING(chunk), got);
+            *crc = crc32(*crc, dest, got);
+        }
+        Py_DECREF(chunk);
+        dest += got;
+        len -= got;
+    }
+    return 0;
 }
 
+static PyObject *
+load_from(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"fileobj", "chunk_size", NULL};
+    struct module_state *st = get_state(self);
+    PyObject *fileobj, *read, *filter = NULL;
+    Py_ssize_t chunk_size = STREAM_CHUNK;
+    struct filter_header header;
+    struct rice_table table;
+    char head[HEADER_V2_SIZE], *padding, *packed;
+    struct bloom *bloom_struct;
+    uint32_t crc = 0, unused = 0;
+    size_t v1_size = sizeof(struct serialized_filter_header);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", kwlist, &fileobj, &chunk_size)) {
+        return NULL;
+    }
+    if (chunk_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+        return NULL;
+    }
+    read = PyObject_GetAttrString(fileobj, "read");
+    if (read == NULL) {
+        return NULL;
+    }
+
+    if (read_into(st, read, head, v1_size, chunk_size, &unused) < 0) {
+        goto done;
+    }
+    decode_header(head, &header);
+    if (header.error_rate == 0) {
+        if (read_into(st, read, head + v1_size, HEADER_V2_SIZE - v1_size, chunk_size, &crc) < 0 ||
+                decode_header_ext(st, head + v1_size, &header) < 0) {
+            goto done;
+        }
+        if (header.header_len > HEADER_V2_SIZE) {
+            padding = (char *)PyMem_Malloc(header.header_len - HEADER_V2_SIZE);
+            if (padding == NULL) {
+                PyErr_NoMemory();
+                goto done;
+            }
+            if (read_into(st, read, padding, header.header_len - HEADER_V2_SIZE, chunk_size, &crc) < 0) {
+                PyMem_Free(padding);
+                goto done;
+            }
+            PyMem_Free(padding);
+        }
+    }
+
+    filter = instantiate_filter(st, header.cardinality, header.error_rate, header.layout, header.hash,
+        NULL, 0);
+    if (filter == NULL) {
+        goto done;
+    }
+    bloom_struct = ((Filter *)filter)->_bloom_struct;
+    if (header.encoding != ENCODING_RAW) {
+        if (read_into(st, read, head, RICE_TABLE_SIZE, chunk_size, &crc) < 0 ||
+                parse_rice_table(st, head, RICE_TABLE_SIZE, &table) < 0) {
+            Py_CLEAR(filter);
+            goto done;
+        }
+        packed = (char *)PyMem_Malloc(table.length + 1);
+        if (packed == NULL) {
+            PyErr_NoMemory();
+            Py_CLEAR(filter);
+            goto done;
+        }
+        if (read_into(st, read, packed, table.length, chunk_size, &crc) < 0 ||
+                decode_compressed(st, (Filter *)filter, &table, packed, table.length) < 0) {
+            Py_CLEAR(filter);
+        }
+        PyMem_Free(packed);
+        if (filter == NULL) {
+            goto done;
+        }
+    }
+    else if (read_into(st, read, (char *)bloom_struct->bf, bloom_struct->bytes, chunk_size, &crc) < 0) {
+        Py_CLEAR(filter);
+        goto done;
+    }
+    if (fold_checksum(crc) != header.checksum) {
+        PyErr_SetString(st->error, "checksum mismatch");
+        Py_CLEAR(filter);
+    }
+
+done:
+    Py_DECREF(read);
+    return filter;
+}
 
-#ifndef PyMODINIT_FUNC
-#define PyMODINIT_FUND void
+static PyObject *
+set_error_from_os(const char *path)
+{
+#ifdef _WIN32
+    return PyErr_SetFromWindowsErrWithFilename(0, path);
+#else
+    return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
 #endif
-PyMODINIT_FUNC
-initpyblossom(void)
-{
-    PyObject *m;
-    FilterType.tp_new = Filter_new;
-    FilterType.tp_init = (initproc)Filter_init;
-    FilterType.tp_methods = Filter_methods;
-    FilterType.tp_dealloc = (destructor)Filter_dealloc;
-    if (PyType_Ready(&FilterType) < 0)
+}
+
+static PyObject *
+open_mmap(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "writable", "verify", NULL};
+    struct module_state *st = get_state(self);
+    struct filter_header header;
+    const char *path;
+    int writable = 0, verify = 0, rc;
+    void *map;
+    size_t map_len;
+    uint16_t expected_checksum;
+    PyObject *filter;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|ii", kwlist, &path, &writable, &verify)) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = map_file(path, writable, &map, &map_len);
+    Py_END_ALLOW_THREADS
+    if (rc < 0) {
+        return set_error_from_os(path);
+    }
+
+    if (parse_header(st, (const char *)map, map_len, &header) < 0) {
+        goto error;
+    }
+    if (header.encoding != ENCODING_RAW) {
+        PyErr_SetString(st->error, "compressed filters cannot be mapped, use load()");
+        goto error;
+    }
+    if (verify) {
+        Py_BEGIN_ALLOW_THREADS
+        expected_checksum = compute_checksum((const char *)map + sizeof(struct serialized_filter_header),
+            map_len - sizeof(struct serialized_filter_header));
+        Py_END_ALLOW_THREADS
+        if (expected_checksum != header.checksum) {
+            PyErr_SetString(st->error, "checksum mismatch");
+            goto error;
+        }
+    }
+
+    filter = instantiate_filter(st, header.cardinality, header.error_rate, header.layout, header.hash,
+        NULL, 0);
+    if (filter == NULL) {
+        goto error;
+    }
+    if (filter_map((Filter *)filter, (char *)map, map_len, header.header_len, writable) < 0) {
+        Py_DECREF(filter);
+        goto error;
+    }
+    return filter;
+
+error:
+    unmap_file(map, map_len);
+    return NULL;
+}
+
+#ifdef HAVE_SHARED_MEMORY
+#define SHM_ALIGN 4096
+
+/* The creator of a shared filter writes its header last and the version
+ * byte of the extension, which always follows a SHM_ALIGN header, after
+ * all the rest; openers wait for that byte before parsing the header. */
+#define SHM_VERSION_OFFSET sizeof(struct serialized_filter_header)
+
+static void
+shm_publish(Filter *fresh, char *map, size_t header_len)
+{
+    char *header = (char *)PyMem_RawMalloc(header_len);
+    char version;
+
+    if (header == NULL) {
+        /* the bits are zero in both, only the header needs writing */
+        serialize_filter(fresh, map, header_len);
         return;
+    }
+    write_header(fresh, header, header_len, fresh->_bloom_struct->bf);
+    version = header[SHM_VERSION_OFFSET];
+    memcpy(map, header, SHM_VERSION_OFFSET);
+    memcpy(map + SHM_VERSION_OFFSET + 1, header + SHM_VERSION_OFFSET + 1, header_len - SHM_VERSION_OFFSET - 1);
+    __atomic_store_n(map + SHM_VERSION_OFFSET, version, __ATOMIC_RELEASE);
+    PyMem_RawFree(header);
+}
+
+/* waits for the creator of a shared filter to publish its header, returns
+ * -1 if it never does */
+static int
+shm_wait_header(const char *map, size_t map_len)
+{
+    int tries;
+
+    if (map_len <= SHM_VERSION_OFFSET)
+        return 0;
+    for (tries = 0; tries < SHM_WAIT_TRIES; tries++) {
+        if (__atomic_load_n(map + SHM_VERSION_OFFSET, __ATOMIC_ACQUIRE) != 0)
+            return 0;
+        shm_pause();
+    }
+    return -1;
+}
+
+static PyObject *
+open_shm(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"name", "entries", "error", "layout", "hash", NULL};
+    struct module_state *st = get_state(self);
+    struct filter_header header;
+    const char *name, *layout_name = NULL, *hash_name = NULL;
+    int entries = 0, created, rc, ready = 0;
+    double error = 0;
+    size_t header_len = 0, len = 0, map_len;
+    void *map;
+    Filter *fresh = NULL;
+    PyObject *filter;
+    struct bloom *want;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|idzz", kwlist, &name, &entries, &error,
+            &layout_name, &hash_name)) {
+        return NULL;
+    }
+
+    /* a filter to size and initialize the object with, should it not exist yet */
+    if (entries > 0) {
+        fresh = (Filter *)PyObject_CallFunction((PyObject *)st->filter_type, "idOziz", entries, error,
+            Py_None, layout_name, 0, hash_name);
+        if (fresh == NULL) {
+            return NULL;
+        }
+        header_len = header_size(fresh, SHM_ALIGN);
+        len = header_len + fresh->_bloom_struct->bytes;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = map_shm(name, len, &map, &map_len, &created);
+    if (rc == 0 && created)
+        shm_publish(fresh, (char *)map, header_len);
+    else if (rc == 0)
+        ready = shm_wait_header((const char *)map, map_len);
+    Py_END_ALLOW_THREADS
+    if (rc < 0) {
+        Py_XDECREF(fresh);
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *)name);
+    }
+    if (ready < 0) {
+        PyErr_Format(st->error, "shared filter %s was never initialized", name);
+        goto error;
+    }
+
+    if (parse_header(st, (const char *)map, map_len, &header) < 0) {
+        goto error;
+    }
+    if (fresh != NULL && !created) {
+        want = fresh->_bloom_struct;
+        if (header.cardinality != (uint32_t)want->entries || header.error_rate != (uint16_t)(1.0 / want->error) ||
+                header.layout != fresh->layout || header.hash != fresh->hash) {
+            PyErr_Format(st->error, "shared filter %s exists with other entries, error, layout or hash", name);
+            goto error;
+        }
+    }
+    Py_CLEAR(fresh);
+    if (header.encoding != ENCODING_RAW) {
+        PyErr_SetString(st->error, "compressed filters cannot be mapped, use load()");
+        goto error;
+    }
+    filter = instantiate_filter(st, header.cardinality, header.error_rate, header.layout, header.hash,
+        NULL, 0);
+    if (filter == NULL) {
+        goto error;
+    }
+    if (filter_map((Filter *)filter, (char *)map, map_len, header.header_len, 1) < 0) {
+        Py_DECREF(filter);
+        goto error;
+    }
+    return filter;
+
+error:
+    Py_XDECREF(fresh);
+    unmap_file(map, map_len);
+    return NULL;
+}
+
+static PyObject *
+unlink_shm(PyObject *self, PyObject *args)
+{
+    const char *name;
+
+    if (!PyArg_ParseTuple(args, "s", &name)) {
+        return NULL;
+    }
+    if (shm_unlink(name) < 0) {
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, (char *)name);
+    }
+    Py_RETURN_NONE;
+}
+#endif
+
+static PyObject *merge(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *load_shards(PyObject *self, PyObject *args);
+static int find_name(const char **names, const char *name, const char *what);
+
+/* the keys of a batch call as parallel pointer/length arrays */
+struct key_batch {
+    PyObject *seq;              /* the keys, in a list or tuple no other code can change */
+    Py_buffer view;             /* typed array the keys were read from, if view.obj is set */
+    const char **ptrs;
+    Py_ssize_t *lens;
+    uint64_t *ints;             /* storage of integer keys in a sequence */
+    Py_ssize_t count;
+};
+
+static int get_key(PyObject *item, const char **buffer, Py_ssize_t *buflen, uint64_t *scratch);
+static int collect_keys(struct module_state *st, PyObject *keys, Py_ssize_t width, struct key_batch *batch);
+static void release_keys(struct key_batch *batch);
+
+/* prehashing */
+/* A digest travels as one 64 bit integer, the first probe hash in the low
+ * half. It is only meaningful to filters using the hash it was made with. */
+static uint64_t
+pack_digest(const struct digest *digest)
+{
+    return (uint64_t)digest->a | ((uint64_t)digest->b << 32);
+}
+
+static void
+unpack_digest(uint64_t packed, struct digest *digest)
+{
+    digest->a = (uint32_t)packed;
+    digest->b = (uint32_t)(packed >> 32);
+}
+
+static PyObject *
+hash_key(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"key", "hash", NULL};
+    PyObject *item;
+    const char *key, *hash_name = NULL;
+    Py_ssize_t len;
+    uint64_t scratch;
+    struct digest digest;
+    int hash = HASH_MURMUR2;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|z", kwlist, &item, &hash_name)) {
+        return NULL;
+    }
+    if (hash_name != NULL && (hash = find_name(hash_names, hash_name, "hash")) < 0) {
+        return NULL;
+    }
+    if (get_key(item, &key, &len, &scratch) < 0) {
+        return NULL;
+    }
+    digest_key(hash, key, len, &digest);
+    return PyLong_FromUnsignedLongLong(pack_digest(&digest));
+}
+
+static void
+hash_keys(int hash, const struct key_batch *batch, uint64_t *out)
+{
+    struct digest digest;
+    Py_ssize_t i;
+
+    for (i = 0; i < batch->count; i++) {
+        digest_key(hash, batch->ptrs[i], batch->lens[i], &digest);
+        out[i] = pack_digest(&digest);
+    }
+}
+
+static PyObject *
+hash_many(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"keys", "width", "hash", NULL};
+    PyObject *keys, *result;
+    Py_ssize_t width = 0;
+    const char *hash_name = NULL;
+    struct key_batch batch;
+    uint64_t *out;
+    int hash = HASH_MURMUR2;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|nz", kwlist, &keys, &width, &hash_name)) {
+        return NULL;
+    }
+    if (hash_name != NULL && (hash = find_name(hash_names, hash_name, "hash")) < 0) {
+        return NULL;
+    }
+
+    if (collect_keys(get_state(self), keys, width, &batch) < 0) {
+        return NULL;
+    }
+
+    result = PyBytes_FromStringAndSize(NULL, batch.count * sizeof(uint64_t));
+    if (result != NULL) {
+        out = (uint64_t *)PyBytes_AS_STRING(result);
+        if (batch.count >= GIL_MINKEYS) {
+            Py_BEGIN_ALLOW_THREADS
+            hash_keys(hash, &batch, out);
+            Py_END_ALLOW_THREADS
+        }
+        else {
+            hash_keys(hash, &batch, out);
+        }
+    }
+
+    release_keys(&batch);
+    return result;
+}
+
+/* background I/O */
+#define TASK_LOAD 0
+#define TASK_DUMP 1
+
+/* A load_async or dump_async call. Its thread runs with a thread state of
+ * its own; load and dump drop the GIL around checksums, copies and file
+ * I/O, so the loop's thread keeps running meanwhile. */
+struct async_task {
+    int kind;                   /* TASK_* */
+    PyInterpreterState *interp;
+    PyObject *module;
+    PyObject *loop;
+    PyObject *future;
+    PyObject *path;             /* bytes, from PyUnicode_FSConverter */
+    PyObject *filter;           /* the filter of TASK_DUMP */
+    PyObject *kwargs;           /* for load() or dump() */
+};
 
-    m = Py_InitModule3("pyblossom", module_methods, module_docstring);
-    Py_INCREF(&FilterType);
-    PyModule_AddObject(m, "Filter", (PyObject *)&FilterType);
+static void
+async_task_free(struct async_task *task)
+{
+    Py_DECREF(task->module);
+    Py_DECREF(task->loop);
+    Py_DECREF(task->future);
+    Py_DECREF(task->path);
+    Py_XDECREF(task->filter);
+    Py_DECREF(task->kwargs);
+    PyMem_RawFree(task);
+}
+
+/* load() of a mapping of the file, copied so the mapping can go right away */
+static PyObject *
+async_load(struct async_task *task)
+{
+    const char *path = PyBytes_AS_STRING(task->path);
+    PyObject *view, *args, *result;
+    void *map;
+    size_t map_len;
+    int rc;
+
+    Py_BEGIN_ALLOW_THREADS
+    rc = map_file(path, 0, &map, &map_len);
+    if (rc == 0)
+        advise_sequential(map, map_len);
+    Py_END_ALLOW_THREADS
+    if (rc < 0) {
+        return set_error_from_os(path);
+    }
+    view = PyMemoryView_FromMemory((char *)map, map_len, PyBUF_READ);
+    args = view != NULL ? PyTuple_Pack(1, view) : NULL;
+    result = args != NULL ? load(task->module, args, task->kwargs) : NULL;
+    Py_XDECREF(args);
+    Py_XDECREF(view);
+    unmap_file(map, map_len);
+    return result;
+}
+
+static PyObject *
+async_dump(struct async_task *task)
+{
+    const char *path = PyBytes_AS_STRING(task->path);
+    PyObject *args, *serial;
+    int rc;
+
+    args = PyTuple_Pack(1, task->filter);
+    if (args == NULL) {
+        return NULL;
+    }
+    serial = dump(task->module, args, task->kwargs);
+    Py_DECREF(args);
+    if (serial == NULL) {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    rc = replace_file(path, PyBytes_AS_STRING(serial), PyBytes_GET_SIZE(serial));
+    Py_END_ALLOW_THREADS
+    Py_DECREF(serial);
+    if (rc < 0) {
+        return set_error_from_os(path);
+    }
+    Py_RETURN_NONE;
+}
+
+/* sets the outcome of a task on its future, on the loop's thread */
+static PyObject *
+async_settle(PyObject *self, PyObject *args)
+{
+    PyObject *future, *value, *cancelled;
+    int ok;
+
+    if (!PyArg_ParseTuple(args, "OpO", &future, &ok, &value)) {
+        return NULL;
+    }
+    cancelled = PyObject_CallMethod(future, "cancelled", NULL);
+    if (cancelled == NULL) {
+        return NULL;
+    }
+    if (PyObject_IsTrue(cancelled)) {
+        Py_DECREF(cancelled);
+        Py_RETURN_NONE;
+    }
+    Py_DECREF(cancelled);
+    return PyObject_CallMethod(future, ok ? "set_result" : "set_exception", "O", value);
+}
 
-    PyBlossomError = PyErr_NewException("pyblossom.error", NULL, NULL);
-    Py_INCREF(PyBlossomError);
-    PyModule_AddObject(m, "error", PyBlossomError);
+static PyMethodDef async_settle_def = {"settle", (PyCFunction)async_settle, METH_VARARGS, NULL};
+
+static void
+async_thread(void *arg)
+{
+    struct async_task *task = (struct async_task *)arg;
+    PyThreadState *tstate;
+    PyObject *value, *settle, *handle;
+    int ok;
+
+    tstate = PyThreadState_New(task->interp);
+    if (tstate == NULL) {
+        return;
+    }
+    PyEval_RestoreThread(tstate);
+
+    value = task->kind == TASK_LOAD ? async_load(task) : async_dump(task);
+    ok = value != NULL;
+    if (!ok) {
+#if PY_VERSION_HEX >= 0x030C0000
+        value = PyErr_GetRaisedException();
+#else
+        PyObject *type, *traceback;
+
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        if (traceback != NULL)
+            PyException_SetTraceback(value, traceback);
+        Py_XDECREF(type);
+        Py_XDECREF(traceback);
+#endif
+    }
+    settle = PyCFunction_NewEx(&async_settle_def, NULL, NULL);
+    handle = settle != NULL ? PyObject_CallMethod(task->loop, "call_soon_threadsafe", "OOOO", settle,
+        task->future, ok ? Py_True : Py_False, value) : NULL;
+    if (handle == NULL) {
+        /* the loop is closed, nobody is waiting for the future */
+        PyErr_Clear();
+    }
+    Py_XDECREF(handle);
+    Py_XDECREF(settle);
+    Py_XDECREF(value);
+    async_task_free(task);
+
+    PyThreadState_Clear(tstate);
+    PyThreadState_DeleteCurrent();
+}
+
+/* starts a task on a thread of its own, returns the future of the running
+ * loop it resolves */
+static PyObject *
+async_start(PyObject *self, int kind, PyObject *path, PyObject *filter, PyObject *kwargs)
+{
+    PyObject *asyncio, *loop = NULL, *future = NULL;
+    struct async_task *task;
+
+    if (kwargs == NULL) {
+        Py_DECREF(path);
+        return NULL;
+    }
+    asyncio = PyImport_ImportModule("asyncio");
+    if (asyncio != NULL) {
+        loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+        Py_DECREF(asyncio);
+    }
+    if (loop != NULL) {
+        future = PyObject_CallMethod(loop, "create_future", NULL);
+    }
+    task = future != NULL ? (struct async_task *)PyMem_RawMalloc(sizeof(struct async_task)) : NULL;
+    if (task == NULL) {
+        if (future != NULL)
+            PyErr_NoMemory();
+        Py_XDECREF(future);
+        Py_XDECREF(loop);
+        Py_DECREF(path);
+        Py_DECREF(kwargs);
+        return NULL;
+    }
+
+    task->kind = kind;
+    task->interp = PyInterpreterState_Get();
+    task->module = self;
+    task->loop = loop;
+    task->future = future;
+    task->path = path;
+    task->filter = filter;
+    task->kwargs = kwargs;
+    Py_INCREF(self);
+    Py_INCREF(future);
+    Py_XINCREF(filter);
+    if (PyThread_start_new_thread(async_thread, task) == PYTHREAD_INVALID_THREAD_ID) {
+        async_task_free(task);
+        Py_DECREF(future);
+        PyErr_SetString(PyExc_RuntimeError, "can't start new thread");
+        return NULL;
+    }
+    return future;
+}
+
+static PyObject *
+load_async(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "verify", NULL};
+    PyObject *path;
+    int verify = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|p", kwlist, PyUnicode_FSConverter, &path, &verify)) {
+        return NULL;
+    }
+    return async_start(self, TASK_LOAD, path, NULL, Py_BuildValue("{s:i}", "verify", verify));
+}
+
+static PyObject *
+dump_async(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"filter", "path", "align", "compress", NULL};
+    PyObject *filter, *path;
+    Py_ssize_t align = 0;
+    int compress = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO&|np", kwlist, &filter, PyUnicode_FSConverter, &path,
+            &align, &compress)) {
+        return NULL;
+    }
+    return async_start(self, TASK_DUMP, path, filter,
+        Py_BuildValue("{s:n,s:i}", "align", align, "compress", compress));
+}
+
+static PyMethodDef module_methods[] = {
+    {"load", (PyCFunction)load, METH_VARARGS | METH_KEYWORDS,
+     "load a serialized filter; with copy=False the filter probes the payload in place "
+     "and copies it only on the first write, verify=False skips the checksum; "
+     "payloads of the other filter kinds are always copied"},
+    {"dump", (PyCFunction)dump, METH_VARARGS | METH_KEYWORDS,
+     "dump a filter into a string; align=N pads the (then extended) header so the data "
+     "starts at a multiple of N, e.g. align=mmap.PAGESIZE for open_mmap; compress=True "
+     "Rice codes the bits of a sparse Filter when that is smaller"},
+    {"dump_ex", (PyCFunction)dump_ex, METH_VARARGS,
+     "dump a filter and return it as memory view with params (without crc32 check)"},
+    {"hash", (PyCFunction)hash_key, METH_VARARGS | METH_KEYWORDS,
+     "digest a key once for add_hashed and contains_hashed, with hash as used by the filters"},
+    {"hash_many", (PyCFunction)hash_many, METH_VARARGS | METH_KEYWORDS,
+     "digest keys as hash does, returns a buffer of native uint64 digests"},
+    {"merge", (PyCFunction)merge, METH_VARARGS | METH_KEYWORDS,
+     "return a new filter holding the union of an iterable of compatible filters, "
+     "threads=N splits the bits between N threads"},
+    {"load_shards", (PyCFunction)load_shards, METH_VARARGS,
+     "rebuild a ShardedFilter from the manifest of dump_shards and its shards as Filters, "
+     "e.g. loaded in parallel or mapped with open_mmap"},
+    {"dump_to", (PyCFunction)dump_to, METH_VARARGS | METH_KEYWORDS,
+     "stream a dumped filter to fileobj.write() in chunk_size pieces, writers block "
+     "until it is done"},
+    {"load_from", (PyCFunction)load_from, METH_VARARGS | METH_KEYWORDS,
+     "read a dumped filter from fileobj.read() in chunk_size pieces, straight into "
+     "the new filter's bits"},
+    {"load_async", (PyCFunction)load_async, METH_VARARGS | METH_KEYWORDS,
+     "load the filter dumped to the file at path on a thread of its own, returns a future of "
+     "the running asyncio loop; verify=False skips the checksum"},
+    {"dump_async", (PyCFunction)dump_async, METH_VARARGS | METH_KEYWORDS,
+     "dump a filter to the file at path on a thread of its own, through a temporary file "
+     "renamed over it; returns a future of the running asyncio loop, align and compress "
+     "are as for dump()"},
+    {"open_mmap", (PyCFunction)open_mmap, METH_VARARGS | METH_KEYWORDS,
+     "open a dumped filter file as a shared memory mapping; pages load lazily and are shared "
+     "by every process mapping the file. writable=True writes adds through to the file "
+     "(call flush() to update its checksum), otherwise the first add makes a private copy. "
+     "verify=True checks the checksum up front"},
+#ifdef HAVE_SHARED_MEMORY
+    {"open_shm", (PyCFunction)open_shm, METH_VARARGS | METH_KEYWORDS,
+     "open the filter in the POSIX shared memory object name, creating it with entries, "
+     "error, layout and hash if it does not exist yet; all processes add to it atomically"},
+    {"unlink_shm", (PyCFunction)unlink_shm, METH_VARARGS,
+     "remove a shared memory filter name, mappings already open stay valid"},
+#endif
+    {NULL}
+};
+
+/* storage */
+/* frees the bit array, whoever allocated it */
+static void
+filter_release_storage(Filter *self)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+
+    if (self->storage == STORAGE_ALIGNED) {
+        aligned_free(bloom_struct->bf);
+        bloom_struct->bf = NULL;
+    }
+    else if (self->storage != STORAGE_LIBBLOOM) {
+        bloom_struct->bf = NULL;
+    }
+    self->storage = STORAGE_LIBBLOOM;
+    self->atomic = 0;
+    bloom_free(bloom_struct);
+    if (self->source.obj != NULL) {
+        PyBuffer_Release(&self->source);
+    }
+    if (self->map != NULL) {
+        unmap_file(self->map, self->map_len);
+        self->map = NULL;
+    }
+}
+
+/* Points the filter at data that lives at offset in source, which the
+ * filter takes over. */
+static int
+filter_borrow(Filter *self, Py_buffer *source, size_t offset)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+
+    if (source->len - offset != (size_t)bloom_struct->bytes) {
+        PyErr_SetString(OBJECT_STATE(self)->error, "invalid data length");
+        return -1;
+    }
+    filter_release_storage(self);
+    bloom_struct->bf = (unsigned char *)source->buf + offset;
+    bloom_struct->ready = 1;
+    self->storage = STORAGE_BUFFER;
+    self->source = *source;
+    return 0;
+}
+
+/* Points the filter at data that lives at offset in a file mapping, which
+ * the filter takes over. */
+static int
+filter_map(Filter *self, char *map, size_t map_len, size_t offset, int writable)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+
+    if (map_len - offset != (size_t)bloom_struct->bytes) {
+        PyErr_SetString(OBJECT_STATE(self)->error, "invalid data length");
+        return -1;
+    }
+    filter_release_storage(self);
+    bloom_struct->bf = (unsigned char *)map + offset;
+    bloom_struct->ready = 1;
+    self->storage = STORAGE_MAPPED;
+    self->map = map;
+    self->map_len = map_len;
+    self->map_writable = writable;
+    self->atomic = writable;
+    return 0;
+}
+
+#ifdef HAVE_SHARED_MEMORY
+/* Moves the bit array into anonymous shared memory, so that processes forked
+ * from here on all see and atomically update the same bits. */
+static int
+filter_share(Filter *self)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+    size_t map_len = ((size_t)bloom_struct->bytes + 7) & ~(size_t)7;
+    char *map;
+
+    map = (char *)map_anonymous(map_len);
+    if (map == NULL) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    memcpy(map, bloom_struct->bf, bloom_struct->bytes);
+    filter_release_storage(self);
+    bloom_struct->bf = (unsigned char *)map;
+    bloom_struct->ready = 1;
+    self->storage = STORAGE_SHARED;
+    self->map = map;
+    self->map_len = map_len;
+    self->map_writable = 1;
+    self->atomic = 1;
+    return 0;
+}
+#endif
+
+/* With the filter lock held, waits for a dump_to streaming the filter to
+ * finish, giving the lock up meanwhile. Needs no GIL. */
+static void
+filter_wait_dump(Filter *self)
+{
+    while (self->dump_owner != 0) {
+        PyThread_release_lock(self->lock);
+        PyThread_acquire_lock(self->dump_lock, 1);
+        PyThread_release_lock(self->dump_lock);
+        PyThread_acquire_lock(self->lock, 1);
+    }
+}
+
+/* Writers wait in here while dump_to streams the filter, which holds no
+ * lock across its write() calls. Gives a filter that borrows its bits
+ * read-only a private copy before the first write, so the borrowed buffer or mapping is never modified. It stays
+ * referenced until the filter goes away, as readers without the GIL may
+ * still be probing it. Exported buffers would keep showing the old bits, so
+ * that fails while there are any. */
+static int
+filter_make_writable(Filter *self)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+    unsigned char *bf;
+
+    if (self->dump_owner != 0) {
+        if (self->dump_owner == PyThread_get_thread_ident()) {
+            PyErr_SetString(PyExc_RuntimeError, "cannot write to a filter while dump_to streams it");
+            return -1;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        filter_wait_dump(self);
+        Py_END_ALLOW_THREADS
+    }
+    if (self->storage != STORAGE_BUFFER &&
+            (self->storage != STORAGE_MAPPED || self->map_writable)) {
+        return 0;
+    }
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+            "cannot write to a read-only filter while its buffer is exported");
+        return -1;
+    }
+    bf = (unsigned char *)aligned_calloc(bloom_struct->bytes, BLOCK_BYTES);
+    if (bf == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(bf, bloom_struct->bf, bloom_struct->bytes);
+    bloom_struct->bf = bf;
+    self->storage = STORAGE_ALIGNED;
+    return 0;
+}
+
+/* Rounds the bit array up to whole blocks and moves it to cache-line-aligned
+ * storage, so no block straddles two cache lines. */
+static int
+filter_allocate_blocked(Filter *self, int block_bytes)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+    int block_bits = block_bytes * 8;
+    int blocks = (bloom_struct->bits + block_bits - 1) / block_bits;
+    unsigned char *bf;
+
+    bf = (unsigned char *)aligned_calloc((size_t)blocks * block_bytes, BLOCK_BYTES);
+    if (bf == NULL) {
+        return -1;
+    }
+    free(bloom_struct->bf);
+    bloom_struct->bf = bf;
+    bloom_struct->bits = blocks * block_bits;
+    bloom_struct->bytes = blocks * block_bytes;
+    self->storage = STORAGE_ALIGNED;
+    return 0;
+}
+
+/* Filter methods */
+
+/* marks the chunks an add of digest wrote to, for the next dump_delta */
+static void
+filter_mark_dirty(Filter *self, struct digest *digest, int atomic)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+
+    switch (self->layout) {
+    case LAYOUT_BLOCKED:
+        delta_mark(self->dirty, (size_t)fastrange32(digest->a, bloom_struct->bits / BLOCK_BITS) *
+            BLOCK_BYTES, atomic);
+        break;
+    case LAYOUT_SPLIT:
+        delta_mark(self->dirty, (size_t)fastrange32(digest->a, bloom_struct->bits / SPLIT_BLOCK_BITS) *
+            SPLIT_BLOCK_BYTES, atomic);
+        break;
+    default:
+        delta_mark_standard(self->dirty, bloom_struct->bits, bloom_struct->hashes, digest, atomic);
+    }
+}
+
+/* Probes a key digest in the filter's layout, returns 1 if all its bits
+ * were set. add is a PROBE_* mode, PROBE_ATOMIC_ADD for threads sharing
+ * the filter; adds to shared filters are always atomic. */
+static int
+filter_probe(Filter *self, struct digest *digest, int add)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+    int mode = add, present;
+
+    if (add && self->atomic) {
+        mode = PROBE_ATOMIC_ADD;
+    }
+
+    switch (self->layout) {
+    case LAYOUT_SPLIT:
+        if (mode == PROBE_ATOMIC_ADD)
+            present = split_check_add_scalar(bloom_struct->bf, bloom_struct->bits / SPLIT_BLOCK_BITS,
+                digest, mode);
+        else
+            present = split_check_add(bloom_struct->bf, bloom_struct->bits / SPLIT_BLOCK_BITS,
+                digest, mode);
+        break;
+    default:
+        present = self->probe(bloom_struct->bf, bloom_struct->bits, self->reciprocal, bloom_struct->hashes,
+            digest, mode);
+    }
+    if (add && !present && self->dirty != NULL) {
+        filter_mark_dirty(self, digest, mode == PROBE_ATOMIC_ADD);
+    }
+    return present;
+}
+
+/* prefetches the bytes filter_probe is going to touch for digest */
+static void
+filter_prefetch(Filter *self, const struct digest *digest, int rw)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+    uint32_t i, x = digest->a;
+
+    switch (self->layout) {
+    case LAYOUT_BLOCKED:
+        PREFETCH(bloom_struct->bf + (size_t)fastrange32(digest->a, bloom_struct->bits / BLOCK_BITS) *
+            BLOCK_BYTES, rw);
+        break;
+    case LAYOUT_SPLIT:
+        PREFETCH(bloom_struct->bf + (size_t)fastrange32(digest->a, bloom_struct->bits / SPLIT_BLOCK_BITS) *
+            SPLIT_BLOCK_BYTES, rw);
+        break;
+    default:
+        for (i = 0; i < (uint32_t)bloom_struct->hashes; i++, x += digest->b) {
+            PREFETCH(bloom_struct->bf + (fastmod32(x, self->reciprocal, bloom_struct->bits) >> 3), rw);
+        }
+    }
+}
+
+/* probes a key in the filter's layout as filter_probe does, returns 1 if
+ * all its bits were set */
+static int
+filter_check_add(Filter *self, const char *key, Py_ssize_t len, int add)
+{
+    struct digest digest;
+
+    digest_key(self->hash, key, len, &digest);
+    return filter_probe(self, &digest, add);
+}
+
+static PyObject *
+Filter_add(Filter *self, PyObject *key)
+{
+    const char *buffer;
+    Py_ssize_t buflen;
+    uint64_t scratch;
+    if (get_key(key, &buffer, &buflen, &scratch) < 0) {
+        return NULL;
+    }
+
+    ENTER_FILTER(self);
+    if (filter_make_writable(self) < 0) {
+        LEAVE_FILTER(self);
+        return NULL;
+    }
+    filter_check_add(self, buffer, buflen, 1);
+    self->adds++;
+    LEAVE_FILTER(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Filter_check(Filter *self, PyObject *key)
+{
+    const char *buffer;
+    Py_ssize_t buflen;
+    uint64_t scratch;
+    if (get_key(key, &buffer, &buflen, &scratch) < 0) {
+        return NULL;
+    }
+
+    if (filter_check_add(self, buffer, buflen, 0)) {
+        self->positives++;
+        Py_RETURN_TRUE;
+    }
+    self->negatives++;
+    Py_RETURN_FALSE;
+}
+
+/* batch helpers */
+/* An integer key is hashed as its 8 native bytes, the same bytes an int64
+ * or uint64 array element holds; negative ones as two's complement. */
+static int
+get_int_key(PyObject *item, uint64_t *value)
+{
+    PyObject *number;
+    PY_LONG_LONG signed_value;
+    int overflow;
+
+    number = PyNumber_Index(item);
+    if (number == NULL) {
+        return -1;
+    }
+    signed_value = PyLong_AsLongLongAndOverflow(number, &overflow);
+    if (overflow > 0) {
+        *value = PyLong_AsUnsignedLongLong(number);
+    }
+    else if (overflow < 0) {
+        PyErr_SetString(PyExc_OverflowError, "integer keys must fit in 64 bits");
+    }
+    else {
+        *value = (uint64_t)signed_value;
+    }
+    Py_DECREF(number);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/* Points *buffer at the bytes of a key, str keys are hashed as UTF-8.
+ * Integer keys are stored in scratch, which must outlive the use of
+ * *buffer. */
+static int
+get_key(PyObject *item, const char **buffer, Py_ssize_t *buflen, uint64_t *scratch)
+{
+    if (PyBytes_CheckExact(item)) {
+        *buffer = PyBytes_AS_STRING(item);
+        *buflen = PyBytes_GET_SIZE(item);
+        return 0;
+    }
+    if (PyUnicode_CheckExact(item)) {
+        *buffer = PyUnicode_AsUTF8AndSize(item, buflen);
+        return *buffer != NULL ? 0 : -1;
+    }
+    if (PyIndex_Check(item)) {
+        if (get_int_key(item, scratch) < 0) {
+            return -1;
+        }
+        *buffer = (const char *)scratch;
+        *buflen = sizeof(uint64_t);
+        return 0;
+    }
+    return PyArg_Parse(item, "y#", buffer, buflen) ? 0 : -1;
+}
+
+/* Whether a buffer holds native 64 bit integers whose raw bytes get_int_key
+ * would produce for each element. */
+static int
+is_int64_view(const Py_buffer *view)
+{
+    const char *format = view->format;
+
+    if (view->itemsize != sizeof(uint64_t) || format == NULL) {
+        return 0;
+    }
+#ifdef HASH_BIG_ENDIAN
+    if (*format == '@' || *format == '=' || *format == '>' || *format == '!') {
+#else
+    if (*format == '@' || *format == '=' || *format == '<') {
+#endif
+        format++;
+    }
+    return strcmp(format, "q") == 0 || strcmp(format, "Q") == 0 ||
+           strcmp(format, "l") == 0 || strcmp(format, "L") == 0;
+}
+
+/* Splits either a fixed-width buffer (width > 0), a typed array of 64 bit
+ * integers or a sequence of keys into batch. On success the caller must
+ * release_keys the batch. */
+static int
+collect_keys(struct module_state *st, PyObject *keys, Py_ssize_t width, struct key_batch *batch)
+{
+    PyObject *item;
+    Py_ssize_t i, count;
+    const char *buffer = NULL;
+    Py_ssize_t buflen = 0;
+
+    memset(batch, 0, sizeof(struct key_batch));
+
+    if (width < 0) {
+        PyErr_SetString(PyExc_ValueError, "width must not be negative");
+        return -1;
+    }
+    if (width == 0 && !PyBytes_Check(keys) && PyObject_CheckBuffer(keys)) {
+        if (PyObject_GetBuffer(keys, &batch->view, PyBUF_FORMAT | PyBUF_C_CONTIGUOUS) < 0) {
+            PyErr_Clear();
+            batch->view.obj = NULL;
+        }
+        else if (!is_int64_view(&batch->view)) {
+            PyBuffer_Release(&batch->view);
+            batch->view.obj = NULL;
+        }
+        else {
+            buffer = (const char *)batch->view.buf;
+            buflen = batch->view.len;
+            width = sizeof(uint64_t);
+        }
+    }
+    if (batch->view.obj == NULL && width > 0) {
+        if (PyObject_GetBuffer(keys, &batch->view, PyBUF_C_CONTIGUOUS) < 0) {
+            batch->view.obj = NULL;
+            return -1;
+        }
+        buffer = (const char *)batch->view.buf;
+        buflen = batch->view.len;
+        if (buflen % width) {
+            PyBuffer_Release(&batch->view);
+            batch->view.obj = NULL;
+            PyErr_SetString(st->error, "buffer length is not a multiple of width");
+            return -1;
+        }
+    }
+    if (width > 0) {
+        count = buflen / width;
+    }
+    else {
+        batch->seq = PySequence_Fast(keys, "keys must be an iterable");
+        if (batch->seq == NULL) {
+            return -1;
+        }
+        /* the caller's own list, any thread could drop keys from it while the GIL is released */
+        if (batch->seq == keys && PyList_Check(keys)) {
+            Py_SETREF(batch->seq, PyList_AsTuple(keys));
+            if (batch->seq == NULL) {
+                return -1;
+            }
+        }
+        count = PySequence_Fast_GET_SIZE(batch->seq);
+    }
+
+    batch->count = count;
+    batch->ptrs = (const char **)PyMem_Malloc((count + 1) * sizeof(const char *));
+    batch->lens = (Py_ssize_t *)PyMem_Malloc((count + 1) * sizeof(Py_ssize_t));
+    if (batch->ptrs == NULL || batch->lens == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (width > 0) {
+            batch->ptrs[i] = buffer + i * width;
+            batch->lens[i] = width;
+            continue;
+        }
+        item = PySequence_Fast_GET_ITEM(batch->seq, i);
+        if (batch->ints == NULL && PyIndex_Check(item)) {
+            batch->ints = (uint64_t *)PyMem_Malloc(count * sizeof(uint64_t));
+            if (batch->ints == NULL) {
+                PyErr_NoMemory();
+                goto error;
+            }
+        }
+        if (get_key(item, &batch->ptrs[i], &batch->lens[i],
+                batch->ints != NULL ? batch->ints + i : NULL) < 0) {
+            goto error;
+        }
+    }
+    return 0;
+
+error:
+    release_keys(batch);
+    return -1;
+}
+
+static void
+release_keys(struct key_batch *batch)
+{
+    PyMem_Free(batch->ptrs);
+    PyMem_Free(batch->lens);
+    PyMem_Free(batch->ints);
+    if (batch->view.obj != NULL) {
+        PyBuffer_Release(&batch->view);
+    }
+    Py_CLEAR(batch->seq);
+}
+
+static void
+add_keys(Filter *self, const struct key_batch *batch)
+{
+    Py_ssize_t i;
+    for (i = 0; i < batch->count; i++) {
+        filter_check_add(self, batch->ptrs[i], batch->lens[i], 1);
+    }
+}
+
+/* Lookups in filters past the caches stall on a miss per probe. With a
+ * window the keys are hashed that far ahead of the one being checked and
+ * their bits prefetched, so the misses of a window of keys overlap. */
+#define PREFETCH_WINDOW 16
+#define PREFETCH_MAX_WINDOW 64
+#define PREFETCH_MINSIZE (1 << 22) /* bytes from which contains_many prefetches by default */
+
+static int
+filter_window(Filter *self, int prefetch)
+{
+    if (prefetch >= 0)
+        return prefetch;
+    return self->_bloom_struct->bytes >= PREFETCH_MINSIZE ? PREFETCH_WINDOW : 0;
+}
+
+/* checks keys [begin, end) of a batch, prefetching window keys ahead */
+static void
+check_keys(Filter *self, const struct key_batch *batch, char *hits, Py_ssize_t begin, Py_ssize_t end,
+    int window)
+{
+    struct digest ring[PREFETCH_MAX_WINDOW];
+    Py_ssize_t i, ahead;
+
+    if (window <= 0) {
+        for (i = begin; i < end; i++) {
+            hits[i] = filter_check_add(self, batch->ptrs[i], batch->lens[i], 0);
+        }
+        return;
+    }
+    for (ahead = begin; ahead < end && ahead - begin < window; ahead++) {
+        digest_key(self->hash, batch->ptrs[ahead], batch->lens[ahead], &ring[ahead % window]);
+        filter_prefetch(self, &ring[ahead % window], 0);
+    }
+    for (i = begin; i < end; i++) {
+        hits[i] = filter_probe(self, &ring[i % window], 0);
+        if (ahead < end) {
+            digest_key(self->hash, batch->ptrs[ahead], batch->lens[ahead], &ring[ahead % window]);
+            filter_prefetch(self, &ring[ahead % window], 0);
+            ahead++;
+        }
+    }
+}
+
+/* a batch split over the pool, adds go in with atomic fetch-ors */
+#define POOL_GRAIN_KEYS 4096
+
+struct keys_job {
+    Filter *filter;
+    const struct key_batch *batch;
+    char *hits;
+    int window;                 /* prefetch window of the checks */
+};
+
+static void
+add_keys_range(void *arg, size_t begin, size_t end)
+{
+    struct keys_job *job = (struct keys_job *)arg;
+    size_t i;
+
+    for (i = begin; i < end; i++) {
+        filter_check_add(job->filter, job->batch->ptrs[i], job->batch->lens[i], PROBE_ATOMIC_ADD);
+    }
+}
+
+static void
+check_keys_range(void *arg, size_t begin, size_t end)
+{
+    struct keys_job *job = (struct keys_job *)arg;
+
+    check_keys(job->filter, job->batch, job->hits, (Py_ssize_t)begin, (Py_ssize_t)end, job->window);
+}
+
+/* Parses the (keys, width=0, threads=0, *, prefetch=-1) arguments of a
+ * METH_FASTCALL batch method, without the argument tuple and dict
+ * PyArg_ParseTupleAndKeywords needs. Methods that run on the calling thread
+ * only pass threads NULL, those that do not prefetch pass prefetch NULL. */
+static int
+parse_keys_args(PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames, PyObject **keys,
+    Py_ssize_t *width, int *threads, int *prefetch)
+{
+    PyObject *values[4] = {NULL, NULL, NULL, NULL}, *name;
+    Py_ssize_t i, nkwargs = kwnames != NULL ? PyTuple_GET_SIZE(kwnames) : 0, value;
+    Py_ssize_t maxargs = threads != NULL ? 3 : 2;
+    int slot;
+
+    if (nargs > maxargs) {
+        PyErr_Format(PyExc_TypeError, "expected at most %zd arguments, got %zd", maxargs, nargs);
+        return -1;
+    }
+    for (i = 0; i < nargs; i++) {
+        values[i] = args[i];
+    }
+    for (i = 0; i < nkwargs; i++) {
+        name = PyTuple_GET_ITEM(kwnames, i);
+        if (PyUnicode_CompareWithASCIIString(name, "keys") == 0) {
+            slot = 0;
+        }
+        else if (PyUnicode_CompareWithASCIIString(name, "width") == 0) {
+            slot = 1;
+        }
+        else if (threads != NULL && PyUnicode_CompareWithASCIIString(name, "threads") == 0) {
+            slot = 2;
+        }
+        else if (prefetch != NULL && PyUnicode_CompareWithASCIIString(name, "prefetch") == 0) {
+            slot = 3;
+        }
+        else {
+            PyErr_Format(PyExc_TypeError, "'%U' is an invalid keyword argument", name);
+            return -1;
+        }
+        if (values[slot] != NULL) {
+            PyErr_Format(PyExc_TypeError, "argument '%U' given by name and position", name);
+            return -1;
+        }
+        values[slot] = args[nargs + i];
+    }
+    if (values[0] == NULL) {
+        PyErr_SetString(PyExc_TypeError, "missing required argument 'keys'");
+        return -1;
+    }
+
+    *keys = values[0];
+    *width = 0;
+    if (values[1] != NULL) {
+        *width = PyNumber_AsSsize_t(values[1], PyExc_OverflowError);
+        if (*width == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+    }
+    if (threads != NULL) {
+        *threads = 0;
+        if (values[2] != NULL) {
+            value = PyNumber_AsSsize_t(values[2], PyExc_OverflowError);
+            if (value == -1 && PyErr_Occurred()) {
+                return -1;
+            }
+            if (value < 0 || value > POOL_MAX_THREADS) {
+                PyErr_Format(PyExc_ValueError, "threads must be between 0 and %d", POOL_MAX_THREADS);
+                return -1;
+            }
+            *threads = (int)value;
+        }
+    }
+    if (prefetch != NULL) {
+        *prefetch = -1;
+        if (values[3] != NULL) {
+            value = PyNumber_AsSsize_t(values[3], PyExc_OverflowError);
+            if (value == -1 && PyErr_Occurred()) {
+                return -1;
+            }
+            if (value < -1 || value > PREFETCH_MAX_WINDOW) {
+                PyErr_Format(PyExc_ValueError, "prefetch must be between -1 and %d", PREFETCH_MAX_WINDOW);
+                return -1;
+            }
+            *prefetch = (int)value;
+        }
+    }
+    return 0;
+}
+
+static PyObject *
+Filter_add_many(Filter *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *keys;
+    Py_ssize_t width;
+    struct key_batch batch;
+    struct keys_job job;
+    int rc = 0, threads;
+
+    if (parse_keys_args(args, nargs, kwnames, &keys, &width, &threads, NULL) < 0) {
+        return NULL;
+    }
+
+    if (collect_keys(OBJECT_STATE(self), keys, width, &batch) < 0) {
+        return NULL;
+    }
+
+    ENTER_FILTER(self);
+    if (filter_make_writable(self) < 0) {
+        rc = -1;
+    }
+    else if (threads > 1) {
+        job.filter = self;
+        job.batch = &batch;
+        BEGIN_FILTER_THREADS(self)
+        pool_run(add_keys_range, &job, batch.count, POOL_GRAIN_KEYS, threads);
+        END_FILTER_THREADS(self)
+    }
+    else if (batch.count >= GIL_MINKEYS) {
+        BEGIN_FILTER_THREADS(self)
+        add_keys(self, &batch);
+        END_FILTER_THREADS(self)
+    }
+    else {
+        add_keys(self, &batch);
+    }
+    if (rc == 0)
+        self->adds += batch.count;
+    LEAVE_FILTER(self);
+
+    release_keys(&batch);
+    if (rc < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* counts the results of a batch check in the filter's statistics */
+static void
+count_hits(Filter *self, const char *hits, Py_ssize_t count)
+{
+    Py_ssize_t i, positives = 0;
+
+    for (i = 0; i < count; i++) {
+        positives += hits[i] != 0;
+    }
+    self->positives += positives;
+    self->negatives += count - positives;
+}
+
+/* the result list of a batch check */
+static PyObject *
+hits_list(const char *hits, Py_ssize_t count)
+{
+    PyObject *result, *hit;
+    Py_ssize_t i;
+
+    result = PyList_New(count);
+    if (result != NULL) {
+        for (i = 0; i < count; i++) {
+            hit = hits[i] ? Py_True : Py_False;
+            Py_INCREF(hit);
+            PyList_SET_ITEM(result, i, hit);
+        }
+    }
+    return result;
+}
+
+static PyObject *
+Filter_contains_many(Filter *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *keys, *result = NULL;
+    Py_ssize_t width;
+    struct key_batch batch;
+    struct keys_job job;
+    char *hits;
+    int threads, prefetch;
+
+    if (parse_keys_args(args, nargs, kwnames, &keys, &width, &threads, &prefetch) < 0) {
+        return NULL;
+    }
+
+    if (collect_keys(OBJECT_STATE(self), keys, width, &batch) < 0) {
+        return NULL;
+    }
+
+    hits = (char *)PyMem_Malloc(batch.count + 1);
+    if (hits == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    job.filter = self;
+    job.batch = &batch;
+    job.hits = hits;
+    job.window = filter_window(self, prefetch);
+    if (threads > 1) {
+        BEGIN_FILTER_THREADS(self)
+        pool_run(check_keys_range, &job, batch.count, POOL_GRAIN_KEYS, threads);
+        END_FILTER_THREADS(self)
+    }
+    else if (batch.count >= GIL_MINKEYS) {
+        BEGIN_FILTER_THREADS(self)
+        check_keys(self, &batch, hits, 0, batch.count, job.window);
+        END_FILTER_THREADS(self)
+    }
+    else {
+        check_keys(self, &batch, hits, 0, batch.count, job.window);
+    }
+
+    count_hits(self, hits, batch.count);
+    result = hits_list(hits, batch.count);
+    PyMem_Free(hits);
+
+done:
+    release_keys(&batch);
+    return result;
+}
+
+/* bulk loading */
+#define BUILD_BLOCK 65536       /* records split off the file per round */
+
+/* Adds a batch through its digests, prefetching the bits of the key
+ * PREFETCH_WINDOW ahead so its cache misses overlap with the adds before. */
+static void
+add_keys_prefetched(Filter *self, const struct key_batch *batch, uint64_t *digests)
+{
+    struct digest digest;
+    Py_ssize_t i;
+
+    hash_keys(self->hash, batch, digests);
+    for (i = 0; i < batch->count && i < PREFETCH_WINDOW; i++) {
+        unpack_digest(digests[i], &digest);
+        filter_prefetch(self, &digest, 1);
+    }
+    for (i = 0; i < batch->count; i++) {
+        if (i + PREFETCH_WINDOW < batch->count) {
+            unpack_digest(digests[i + PREFETCH_WINDOW], &digest);
+            filter_prefetch(self, &digest, 1);
+        }
+        unpack_digest(digests[i], &digest);
+        filter_probe(self, &digest, PROBE_ADD);
+    }
+}
+
+static PyObject *
+Filter_build_from_file(Filter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "format", "threads", NULL};
+    const char *path, *format_name = NULL;
+    int format = RECORDS_LINES, threads = 0, rc, empty;
+    void *map;
+    size_t map_len, pos = 0;
+    Py_ssize_t count = 0, total = 0;
+    struct key_batch batch;
+    struct keys_job job;
+    uint64_t *digests;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|zi", kwlist, &path, &format_name, &threads)) {
+        return NULL;
+    }
+    if (format_name != NULL && (format = find_name(record_formats, format_name, "format")) < 0) {
+        return NULL;
+    }
+    if (threads < 0 || threads > POOL_MAX_THREADS) {
+        PyErr_Format(PyExc_ValueError, "threads must be between 0 and %d", POOL_MAX_THREADS);
+        return NULL;
+    }
+
+    memset(&batch, 0, sizeof(struct key_batch));
+    batch.ptrs = (const char **)PyMem_Malloc(BUILD_BLOCK * sizeof(const char *));
+    batch.lens = (Py_ssize_t *)PyMem_Malloc(BUILD_BLOCK * sizeof(Py_ssize_t));
+    digests = (uint64_t *)PyMem_Malloc(BUILD_BLOCK * sizeof(uint64_t));
+    if (batch.ptrs == NULL || batch.lens == NULL || digests == NULL) {
+        release_keys(&batch);
+        PyMem_Free(digests);
+        return PyErr_NoMemory();
+    }
+
+    /* an empty file holds no records, but cannot be mapped */
+    Py_BEGIN_ALLOW_THREADS
+    empty = file_empty(path);
+    rc = empty ? 0 : map_file(path, 0, &map, &map_len);
+    Py_END_ALLOW_THREADS
+    if (rc < 0 || empty) {
+        release_keys(&batch);
+        PyMem_Free(digests);
+        return rc < 0 ? set_error_from_os(path) : PyLong_FromSsize_t(0);
+    }
+
+    ENTER_FILTER(self);
+    if (filter_make_writable(self) < 0) {
+        LEAVE_FILTER(self);
+        count = 0;
+        goto done;
+    }
+    job.filter = self;
+    job.batch = &batch;
+    BEGIN_FILTER_THREADS(self)
+    advise_sequential(map, map_len);
+    while ((count = split_records(format, (const char *)map, map_len, &pos, batch.ptrs, batch.lens,
+            BUILD_BLOCK)) > 0) {
+        batch.count = count;
+        if (threads > 1)
+            pool_run(add_keys_range, &job, count, POOL_GRAIN_KEYS, threads);
+        else
+            add_keys_prefetched(self, &batch, digests);
+        total += count;
+    }
+    END_FILTER_THREADS(self)
+    self->adds += total;
+    LEAVE_FILTER(self);
+    if (count < 0) {
+        PyErr_Format(OBJECT_STATE(self)->error, "%s ends inside a record", path);
+    }
+
+done:
+    unmap_file(map, map_len);
+    release_keys(&batch);
+    PyMem_Free(digests);
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    return PyLong_FromSsize_t(total);
+}
+
+/* prehashed probes */
+static int
+get_digest(PyObject *obj, struct digest *digest)
+{
+    PyObject *number;
+    unsigned PY_LONG_LONG packed;
+
+    number = PyNumber_Index(obj);
+    if (number == NULL) {
+        return -1;
+    }
+    packed = PyLong_AsUnsignedLongLong(number);
+    Py_DECREF(number);
+    if (packed == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred()) {
+        return -1;
+    }
+    unpack_digest(packed, digest);
+    return 0;
+}
+
+/* Gets a buffer of native uint64 digests, as made by hash_many or held in
+ * an array('Q') or uint64 numpy array, into view. Returns the digest count,
+ * the caller releases view. */
+static Py_ssize_t
+get_digests(Filter *self, PyObject *digests, Py_buffer *view)
+{
+    if (PyObject_GetBuffer(digests, view, PyBUF_C_CONTIGUOUS) < 0) {
+        return -1;
+    }
+    if (view->len % sizeof(uint64_t)) {
+        PyBuffer_Release(view);
+        PyErr_SetString(OBJECT_STATE(self)->error, "buffer length is not a multiple of 8");
+        return -1;
+    }
+    return view->len / sizeof(uint64_t);
+}
+
+static void
+probe_digests(Filter *self, const char *buffer, Py_ssize_t count, int add, char *hits)
+{
+    struct digest digest;
+    uint64_t packed;
+    Py_ssize_t i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(&packed, buffer + i * sizeof(uint64_t), sizeof(uint64_t));
+        unpack_digest(packed, &digest);
+        if (add)
+            filter_probe(self, &digest, 1);
+        else
+            hits[i] = filter_probe(self, &digest, 0);
+    }
+}
+
+static PyObject *
+Filter_add_hashed(Filter *self, PyObject *digest_obj)
+{
+    struct digest digest;
+
+    if (get_digest(digest_obj, &digest) < 0) {
+        return NULL;
+    }
+
+    ENTER_FILTER(self);
+    if (filter_make_writable(self) < 0) {
+        LEAVE_FILTER(self);
+        return NULL;
+    }
+    filter_probe(self, &digest, 1);
+    self->adds++;
+    LEAVE_FILTER(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Filter_contains_hashed(Filter *self, PyObject *digest_obj)
+{
+    struct digest digest;
+
+    if (get_digest(digest_obj, &digest) < 0) {
+        return NULL;
+    }
+
+    if (filter_probe(self, &digest, 0)) {
+        self->positives++;
+        Py_RETURN_TRUE;
+    }
+    self->negatives++;
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+Filter_add_hashed_many(Filter *self, PyObject *digests)
+{
+    Py_buffer view;
+    const char *buffer;
+    Py_ssize_t count;
+    int rc = 0;
+
+    count = get_digests(self, digests, &view);
+    if (count < 0) {
+        return NULL;
+    }
+    buffer = (const char *)view.buf;
+
+    ENTER_FILTER(self);
+    if (filter_make_writable(self) < 0) {
+        rc = -1;
+    }
+    else if (count >= GIL_MINKEYS) {
+        BEGIN_FILTER_THREADS(self)
+        probe_digests(self, buffer, count, 1, NULL);
+        END_FILTER_THREADS(self)
+    }
+    else {
+        probe_digests(self, buffer, count, 1, NULL);
+    }
+    if (rc == 0)
+        self->adds += count;
+    LEAVE_FILTER(self);
+
+    PyBuffer_Release(&view);
+    if (rc < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Filter_contains_hashed_many(Filter *self, PyObject *digests)
+{
+    PyObject *result;
+    Py_buffer view;
+    const char *buffer;
+    Py_ssize_t count;
+    char *hits;
+
+    count = get_digests(self, digests, &view);
+    if (count < 0) {
+        return NULL;
+    }
+    buffer = (const char *)view.buf;
+
+    hits = (char *)PyMem_Malloc(count + 1);
+    if (hits == NULL) {
+        PyBuffer_Release(&view);
+        return PyErr_NoMemory();
+    }
+
+    if (count >= GIL_MINKEYS) {
+        BEGIN_FILTER_THREADS(self)
+        probe_digests(self, buffer, count, 0, hits);
+        END_FILTER_THREADS(self)
+    }
+    else {
+        probe_digests(self, buffer, count, 0, hits);
+    }
+    PyBuffer_Release(&view);
+
+    count_hits(self, hits, count);
+    result = hits_list(hits, count);
+    PyMem_Free(hits);
+    return result;
+}
+
+/* buffer protocol */
+/* whether writes to the exported bits would modify memory the filter only borrows */
+static int
+filter_readonly(Filter *self)
+{
+    return self->storage == STORAGE_BUFFER || (self->storage == STORAGE_MAPPED && !self->map_writable);
+}
+
+/* Exports the bit array itself. Each export keeps the filter alive, and
+ * while there are any the array is never moved or freed. A writable request
+ * gives a borrowing filter its private copy first; other requests get a
+ * read-only view, so only writable ones hide writes from dump_delta. */
+static int
+Filter_getbuffer(Filter *self, Py_buffer *view, int flags)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+
+    if (self->export_writable)
+        flags |= PyBUF_WRITABLE;
+    if ((flags & PyBUF_WRITABLE) && filter_readonly(self)) {
+        ENTER_FILTER(self);
+        if (filter_make_writable(self) < 0) {
+            LEAVE_FILTER(self);
+            view->obj = NULL;
+            return -1;
+        }
+        LEAVE_FILTER(self);
+    }
+    if (PyBuffer_FillInfo(view, (PyObject *)self, bloom_struct->bf, bloom_struct->bytes,
+            !(flags & PyBUF_WRITABLE), flags) < 0) {
+        return -1;
+    }
+    self->exports++;
+    if (!view->readonly) {
+        self->writable_exports++;
+        self->delta_untracked = 1;
+    }
+    return 0;
+}
+
+static void
+Filter_releasebuffer(Filter *self, Py_buffer *view)
+{
+    self->exports--;
+    if (!view->readonly) {
+        self->writable_exports--;
+        self->delta_untracked = 1;
+    }
+}
+
+static PyObject *
+Filter_get_buffer(Filter *self, PyObject *args)
+{
+    PyObject *memview;
+
+    /* a writable view of the filter's own bits, memoryview() only asks for a read-only one */
+    self->export_writable = 1;
+    memview = PyMemoryView_FromObject((PyObject *)self);
+    self->export_writable = 0;
+    return memview;
+}
+
+/* rewrites the checksum of a writable mapping and syncs it to its file */
+static PyObject *
+Filter_flush(Filter *self, PyObject *args)
+{
+    struct serialized_filter_header *header;
+    int rc;
+
+    if (self->storage != STORAGE_MAPPED || !self->map_writable) {
+        Py_RETURN_NONE;
+    }
+
+    header = (struct serialized_filter_header *)self->map;
+    ENTER_FILTER(self);
+    BEGIN_FILTER_THREADS(self)
+    header->checksum = htons(compute_checksum(self->map + sizeof(struct serialized_filter_header),
+        self->map_len - sizeof(struct serialized_filter_header)));
+    rc = sync_mapping(self->map, self->map_len);
+    END_FILTER_THREADS(self)
+    LEAVE_FILTER(self);
+    if (rc < 0) {
+        return set_error_from_os(NULL);
+    }
+    Py_RETURN_NONE;
+}
+
+/* Fill and saturation of the bit array, from a popcount over all of it,
+ * and the counters of this object. The estimates treat the filter as a
+ * standard one with the same bits and hashes, which blocked and split
+ * layouts approach closely enough to drive resize decisions. */
+static PyObject *
+Filter_stats(Filter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"reset", NULL};
+    struct bloom *bloom_struct = self->_bloom_struct;
+    int reset = 0;
+    uint64_t set_bits;
+    double fill, estimate;
+    PyObject *result;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", kwlist, &reset)) {
+        return NULL;
+    }
+
+    /* readers take no lock, this only races with adds like contains does */
+    if (bloom_struct->bytes >= GIL_MINSIZE) {
+        BEGIN_FILTER_THREADS(self)
+        set_bits = bits_count(bloom_struct->bf, bloom_struct->bytes);
+        END_FILTER_THREADS(self)
+    }
+    else {
+        set_bits = bits_count(bloom_struct->bf, bloom_struct->bytes);
+    }
+
+    fill = (double)set_bits / bloom_struct->bits;
+    if (set_bits >= (uint64_t)bloom_struct->bits)
+        estimate = Py_HUGE_VAL;
+    else
+        estimate = (double)bloom_struct->bits / bloom_struct->hashes * -log1p(-fill);
+
+    result = Py_BuildValue("{s:i,s:i,s:i,s:d,s:i,s:d,s:s,s:s,s:K,s:d,s:d,s:d,s:K,s:K,s:K}",
+        "bits", bloom_struct->bits, "bytes", bloom_struct->bytes, "hashes", bloom_struct->hashes,
+        "bpe", bloom_struct->bpe, "entries", bloom_struct->entries, "error", bloom_struct->error,
+        "layout", layout_names[self->layout], "hash", hash_names[self->hash],
+        "set_bits", (unsigned PY_LONG_LONG)set_bits, "fill", fill,
+        "estimated_entries", estimate, "estimated_error", pow(fill, bloom_struct->hashes),
+        "adds", (unsigned PY_LONG_LONG)self->adds,
+        "positives", (unsigned PY_LONG_LONG)self->positives,
+        "negatives", (unsigned PY_LONG_LONG)self->negatives);
+    if (result != NULL && reset) {
+        self->adds = self->positives = self->negatives = 0;
+    }
+    return result;
+}
+
+/* deltas */
+#define DELTA_VERSION 1
+#define DELTA_HEADER_SIZE 34    /* checksum u16, version, layout, hash, chunk shift u8, bits u32,
+                                 * bytes u32, since u64, token u64, runs u32 */
+
+static void
+write_uint64(char **buffer, uint64_t value)
+{
+    write_uint32(buffer, (uint32_t)(value >> 32));
+    write_uint32(buffer, (uint32_t)value);
+}
+
+static uint64_t
+read_uint64(const char **buffer)
+{
+    uint64_t value = (uint64_t)read_uint32(buffer) << 32;
+
+    return value | read_uint32(buffer);
+}
+
+/* bytes of the bit array in the run of count chunks from chunk */
+static size_t
+delta_run_bytes(size_t bytes, size_t chunk, size_t count)
+{
+    size_t end = (chunk + count) << DELTA_CHUNK_SHIFT;
+
+    return (end < bytes ? end : bytes) - (chunk << DELTA_CHUNK_SHIFT);
+}
+
+/* writes the run table at out and the runs' bits after it, all of dirty's runs */
+static void
+delta_write_runs(const unsigned char *dirty, const unsigned char *bf, size_t bytes, char *out,
+    size_t runs)
+{
+    size_t chunks = delta_chunks(bytes), chunk, count, len;
+    char *data = out + runs * 8;
+
+    for (chunk = 0; (count = delta_next_run(dirty, chunks, &chunk)) > 0; chunk += count) {
+        len = delta_run_bytes(bytes, chunk, count);
+        write_uint32(&out, (uint32_t)chunk);
+        write_uint32(&out, (uint32_t)count);
+        memcpy(data, bf + (chunk << DELTA_CHUNK_SHIFT), len);
+        data += len;
+    }
+}
+
+static int
+filter_check_delta_storage(Filter *self)
+{
+    if (self->atomic) {
+        PyErr_SetString(OBJECT_STATE(self)->error,
+            "deltas cannot track a filter other processes write to");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+Filter_dump_delta(Filter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"since", NULL};
+    struct bloom *bloom_struct = self->_bloom_struct;
+    unsigned PY_LONG_LONG since = 0;
+    size_t bytes = bloom_struct->bytes, chunks = delta_chunks(bytes);
+    size_t bitmap_bytes = delta_bitmap_bytes(bytes), chunk, count, runs = 0, len = 0;
+    PyObject *serial;
+    uint64_t token;
+    uint16_t checksum;
+    char *out, *data;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|K", kwlist, &since) ||
+            filter_check_delta_storage(self) < 0) {
+        return NULL;
+    }
+
+    ENTER_FILTER(self);
+    if (since == 0) {
+        if (self->dirty == NULL && (self->dirty = (unsigned char *)malloc(bitmap_bytes)) == NULL) {
+            LEAVE_FILTER(self);
+            return PyErr_NoMemory();
+        }
+        memset(self->dirty, 0xff, bitmap_bytes);
+    }
+    else if (self->dirty == NULL || since != self->delta_token) {
+        LEAVE_FILTER(self);
+        PyErr_SetString(OBJECT_STATE(self)->error,
+            "since is not the token of the last delta, dump a full one with since=0");
+        return NULL;
+    }
+    /* writes through a view are invisible, each delta sends all chunks until it is gone */
+    if (self->delta_untracked) {
+        memset(self->dirty, 0xff, bitmap_bytes);
+        self->delta_untracked = self->writable_exports > 0;
+    }
+
+    for (chunk = 0; (count = delta_next_run(self->dirty, chunks, &chunk)) > 0; chunk += count) {
+        runs++;
+        len += delta_run_bytes(bytes, chunk, count);
+    }
+    serial = PyBytes_FromStringAndSize(NULL, DELTA_HEADER_SIZE + runs * 8 + len);
+    if (serial == NULL) {
+        LEAVE_FILTER(self);
+        return NULL;
+    }
+    out = PyBytes_AS_STRING(serial);
+    token = ++self->delta_token;
+
+    data = out + 2;
+    *data++ = DELTA_VERSION;
+    *data++ = (char)self->layout;
+    *data++ = (char)self->hash;
+    *data++ = DELTA_CHUNK_SHIFT;
+    write_uint32(&data, bloom_struct->bits);
+    write_uint32(&data, (uint32_t)bytes);
+    write_uint64(&data, since);
+    write_uint64(&data, token);
+    write_uint32(&data, (uint32_t)runs);
+    if (len >= GIL_MINSIZE) {
+        BEGIN_FILTER_THREADS(self)
+        delta_write_runs(self->dirty, bloom_struct->bf, bytes, data, runs);
+        END_FILTER_THREADS(self)
+    }
+    else {
+        delta_write_runs(self->dirty, bloom_struct->bf, bytes, data, runs);
+    }
+    memset(self->dirty, 0, bitmap_bytes);
+    LEAVE_FILTER(self);
+
+    data = out;
+    len = PyBytes_GET_SIZE(serial) - 2;
+    if (len >= GIL_MINSIZE) {
+        Py_BEGIN_ALLOW_THREADS
+        checksum = compute_checksum(out + 2, len);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        checksum = compute_checksum(out + 2, len);
+    }
+    write_uint16(&data, checksum);
+    return Py_BuildValue("KN", (unsigned PY_LONG_LONG)token, serial);
+}
+
+/* copies the runs of a validated delta into the bit array */
+static void
+delta_read_runs(Filter *self, const char *table, size_t runs)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+    const char *data = table + runs * 8;
+    size_t i, chunk, count, len, c;
+
+    for (i = 0; i < runs; i++) {
+        chunk = read_uint32(&table);
+        count = read_uint32(&table);
+        len = delta_run_bytes(bloom_struct->bytes, chunk, count);
+        memcpy(bloom_struct->bf + (chunk << DELTA_CHUNK_SHIFT), data, len);
+        data += len;
+        for (c = chunk; self->dirty != NULL && c < chunk + count; c++) {
+            delta_mark(self->dirty, c << DELTA_CHUNK_SHIFT, 0);
+        }
+    }
+}
+
+static PyObject *
+Filter_apply_delta(Filter *self, PyObject *delta)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+    struct module_state *st = OBJECT_STATE(self);
+    size_t chunks = delta_chunks(bloom_struct->bytes), runs, i, chunk, count, len = 0;
+    const char *buffer, *table;
+    uint64_t since, token;
+    Py_buffer view;
+    int layout, hash, shift;
+    uint32_t bits, bytes;
+    uint16_t checksum, expected;
+
+    if (filter_check_delta_storage(self) < 0 ||
+            PyObject_GetBuffer(delta, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    buffer = (const char *)view.buf;
+    if (view.len < DELTA_HEADER_SIZE) {
+        PyErr_SetString(st->error, "incomplete delta");
+        goto error;
+    }
+    checksum = read_uint16(&buffer);
+    if (view.len >= GIL_MINSIZE) {
+        Py_BEGIN_ALLOW_THREADS
+        expected = compute_checksum(buffer, view.len - 2);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        expected = compute_checksum(buffer, view.len - 2);
+    }
+    if (checksum != expected) {
+        PyErr_SetString(st->error, "checksum mismatch");
+        goto error;
+    }
+    shift = buffer[3];
+    if (buffer[0] != DELTA_VERSION || shift != DELTA_CHUNK_SHIFT) {
+        PyErr_SetString(st->error, "unsupported delta version");
+        goto error;
+    }
+    layout = buffer[1];
+    hash = buffer[2];
+    buffer += 4;
+    bits = read_uint32(&buffer);
+    bytes = read_uint32(&buffer);
+    if (layout != self->layout || hash != self->hash || bits != (uint32_t)bloom_struct->bits ||
+            bytes != (uint32_t)bloom_struct->bytes) {
+        PyErr_SetString(st->error, "delta is of a filter with different parameters");
+        goto error;
+    }
+    since = read_uint64(&buffer);
+    token = read_uint64(&buffer);
+    runs = read_uint32(&buffer);
+    table = buffer;
+    if (runs > (size_t)(view.len - DELTA_HEADER_SIZE) / 8) {
+        PyErr_SetString(st->error, "invalid delta");
+        goto error;
+    }
+    for (i = 0; i < runs; i++) {
+        chunk = read_uint32(&buffer);
+        count = read_uint32(&buffer);
+        if (count == 0 || chunk >= chunks || count > chunks - chunk) {
+            PyErr_SetString(st->error, "invalid delta");
+            goto error;
+        }
+        len += delta_run_bytes(bytes, chunk, count);
+    }
+    if (len != view.len - DELTA_HEADER_SIZE - runs * 8) {
+        PyErr_SetString(st->error, "invalid delta");
+        goto error;
+    }
+    if (since != 0 && since != self->delta_applied) {
+        PyErr_SetString(st->error, "delta does not follow the last one applied");
+        goto error;
+    }
+
+    ENTER_FILTER(self);
+    if (filter_make_writable(self) < 0) {
+        LEAVE_FILTER(self);
+        goto error;
+    }
+    if (len >= GIL_MINSIZE) {
+        BEGIN_FILTER_THREADS(self)
+        delta_read_runs(self, table, runs);
+        END_FILTER_THREADS(self)
+    }
+    else {
+        delta_read_runs(self, table, runs);
+    }
+    self->delta_applied = token;
+    LEAVE_FILTER(self);
+
+    PyBuffer_Release(&view);
+    Py_RETURN_NONE;
+
+error:
+    PyBuffer_Release(&view);
+    return NULL;
+}
+
+/* set operations */
+static int
+filter_compatible(Filter *self, Filter *other)
+{
+    struct bloom *a = self->_bloom_struct;
+    struct bloom *b = other->_bloom_struct;
+
+    if (self->layout != other->layout || self->hash != other->hash || a->entries != b->entries || a->error != b->error ||
+            a->bits != b->bits || a->hashes != b->hashes) {
+        PyErr_SetString(OBJECT_STATE(self)->error, "filters have different parameters");
+        return -1;
+    }
+    return 0;
+}
+
+/* a new private filter with the same parameters and bits as self */
+static Filter *
+filter_copy(Filter *self)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+    Filter *copy;
+
+    copy = (Filter *)PyObject_CallFunction((PyObject *)Py_TYPE(self), "idOsis", bloom_struct->entries,
+        bloom_struct->error, Py_None, layout_names[self->layout], 0, hash_names[self->hash]);
+    if (copy == NULL) {
+        return NULL;
+    }
+    if (bloom_struct->bytes >= GIL_MINSIZE) {
+        BEGIN_FILTER_THREADS(self)
+        memcpy(copy->_bloom_struct->bf, bloom_struct->bf, bloom_struct->bytes);
+        END_FILTER_THREADS(self)
+    }
+    else {
+        memcpy(copy->_bloom_struct->bf, bloom_struct->bf, bloom_struct->bytes);
+    }
+    return copy;
+}
+
+static void
+combine_bits(Filter *self, const unsigned char *src, size_t offset, size_t len, int op)
+{
+    unsigned char *dst = self->_bloom_struct->bf + offset;
+
+    src += offset;
+    if (self->atomic)
+        (op == BITS_OR ? bits_or_atomic : bits_and_atomic)(dst, src, len);
+    else
+        (op == BITS_OR ? bits_or : bits_and)(dst, src, len);
+}
+
+/* ORs or ANDs the bits of other into self */
+static int
+filter_combine(Filter *self, Filter *other, int op)
+{
+    size_t bytes = self->_bloom_struct->bytes;
+
+    if (filter_compatible(self, other) < 0) {
+        return -1;
+    }
+    ENTER_FILTER(self);
+    if (filter_make_writable(self) < 0) {
+        LEAVE_FILTER(self);
+        return -1;
+    }
+    if (bytes >= GIL_MINSIZE) {
+        other->busy++;
+        BEGIN_FILTER_THREADS(self)
+        combine_bits(self, other->_bloom_struct->bf, 0, bytes, op);
+        END_FILTER_THREADS(self)
+        other->busy--;
+    }
+    else {
+        combine_bits(self, other->_bloom_struct->bf, 0, bytes, op);
+    }
+    self->delta_untracked = 1;
+    LEAVE_FILTER(self);
+    return 0;
+}
+
+static PyObject *
+filter_combined(Filter *self, PyObject *other, int op)
+{
+    Filter *result;
+
+    if (!PyObject_TypeCheck(other, OBJECT_STATE(self)->filter_type)) {
+        PyErr_SetString(PyExc_TypeError, "expected a pyblossom.Filter");
+        return NULL;
+    }
+    if (filter_compatible(self, (Filter *)other) < 0) {
+        return NULL;
+    }
+    result = filter_copy(self);
+    if (result != NULL && filter_combine(result, (Filter *)other, op) < 0) {
+        Py_CLEAR(result);
+    }
+    return (PyObject *)result;
+}
+
+static PyObject *
+Filter_union(Filter *self, PyObject *other)
+{
+    return filter_combined(self, other, BITS_OR);
+}
+
+static PyObject *
+Filter_intersection(Filter *self, PyObject *other)
+{
+    return filter_combined(self, other, BITS_AND);
+}
+
+/* whether both operands of a binary operator are Filters, either may be the foreign one */
+static int
+both_filters(PyObject *a, PyObject *b)
+{
+    struct module_state *st = OBJECT_STATE(a);
+
+    if (st == NULL)
+        st = OBJECT_STATE(b);
+    return st != NULL && PyObject_TypeCheck(a, st->filter_type) && PyObject_TypeCheck(b, st->filter_type);
+}
+
+static PyObject *
+Filter_or(PyObject *a, PyObject *b)
+{
+    if (!both_filters(a, b)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    return filter_combined((Filter *)a, b, BITS_OR);
+}
+
+static PyObject *
+Filter_and(PyObject *a, PyObject *b)
+{
+    if (!both_filters(a, b)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    return filter_combined((Filter *)a, b, BITS_AND);
+}
+
+static PyObject *
+filter_combine_inplace(PyObject *a, PyObject *b, int op)
+{
+    if (!both_filters(a, b)) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    if (filter_combine((Filter *)a, (Filter *)b, op) < 0) {
+        return NULL;
+    }
+    Py_INCREF(a);
+    return a;
+}
+
+static PyObject *
+Filter_ior(PyObject *a, PyObject *b)
+{
+    return filter_combine_inplace(a, b, BITS_OR);
+}
+
+static PyObject *
+Filter_iand(PyObject *a, PyObject *b)
+{
+    return filter_combine_inplace(a, b, BITS_AND);
+}
+
+/* the inputs of merge() and the slice of the output a thread works on */
+struct merge_job {
+    Filter *result;
+    Filter **items;
+    Py_ssize_t count;
+};
+
+static void
+merge_range(void *arg, size_t begin, size_t end)
+{
+    struct merge_job *job = (struct merge_job *)arg;
+    size_t offset, len;
+    Py_ssize_t i;
+
+    for (offset = begin; offset < end; offset += len) {
+        len = end - offset < MERGE_CHUNK ? end - offset : MERGE_CHUNK;
+        for (i = 1; i < job->count; i++) {
+            combine_bits(job->result, job->items[i]->_bloom_struct->bf, offset, len, BITS_OR);
+        }
+    }
+}
+
+static PyObject *
+merge(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"filters", "threads", NULL};
+    PyObject *filters, *seq;
+    Filter **items, *result = NULL;
+    Py_ssize_t count, i;
+    struct merge_job job;
+    int threads = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist, &filters, &threads)) {
+        return NULL;
+    }
+    if (threads < 0 || threads > POOL_MAX_THREADS) {
+        PyErr_Format(PyExc_ValueError, "threads must be between 0 and %d", POOL_MAX_THREADS);
+        return NULL;
+    }
+    seq = PySequence_Fast(filters, "filters must be an iterable");
+    if (seq == NULL) {
+        return NULL;
+    }
+    /* the caller's own list, any thread could drop filters from it while the GIL is released */
+    if (seq == filters && PyList_Check(filters)) {
+        Py_SETREF(seq, PyList_AsTuple(filters));
+        if (seq == NULL) {
+            return NULL;
+        }
+    }
+    count = PySequence_Fast_GET_SIZE(seq);
+    items = (Filter **)PySequence_Fast_ITEMS(seq);
+    if (count == 0) {
+        PyErr_SetString(PyExc_ValueError, "nothing to merge");
+        goto done;
+    }
+    for (i = 0; i < count; i++) {
+        if (!PyObject_TypeCheck((PyObject *)items[i], get_state(self)->filter_type)) {
+            PyErr_SetString(PyExc_TypeError, "expected pyblossom.Filter objects");
+            goto done;
+        }
+        if (filter_compatible(items[0], items[i]) < 0) {
+            goto done;
+        }
+    }
+
+    result = filter_copy(items[0]);
+    if (result == NULL) {
+        goto done;
+    }
+    /* every thread owns whole chunks of the output, no atomics needed */
+    job.result = result;
+    job.items = items;
+    job.count = count;
+    for (i = 1; i < count; i++) {
+        items[i]->busy++;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    pool_run(merge_range, &job, result->_bloom_struct->bytes, MERGE_CHUNK * 16, threads);
+    Py_END_ALLOW_THREADS
+    for (i = 1; i < count; i++) {
+        items[i]->busy--;
+    }
+
+done:
+    Py_DECREF(seq);
+    return (PyObject *)result;
+}
+
+static PyMethodDef Filter_methods[] = {
+    {"add", (PyCFunction)Filter_add, METH_O,
+     "add a member, bytes, str or a 64 bit integer, to the filter"},
+    {"contains", (PyCFunction)Filter_check, METH_O,
+     "check if member, bytes, str or a 64 bit integer, exists the filter"},
+    {"add_many", (PyCFunction)(void (*)(void))Filter_add_many, METH_FASTCALL | METH_KEYWORDS,
+     "add every key of an iterable or int64 array (or of a buffer split into width-byte keys); "
+     "threads=N adds them from N threads"},
+    {"build_from_file", (PyCFunction)Filter_build_from_file, METH_VARARGS | METH_KEYWORDS,
+     "add every record of the file at path, split in C: format='lines' (the default), 'u64' for "
+     "native 64 bit integers or 'len-prefixed' for keys behind a big endian u32 length; "
+     "threads=N adds them from N threads, returns the number of records"},
+    {"contains_many", (PyCFunction)(void (*)(void))Filter_contains_many, METH_FASTCALL | METH_KEYWORDS,
+     "check every key of an iterable or int64 array (or of a buffer split into width-byte keys), "
+     "returns a list of bools; threads=N checks them from N threads, prefetch=N hashes N keys "
+     "ahead and prefetches their bits (0 turns it off, -1 does so for filters past a few MB)"},
+    {"add_hashed", (PyCFunction)Filter_add_hashed, METH_O,
+     "add a key digest made by pyblossom.hash with this filter's hash"},
+    {"contains_hashed", (PyCFunction)Filter_contains_hashed, METH_O,
+     "check a key digest made by pyblossom.hash with this filter's hash"},
+    {"add_hashed_many", (PyCFunction)Filter_add_hashed_many, METH_O,
+     "add every digest of a buffer of native uint64 digests"},
+    {"contains_hashed_many", (PyCFunction)Filter_contains_hashed_many, METH_O,
+     "check every digest of a buffer of native uint64 digests, returns a list of bools"},
+    {"get_buffer", (PyCFunction)Filter_get_buffer, METH_NOARGS,
+     "get writable memoryview of the internal buffer"},
+    {"union", (PyCFunction)Filter_union, METH_O,
+     "return a new filter holding the keys of both filters, same as a | b"},
+    {"intersection", (PyCFunction)Filter_intersection, METH_O,
+     "return a new filter with only the bits both filters have set, same as a & b"},
+    {"flush", (PyCFunction)Filter_flush, METH_NOARGS,
+     "update the checksum of a writable open_mmap filter and sync it to disk"},
+    {"dump_delta", (PyCFunction)Filter_dump_delta, METH_VARARGS | METH_KEYWORDS,
+     "return (token, delta) with the bits changed since the delta that returned token since; "
+     "since=0 returns all of them and starts tracking changes"},
+    {"apply_delta", (PyCFunction)Filter_apply_delta, METH_O,
+     "write a delta made by dump_delta of a filter with the same parameters into this one, "
+     "which must have applied the delta before it"},
+    {"stats", (PyCFunction)Filter_stats, METH_VARARGS | METH_KEYWORDS,
+     "return a dict of the filter's parameters, set bits, fill, estimated entries and "
+     "error, and the adds, positives and negatives counted by this object; "
+     "reset=True zeroes the counters"},
+    {NULL}  /* Sentinel */
+};
+
+static void
+Filter_dealloc(Filter* self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    if (self->_bloom_struct != NULL) {
+        filter_release_storage(self);
+        free(self->_bloom_struct);
+    }
+    free(self->dirty);
+    if (self->lock != NULL) {
+        PyThread_free_lock(self->lock);
+    }
+    if (self->dump_lock != NULL) {
+        PyThread_free_lock(self->dump_lock);
+    }
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+Filter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    Filter *self;
+
+    self = (Filter *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->_bloom_struct = (struct bloom *)calloc(1, sizeof(struct bloom));
+        self->lock = PyThread_allocate_lock();
+        self->probe = standard_check_add;
+        if (self->_bloom_struct == NULL || self->lock == NULL) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+
+    return (PyObject *)self;
+}
+
+/* index of name in a NULL terminated table, sets ValueError if it is not there */
+static int
+find_name(const char **names, const char *name, const char *what)
+{
+    int i;
+
+    for (i = 0; names[i] != NULL; i++) {
+        if (strcmp(names[i], name) == 0)
+            return i;
+    }
+    PyErr_Format(PyExc_ValueError, "unknown %s '%s'", what, name);
+    return -1;
+}
+
+/* sets ValueError for an object whose __init__ never ran, state being
+ * whatever __init__ allocates */
+static int
+check_init(void *self, const void *state)
+{
+    if (state != NULL)
+        return 0;
+    PyErr_Format(PyExc_ValueError, "%s object is not initialized", Py_TYPE(self)->tp_name);
+    return -1;
+}
+
+static int
+Filter_init(Filter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"entries", "error", "data", "layout", "shared", "hash", NULL};
+    int entries, success, layout, hash, shared = 0;
+    double error;
+    PyObject *buf_src = NULL;
+    const char *layout_name = NULL, *hash_name = NULL;
+    Py_buffer buf;
+    struct bloom *bloom_struct;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "id|Oziz", kwlist, &entries, &error, &buf_src,
+            &layout_name, &shared, &hash_name)) {
+        return -1;
+    }
+#ifndef HAVE_SHARED_MEMORY
+    if (shared) {
+        PyErr_SetString(PyExc_NotImplementedError, "shared filters are not supported on this platform");
+        return -1;
+    }
+#endif
+    if (buf_src == Py_None) {
+        buf_src = NULL;
+    }
+
+    layout = LAYOUT_STANDARD;
+    if (layout_name != NULL && (layout = find_name(layout_names, layout_name, "layout")) < 0) {
+        return -1;
+    }
+    hash = HASH_MURMUR2;
+    if (hash_name != NULL && (hash = find_name(hash_names, hash_name, "hash")) < 0) {
+        return -1;
+    }
+
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError, "cannot re-initialize a filter while its buffer is exported");
+        return -1;
+    }
+    if (self->busy > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot re-initialize a filter while other calls use it");
+        return -1;
+    }
+    bloom_struct = self->_bloom_struct;
+    filter_release_storage(self);
+    self->layout = layout;
+    self->hash = hash;
+    self->adds = self->positives = self->negatives = 0;
+    free(self->dirty);
+    self->dirty = NULL;
+    self->delta_token = self->delta_applied = 0;
+    success = bloom_init(bloom_struct, entries, error);
+    if (success == 0 && layout == LAYOUT_BLOCKED && filter_allocate_blocked(self, BLOCK_BYTES) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (success == 0 && layout == LAYOUT_SPLIT) {
+        if (filter_allocate_blocked(self, SPLIT_BLOCK_BYTES) < 0) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        bloom_struct->hashes = SPLIT_HASHES;
+    }
+    if (success == 0) {
+        self->probe = select_probe_kernel(layout, bloom_struct->hashes);
+        self->reciprocal = fastmod_reciprocal(bloom_struct->bits);
+    }
+#ifdef HAVE_SHARED_MEMORY
+    if (success == 0 && shared && filter_share(self) < 0) {
+        return -1;
+    }
+#endif
+
+    if (success == 0) {
+        if (buf_src != NULL) {
+            if (!PyObject_CheckBuffer(buf_src)) {
+                PyErr_SetString(OBJECT_STATE(self)->error, "buffer interface is not supported by provided data type");
+                return -1;
+            }
+
+            if (PyObject_GetBuffer(buf_src, &buf, PyBUF_CONTIG_RO) < 0) {
+                PyErr_SetString(OBJECT_STATE(self)->error, "could not get buffer from provided data type");
+                return -1;
+            }
+
+            if ((int)buf.len != bloom_struct->bytes) {
+                PyBuffer_Release(&buf);
+                PyErr_SetString(OBJECT_STATE(self)->error, "invalid data length");
+                return -1;
+            }
+            if (bloom_struct->bytes >= GIL_MINSIZE) {
+                BEGIN_FILTER_THREADS(self)
+                memcpy(bloom_struct->bf, (const unsigned char *)buf.buf,
+                    bloom_struct->bytes);
+                END_FILTER_THREADS(self)
+            }
+            else {
+                memcpy(bloom_struct->bf, (const unsigned char *)buf.buf,
+                    bloom_struct->bytes);
+            }
+            PyBuffer_Release(&buf);
+        }
+        return 0;
+    }
+    else {
+        PyErr_SetString(OBJECT_STATE(self)->error, "internal initialization failed");
+        return -1;
+    }
+}
+
+/* CountingFilter */
+static PyObject *
+instantiate_counting(struct module_state *st, uint32_t cardinality, uint16_t error_rate, int hash,
+    const char *data, Py_ssize_t datalen)
+{
+    return PyObject_CallFunction((PyObject *)st->counting_type, "idy#s", cardinality,
+        1.0 / error_rate, data, datalen, hash_names[hash]);
+}
+
+static PyObject *
+counting_dump(CountingFilter *self, size_t align)
+{
+    size_t header_len = HEADER_V2_SIZE;
+    size_t bytes = counter_bytes(self->bits);
+    PyObject *serial;
+    char *out;
+
+    if (check_init(self, self->counters) < 0) {
+        return NULL;
+    }
+    if (align > 0)
+        header_len = (header_len + align - 1) / align * align;
+    serial = PyBytes_FromStringAndSize(NULL, header_len + bytes);
+    if (serial == NULL) {
+        return NULL;
+    }
+    out = PyBytes_AS_STRING(serial);
+
+    ENTER_FILTER(self);
+    memcpy(out + header_len, self->counters, bytes);
+    LEAVE_FILTER(self);
+    write_header_fields(out, header_len, self->entries, self->error, LAYOUT_COUNTING, self->hash,
+        (const unsigned char *)out + header_len, bytes);
+    return serial;
+}
+
+static int
+counting_get_digest(CountingFilter *self, PyObject *key, struct digest *digest)
+{
+    const char *buffer;
+    Py_ssize_t buflen;
+    uint64_t scratch;
+
+    if (check_init(self, self->counters) < 0 || get_key(key, &buffer, &buflen, &scratch) < 0) {
+        return -1;
+    }
+    digest_key(self->hash, buffer, buflen, digest);
+    return 0;
+}
+
+static PyObject *
+CountingFilter_add(CountingFilter *self, PyObject *key)
+{
+    struct digest digest;
+
+    if (counting_get_digest(self, key, &digest) < 0) {
+        return NULL;
+    }
+    ENTER_FILTER(self);
+    counting_add(self->counters, self->bits, self->hashes, &digest);
+    LEAVE_FILTER(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CountingFilter_remove(CountingFilter *self, PyObject *key)
+{
+    struct digest digest;
+    int removed;
+
+    if (counting_get_digest(self, key, &digest) < 0) {
+        return NULL;
+    }
+    ENTER_FILTER(self);
+    removed = counting_remove(self->counters, self->bits, self->hashes, &digest);
+    LEAVE_FILTER(self);
+    if (removed)
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *
+CountingFilter_check(CountingFilter *self, PyObject *key)
+{
+    struct digest digest;
+
+    if (counting_get_digest(self, key, &digest) < 0) {
+        return NULL;
+    }
+    if (counting_check(self->counters, self->bits, self->hashes, &digest))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *
+CountingFilter_to_filter(CountingFilter *self, PyObject *args)
+{
+    Filter *filter;
+
+    if (check_init(self, self->counters) < 0) {
+        return NULL;
+    }
+    filter = (Filter *)PyObject_CallFunction((PyObject *)OBJECT_STATE(self)->filter_type, "idOsis", self->entries,
+        self->error, Py_None, layout_names[LAYOUT_STANDARD], 0, hash_names[self->hash]);
+    if (filter == NULL) {
+        return NULL;
+    }
+    ENTER_FILTER(self);
+    if (filter->_bloom_struct->bytes >= GIL_MINSIZE) {
+        Py_BEGIN_ALLOW_THREADS
+        counting_collapse(self->counters, self->bits, filter->_bloom_struct->bf);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        counting_collapse(self->counters, self->bits, filter->_bloom_struct->bf);
+    }
+    LEAVE_FILTER(self);
+    return (PyObject *)filter;
+}
+
+static PyMethodDef CountingFilter_methods[] = {
+    {"add", (PyCFunction)CountingFilter_add, METH_O,
+     "add a member to the filter"},
+    {"remove", (PyCFunction)CountingFilter_remove, METH_O,
+     "remove a member added before, returns False if it was not in the filter"},
+    {"contains", (PyCFunction)CountingFilter_check, METH_O,
+     "check if member exists the filter"},
+    {"to_filter", (PyCFunction)CountingFilter_to_filter, METH_NOARGS,
+     "return a standard Filter with a bit set for every non-zero counter"},
+    {NULL}
+};
+
+static void
+CountingFilter_dealloc(CountingFilter *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    free(self->counters);
+    if (self->lock != NULL) {
+        PyThread_free_lock(self->lock);
+    }
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+CountingFilter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    CountingFilter *self;
+
+    self = (CountingFilter *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->lock = PyThread_allocate_lock();
+        if (self->lock == NULL) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+
+    return (PyObject *)self;
+}
+
+static int
+CountingFilter_init(CountingFilter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"entries", "error", "data", "hash", NULL};
+    int entries, hash;
+    double error;
+    const char *data = NULL, *hash_name = NULL;
+    Py_ssize_t datalen = 0;
+    struct bloom sizing;
+    size_t bytes;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "id|z#z", kwlist, &entries, &error, &data,
+            &datalen, &hash_name)) {
+        return -1;
+    }
+    hash = HASH_MURMUR2;
+    if (hash_name != NULL && (hash = find_name(hash_names, hash_name, "hash")) < 0) {
+        return -1;
+    }
+
+    /* size it like the standard layout Filter it collapses to */
+    memset(&sizing, 0, sizeof(struct bloom));
+    if (bloom_init(&sizing, entries, error) != 0) {
+        PyErr_SetString(OBJECT_STATE(self)->error, "internal initialization failed");
+        return -1;
+    }
+    bloom_free(&sizing);
+
+    bytes = counter_bytes(sizing.bits);
+    if (data != NULL && (size_t)datalen != bytes) {
+        PyErr_SetString(OBJECT_STATE(self)->error, "invalid data length");
+        return -1;
+    }
+    free(self->counters);
+    self->counters = (unsigned char *)calloc(bytes, 1);
+    if (self->counters == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (data != NULL) {
+        memcpy(self->counters, data, bytes);
+    }
+    self->entries = sizing.entries;
+    self->error = sizing.error;
+    self->bits = sizing.bits;
+    self->hashes = sizing.hashes;
+    self->hash = hash;
+    return 0;
+}
+
+/* ScalableFilter */
+#define SCALABLE_TABLE_SIZE 8           /* slices u32, growth u16, ratio u16 */
+#define SCALABLE_SLICE_SIZE 12          /* entries, error_rate, count, all u32 */
+#define SCALABLE_RATIO_ONE 65536        /* fixed point denominator of ratio */
+
+/* 1/N of the false positive rate of slice i, 0 if N does not fit 32 bits */
+static uint32_t
+scalable_error_rate(ScalableFilter *self, Py_ssize_t i)
+{
+    double error = self->error * (1 - self->ratio);
+    Py_ssize_t j;
+
+    for (j = 0; j < i; j++) {
+        error *= self->ratio;
+    }
+    if (1.0 / error >= 4294967295.0)
+        return 0;
+    return (uint32_t)(1.0 / error + 0.5);
+}
+
+/* appends an empty slice */
+static int
+scalable_append(ScalableFilter *self, uint32_t entries, uint32_t error_rate, uint32_t count)
+{
+    struct scalable_slice *slices, *slice;
+    PyObject *filter;
+
+    filter = PyObject_CallFunction((PyObject *)OBJECT_STATE(self)->filter_type, "idOsis", entries,
+        1.0 / error_rate,
+        Py_None, layout_names[LAYOUT_STANDARD], 0, hash_names[self->hash]);
+    if (filter == NULL) {
+        return -1;
+    }
+    slices = (struct scalable_slice *)PyMem_Realloc(self->slices,
+        (self->nslices + 1) * sizeof(struct scalable_slice));
+    if (slices == NULL) {
+        Py_DECREF(filter);
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->slices = slices;
+    slice = &slices[self->nslices++];
+    slice->filter = filter;
+    slice->entries = entries;
+    slice->error_rate = error_rate;
+    slice->count = count;
+    return 0;
+}
+
+static void
+scalable_clear(ScalableFilter *self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->nslices; i++) {
+        Py_DECREF(self->slices[i].filter);
+    }
+    PyMem_Free(self->slices);
+    self->slices = NULL;
+    self->nslices = 0;
+}
+
+/* appends the next, larger and stricter slice */
+static int
+scalable_grow(ScalableFilter *self)
+{
+    struct scalable_slice *last = &self->slices[self->nslices - 1];
+    uint32_t error_rate = scalable_error_rate(self, self->nslices);
+
+    if ((double)last->entries * self->growth > INT_MAX || error_rate == 0) {
+        PyErr_SetString(OBJECT_STATE(self)->error, "scalable filter cannot grow any further");
+        return -1;
+    }
+    return scalable_append(self, last->entries * self->growth, error_rate, 0);
+}
+
+static int
+scalable_get_digest(ScalableFilter *self, PyObject *key, struct digest *digest)
+{
+    const char *buffer;
+    Py_ssize_t buflen;
+    uint64_t scratch;
+
+    if (check_init(self, self->slices) < 0 || get_key(key, &buffer, &buflen, &scratch) < 0) {
+        return -1;
+    }
+    digest_key(self->hash, buffer, buflen, digest);
+    return 0;
+}
+
+/* Probes slices newest first, they are the largest. Slices are only appended
+ * while holding the GIL, which this never drops. */
+static int
+scalable_check(ScalableFilter *self, struct digest *digest)
+{
+    Py_ssize_t i;
+
+    for (i = self->nslices - 1; i >= 0; i--) {
+        if (filter_probe((Filter *)self->slices[i].filter, digest, 0))
+            return 1;
+    }
+    return 0;
+}
+
+static PyObject *
+ScalableFilter_add(ScalableFilter *self, PyObject *key)
+{
+    struct scalable_slice *last;
+    struct digest digest;
+
+    if (scalable_get_digest(self, key, &digest) < 0) {
+        return NULL;
+    }
+
+    ENTER_FILTER(self);
+    /* a key already present would only fill the newest slice up faster */
+    if (!scalable_check(self, &digest)) {
+        last = &self->slices[self->nslices - 1];
+        if (last->count >= last->entries && scalable_grow(self) < 0) {
+            LEAVE_FILTER(self);
+            return NULL;
+        }
+        last = &self->slices[self->nslices - 1];
+        filter_probe((Filter *)last->filter, &digest, 1);
+        last->count++;
+    }
+    LEAVE_FILTER(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ScalableFilter_check(ScalableFilter *self, PyObject *key)
+{
+    struct digest digest;
+
+    if (scalable_get_digest(self, key, &digest) < 0) {
+        return NULL;
+    }
+    if (scalable_check(self, &digest))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *
+ScalableFilter_slices(ScalableFilter *self, PyObject *args)
+{
+    struct scalable_slice *slice;
+    PyObject *result, *item;
+    Py_ssize_t i;
+
+    result = PyList_New(self->nslices);
+    if (result == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < self->nslices; i++) {
+        slice = &self->slices[i];
+        item = Py_BuildValue("(IdI)", slice->entries, 1.0 / slice->error_rate, slice->count);
+        if (item == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    return result;
+}
+
+static Py_ssize_t
+ScalableFilter_length(ScalableFilter *self)
+{
+    Py_ssize_t i, count = 0;
+
+    for (i = 0; i < self->nslices; i++) {
+        count += self->slices[i].count;
+    }
+    return count;
+}
+
+static PyObject *
+scalable_dump(ScalableFilter *self, size_t align)
+{
+    struct scalable_slice *slice;
+    struct bloom *bloom_struct;
+    size_t header_len = HEADER_V2_SIZE, len;
+    PyObject *serial;
+    char *out, *data;
+    Py_ssize_t i;
+
+    if (check_init(self, self->slices) < 0) {
+        return NULL;
+    }
+    if (align > 0)
+        header_len = (header_len + align - 1) / align * align;
+
+    ENTER_FILTER(self);
+    len = SCALABLE_TABLE_SIZE + self->nslices * SCALABLE_SLICE_SIZE;
+    for (i = 0; i < self->nslices; i++) {
+        len += ((Filter *)self->slices[i].filter)->_bloom_struct->bytes;
+    }
+    serial = PyBytes_FromStringAndSize(NULL, header_len + len);
+    if (serial == NULL) {
+        LEAVE_FILTER(self);
+        return NULL;
+    }
+    out = PyBytes_AS_STRING(serial);
+
+    data = out + header_len;
+    write_uint32(&data, self->nslices);
+    write_uint16(&data, self->growth);
+    write_uint16(&data, (uint16_t)(self->ratio * SCALABLE_RATIO_ONE));
+    for (i = 0; i < self->nslices; i++) {
+        slice = &self->slices[i];
+        write_uint32(&data, slice->entries);
+        write_uint32(&data, slice->error_rate);
+        write_uint32(&data, slice->count);
+    }
+    for (i = 0; i < self->nslices; i++) {
+        bloom_struct = ((Filter *)self->slices[i].filter)->_bloom_struct;
+        memcpy(data, bloom_struct->bf, bloom_struct->bytes);
+        data += bloom_struct->bytes;
+    }
+    LEAVE_FILTER(self);
+
+    write_header_fields(out, header_len, self->entries, self->error, LAYOUT_SCALABLE, self->hash,
+        (const unsigned char *)out + header_len, len);
+    return serial;
+}
+
+/* rebuilds a ScalableFilter from the slice table and slices following its header */
+static PyObject *
+load_scalable(struct module_state *st, const struct filter_header *header, const char *data,
+    size_t len)
+{
+    ScalableFilter *self;
+    struct bloom *bloom_struct;
+    const char *table = data;
+    uint32_t nslices, entries, error_rate, count, i;
+    uint16_t growth, ratio;
+    size_t offset;
+
+    if (len < SCALABLE_TABLE_SIZE) {
+        PyErr_SetString(st->error, "incomplete payload");
+        return NULL;
+    }
+    nslices = read_uint32(&table);
+    growth = read_uint16(&table);
+    ratio = read_uint16(&table);
+    if (nslices == 0 || nslices > (len - SCALABLE_TABLE_SIZE) / SCALABLE_SLICE_SIZE) {
+        PyErr_SetString(st->error, "invalid slice table");
+        return NULL;
+    }
+
+    self = (ScalableFilter *)PyObject_CallFunction((PyObject *)st->scalable_type, "ididz",
+        header->cardinality, 1.0 / header->error_rate, growth, (double)ratio / SCALABLE_RATIO_ONE,
+        hash_names[header->hash]);
+    if (self == NULL) {
+        return NULL;
+    }
+    scalable_clear(self);
+
+    offset = SCALABLE_TABLE_SIZE + nslices * SCALABLE_SLICE_SIZE;
+    for (i = 0; i < nslices; i++) {
+        entries = read_uint32(&table);
+        error_rate = read_uint32(&table);
+        count = read_uint32(&table);
+        if (entries == 0 || entries > INT_MAX || error_rate == 0) {
+            PyErr_SetString(st->error, "invalid slice table");
+            goto error;
+        }
+        if (scalable_append(self, entries, error_rate, count) < 0) {
+            goto error;
+        }
+        bloom_struct = ((Filter *)self->slices[i].filter)->_bloom_struct;
+        if ((size_t)bloom_struct->bytes > len - offset) {
+            PyErr_SetString(st->error, "invalid data length");
+            goto error;
+        }
+        memcpy(bloom_struct->bf, data + offset, bloom_struct->bytes);
+        offset += bloom_struct->bytes;
+    }
+    if (offset != len) {
+        PyErr_SetString(st->error, "invalid data length");
+        goto error;
+    }
+    return (PyObject *)self;
+
+error:
+    Py_DECREF(self);
+    return NULL;
+}
+
+static PyMethodDef ScalableFilter_methods[] = {
+    {"add", (PyCFunction)ScalableFilter_add, METH_O,
+     "add a member to the filter, appending a slice once the newest one is full"},
+    {"contains", (PyCFunction)ScalableFilter_check, METH_O,
+     "check if member exists the filter"},
+    {"slices", (PyCFunction)ScalableFilter_slices, METH_NOARGS,
+     "return the slice table as a list of (entries, error, count)"},
+    {NULL}
+};
+
+static void
+ScalableFilter_dealloc(ScalableFilter *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    scalable_clear(self);
+    if (self->lock != NULL) {
+        PyThread_free_lock(self->lock);
+    }
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+ScalableFilter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    ScalableFilter *self;
+
+    self = (ScalableFilter *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->lock = PyThread_allocate_lock();
+        if (self->lock == NULL) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+
+    return (PyObject *)self;
+}
+
+static int
+ScalableFilter_init(ScalableFilter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"entries", "error", "growth", "ratio", "hash", NULL};
+    int entries, growth = 2, hash;
+    double error, ratio = 0.5;
+    const char *hash_name = NULL;
+    uint32_t error_rate, fixed = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "id|idz", kwlist, &entries, &error, &growth,
+            &ratio, &hash_name)) {
+        return -1;
+    }
+    hash = HASH_MURMUR2;
+    if (hash_name != NULL && (hash = find_name(hash_names, hash_name, "hash")) < 0) {
+        return -1;
+    }
+    if (entries < 1 || error <= 0 || error >= 1) {
+        PyErr_SetString(PyExc_ValueError, "entries must be positive and error between 0 and 1");
+        return -1;
+    }
+    if (growth < 1 || growth > 0xFFFF) {
+        PyErr_SetString(PyExc_ValueError, "growth must be between 1 and 65535");
+        return -1;
+    }
+    /* stored as a 16 bit fraction, round it now so a loaded filter grows the same way */
+    if (ratio > 0 && ratio < 1)
+        fixed = (uint32_t)(ratio * SCALABLE_RATIO_ONE + 0.5);
+    if (fixed == 0 || fixed >= SCALABLE_RATIO_ONE) {
+        PyErr_SetString(PyExc_ValueError, "ratio must be between 0 and 1");
+        return -1;
+    }
+    ratio = (double)fixed / SCALABLE_RATIO_ONE;
+
+    scalable_clear(self);
+    self->entries = entries;
+    self->error = error;
+    self->growth = growth;
+    self->ratio = ratio;
+    self->hash = hash;
+    error_rate = scalable_error_rate(self, 0);
+    if (error_rate == 0) {
+        PyErr_SetString(PyExc_ValueError, "error is too small");
+        return -1;
+    }
+    return scalable_append(self, entries, error_rate, 0);
+}
+
+/* digests the single key argument of a StaticFilter or CuckooFilter method */
+static int
+get_packed_key(PyObject *key, int hash, uint64_t *packed)
+{
+    const char *buffer;
+    Py_ssize_t buflen;
+    uint64_t scratch;
+    struct digest digest;
+
+    if (get_key(key, &buffer, &buflen, &scratch) < 0) {
+        return -1;
+    }
+    digest_key(hash, buffer, buflen, &digest);
+    *packed = pack_digest(&digest);
+    return 0;
+}
+
+/* StaticFilter */
+#define STATIC_TABLE_SIZE 20    /* seed u64, segment_length u32, segment_count u32, bits u8, 3 reserved */
+
+/* Digests and dedupes the keys into digests and fills fuse, which has its
+ * fingerprint_bits set. Returns fuse_build's result. */
+static int
+static_build(struct fuse *fuse, int hash, const struct key_batch *batch, uint64_t *digests,
+    uint32_t *count)
+{
+    hash_keys(hash, batch, digests);
+    *count = fuse_unique(digests, (uint32_t)batch->count);
+    fuse_size(fuse, *count);
+    fuse->fingerprints = calloc(fuse_bytes(fuse), 1);
+    if (fuse->fingerprints == NULL) {
+        return -1;
+    }
+    return fuse_build(fuse, digests, *count);
+}
+
+static void
+static_check_keys(StaticFilter *self, const struct key_batch *batch, char *hits)
+{
+    struct digest digest;
+    Py_ssize_t i;
+
+    for (i = 0; i < batch->count; i++) {
+        digest_key(self->hash, batch->ptrs[i], batch->lens[i], &digest);
+        hits[i] = fuse_contains(&self->fuse, pack_digest(&digest));
+    }
+}
+
+static PyObject *
+StaticFilter_check(StaticFilter *self, PyObject *key)
+{
+    uint64_t packed;
+
+    if (check_init(self, self->fuse.fingerprints) < 0 || get_packed_key(key, self->hash, &packed) < 0) {
+        return NULL;
+    }
+    if (fuse_contains(&self->fuse, packed))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *
+StaticFilter_contains_many(StaticFilter *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *keys, *result = NULL;
+    Py_ssize_t width = 0;
+    struct key_batch batch;
+    char *hits;
+
+    if (check_init(self, self->fuse.fingerprints) < 0) {
+        return NULL;
+    }
+    if (parse_keys_args(args, nargs, kwnames, &keys, &width, NULL, NULL) < 0) {
+        return NULL;
+    }
+    if (collect_keys(OBJECT_STATE(self), keys, width, &batch) < 0) {
+        return NULL;
+    }
+
+    hits = (char *)PyMem_Malloc(batch.count + 1);
+    if (hits == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (batch.count >= GIL_MINKEYS) {
+        Py_BEGIN_ALLOW_THREADS
+        static_check_keys(self, &batch, hits);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        static_check_keys(self, &batch, hits);
+    }
+    result = hits_list(hits, batch.count);
+    PyMem_Free(hits);
+
+done:
+    release_keys(&batch);
+    return result;
+}
+
+static PyObject *
+StaticFilter_build(PyObject *cls, PyObject *args, PyObject *kwargs)
+{
+    return PyObject_Call(cls, args, kwargs);
+}
+
+static Py_ssize_t
+StaticFilter_length(StaticFilter *self)
+{
+    return self->count;
+}
+
+static PyObject *
+static_dump(StaticFilter *self, size_t align)
+{
+    size_t header_len = HEADER_V2_SIZE, bytes = fuse_bytes(&self->fuse);
+    PyObject *serial;
+    char *out, *data;
+
+    if (check_init(self, self->fuse.fingerprints) < 0) {
+        return NULL;
+    }
+    if (align > 0)
+        header_len = (header_len + align - 1) / align * align;
+    serial = PyBytes_FromStringAndSize(NULL, header_len + STATIC_TABLE_SIZE + bytes);
+    if (serial == NULL) {
+        return NULL;
+    }
+    out = PyBytes_AS_STRING(serial);
+
+    data = out + header_len;
+    write_uint32(&data, (uint32_t)(self->fuse.seed >> 32));
+    write_uint32(&data, (uint32_t)self->fuse.seed);
+    write_uint32(&data, self->fuse.segment_length);
+    write_uint32(&data, self->fuse.segment_count);
+    memset(data, 0, 4);
+    *data = (char)self->fuse.fingerprint_bits;
+    memcpy(data + 4, self->fuse.fingerprints, bytes);
+
+    /* the v1 error rate is 16 bits wide, 1/65536 is written as 1/65535 */
+    write_header_fields(out, header_len, self->count,
+        1.0 / (self->fuse.fingerprint_bits == 16 ? 65535 : 256), LAYOUT_STATIC, self->hash,
+        (const unsigned char *)out + header_len, STATIC_TABLE_SIZE + bytes);
+    return serial;
+}
+
+static PyObject *
+load_static(struct module_state *st, const struct filter_header *header, const char *data,
+    size_t len)
+{
+    StaticFilter *self;
+    struct fuse fuse;
+    const char *table = data;
+
+    if (len < STATIC_TABLE_SIZE) {
+        PyErr_SetString(st->error, "incomplete payload");
+        return NULL;
+    }
+    memset(&fuse, 0, sizeof(struct fuse));
+    fuse.seed = (uint64_t)read_uint32(&table) << 32;
+    fuse.seed |= read_uint32(&table);
+    fuse.segment_length = read_uint32(&table);
+    fuse.segment_count = read_uint32(&table);
+    fuse.fingerprint_bits = read_uint8(&table);
+    if (fuse.segment_length == 0 || fuse.segment_length > FUSE_MAX_SEGMENT_LENGTH ||
+            (fuse.segment_length & (fuse.segment_length - 1)) != 0 || fuse.segment_count == 0 ||
+            fuse.segment_count > 0xFFFFFFFFU / fuse.segment_length - (FUSE_ARITY - 1) ||
+            (fuse.fingerprint_bits != 8 && fuse.fingerprint_bits != 16)) {
+        PyErr_SetString(st->error, "invalid filter table");
+        return NULL;
+    }
+    fuse.segment_length_mask = fuse.segment_length - 1;
+    fuse.segment_count_length = fuse.segment_count * fuse.segment_length;
+    fuse.array_length = (fuse.segment_count + FUSE_ARITY - 1) * fuse.segment_length;
+    if (fuse_bytes(&fuse) != len - STATIC_TABLE_SIZE) {
+        PyErr_SetString(st->error, "invalid data length");
+        return NULL;
+    }
+
+    self = (StaticFilter *)st->static_type->tp_alloc(st->static_type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    fuse.fingerprints = malloc(fuse_bytes(&fuse));
+    if (fuse.fingerprints == NULL) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    memcpy(fuse.fingerprints, data + STATIC_TABLE_SIZE, fuse_bytes(&fuse));
+    self->fuse = fuse;
+    self->count = header->cardinality;
+    self->hash = header->hash;
+    return (PyObject *)self;
+}
+
+static PyMethodDef StaticFilter_methods[] = {
+    {"build", (PyCFunction)StaticFilter_build, METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+     "build a filter holding keys, same as calling the class"},
+    {"contains", (PyCFunction)StaticFilter_check, METH_O,
+     "check if member exists the filter"},
+    {"contains_many", (PyCFunction)(void (*)(void))StaticFilter_contains_many, METH_FASTCALL | METH_KEYWORDS,
+     "check an iterable of members, or a buffer of width sized keys, returns a list of bools"},
+    {NULL}
+};
+
+static void
+StaticFilter_dealloc(StaticFilter *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    free(self->fuse.fingerprints);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static int
+StaticFilter_init(StaticFilter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"keys", "fingerprint", "width", "hash", NULL};
+    PyObject *keys;
+    int bits = 8, hash, rc;
+    Py_ssize_t width = 0;
+    const char *hash_name = NULL;
+    struct key_batch batch;
+    struct fuse fuse;
+    uint64_t *digests;
+    uint32_t count;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|inz", kwlist, &keys, &bits, &width,
+            &hash_name)) {
+        return -1;
+    }
+    hash = HASH_MURMUR2;
+    if (hash_name != NULL && (hash = find_name(hash_names, hash_name, "hash")) < 0) {
+        return -1;
+    }
+    if (bits != 8 && bits != 16) {
+        PyErr_SetString(PyExc_ValueError, "fingerprint must be 8 or 16 bits");
+        return -1;
+    }
+    if (collect_keys(OBJECT_STATE(self), keys, width, &batch) < 0) {
+        return -1;
+    }
+    if (batch.count > 0x7FFFFFFF) {
+        release_keys(&batch);
+        PyErr_SetString(PyExc_ValueError, "too many keys");
+        return -1;
+    }
+    digests = (uint64_t *)PyMem_Malloc((batch.count + 1) * sizeof(uint64_t));
+    if (digests == NULL) {
+        release_keys(&batch);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memset(&fuse, 0, sizeof(struct fuse));
+    fuse.fingerprint_bits = bits;
+    if (batch.count >= GIL_MINKEYS) {
+        Py_BEGIN_ALLOW_THREADS
+        rc = static_build(&fuse, hash, &batch, digests, &count);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        rc = static_build(&fuse, hash, &batch, digests, &count);
+    }
+    PyMem_Free(digests);
+    release_keys(&batch);
+    if (rc < 0) {
+        free(fuse.fingerprints);
+        if (rc == -1)
+            PyErr_NoMemory();
+        else
+            PyErr_SetString(OBJECT_STATE(self)->error, "could not build the filter");
+        return -1;
+    }
+
+    free(self->fuse.fingerprints);
+    self->fuse = fuse;
+    self->count = count;
+    self->hash = hash;
+    return 0;
+}
+
+/* CuckooFilter */
+#define CUCKOO_TABLE_SIZE 16    /* buckets, count, victim bucket u32, victim u16, flags u8, 1 reserved */
+#define CUCKOO_ERROR_RATE 8192  /* 2 buckets of 4 slots against 16 bit fingerprints */
+
+static void
+cuckoo_check_keys(CuckooFilter *self, const struct key_batch *batch, char *hits)
+{
+    struct digest digest;
+    Py_ssize_t i;
+
+    for (i = 0; i < batch->count; i++) {
+        digest_key(self->hash, batch->ptrs[i], batch->lens[i], &digest);
+        hits[i] = cuckoo_contains(&self->cuckoo, pack_digest(&digest));
+    }
+}
+
+static PyObject *
+CuckooFilter_add(CuckooFilter *self, PyObject *key)
+{
+    uint64_t packed;
+    int rc;
+
+    if (check_init(self, self->cuckoo.table) < 0 || get_packed_key(key, self->hash, &packed) < 0) {
+        return NULL;
+    }
+    ENTER_FILTER(self);
+    rc = cuckoo_add(&self->cuckoo, packed);
+    LEAVE_FILTER(self);
+    if (rc < 0) {
+        PyErr_SetString(OBJECT_STATE(self)->error, "cuckoo filter is full");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+CuckooFilter_remove(CuckooFilter *self, PyObject *key)
+{
+    uint64_t packed;
+    int removed;
+
+    if (check_init(self, self->cuckoo.table) < 0 || get_packed_key(key, self->hash, &packed) < 0) {
+        return NULL;
+    }
+    ENTER_FILTER(self);
+    removed = cuckoo_remove(&self->cuckoo, packed);
+    LEAVE_FILTER(self);
+    if (removed)
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *
+CuckooFilter_check(CuckooFilter *self, PyObject *key)
+{
+    uint64_t packed;
+
+    if (check_init(self, self->cuckoo.table) < 0 || get_packed_key(key, self->hash, &packed) < 0) {
+        return NULL;
+    }
+    if (cuckoo_contains(&self->cuckoo, packed))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *
+CuckooFilter_contains_many(CuckooFilter *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *keys, *result = NULL;
+    Py_ssize_t width = 0;
+    struct key_batch batch;
+    char *hits;
+
+    if (check_init(self, self->cuckoo.table) < 0) {
+        return NULL;
+    }
+    if (parse_keys_args(args, nargs, kwnames, &keys, &width, NULL, NULL) < 0) {
+        return NULL;
+    }
+    if (collect_keys(OBJECT_STATE(self), keys, width, &batch) < 0) {
+        return NULL;
+    }
+
+    hits = (char *)PyMem_Malloc(batch.count + 1);
+    if (hits == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    /* an add relocating a key while the GIL is dropped could hide it from us */
+    ENTER_FILTER(self);
+    if (batch.count >= GIL_MINKEYS) {
+        Py_BEGIN_ALLOW_THREADS
+        cuckoo_check_keys(self, &batch, hits);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        cuckoo_check_keys(self, &batch, hits);
+    }
+    LEAVE_FILTER(self);
+    result = hits_list(hits, batch.count);
+    PyMem_Free(hits);
+
+done:
+    release_keys(&batch);
+    return result;
+}
+
+static Py_ssize_t
+CuckooFilter_length(CuckooFilter *self)
+{
+    return self->cuckoo.count;
+}
+
+static PyObject *
+cuckoo_dump(CuckooFilter *self, size_t align)
+{
+    size_t header_len = HEADER_V2_SIZE, bytes = cuckoo_bytes(self->cuckoo.buckets);
+    PyObject *serial;
+    char *out, *data;
+
+    if (check_init(self, self->cuckoo.table) < 0) {
+        return NULL;
+    }
+    if (align > 0)
+        header_len = (header_len + align - 1) / align * align;
+    serial = PyBytes_FromStringAndSize(NULL, header_len + CUCKOO_TABLE_SIZE + bytes);
+    if (serial == NULL) {
+        return NULL;
+    }
+    out = PyBytes_AS_STRING(serial);
+
+    data = out + header_len;
+    ENTER_FILTER(self);
+    write_uint32(&data, self->cuckoo.buckets);
+    write_uint32(&data, self->cuckoo.count);
+    write_uint32(&data, self->cuckoo.victim_bucket);
+    write_uint16(&data, self->cuckoo.victim);
+    data[0] = (char)self->cuckoo.victim_used;
+    data[1] = 0;
+    memcpy(data + 2, self->cuckoo.table, bytes);
+    LEAVE_FILTER(self);
+
+    write_header_fields(out, header_len, self->capacity, 1.0 / CUCKOO_ERROR_RATE, LAYOUT_CUCKOO,
+        self->hash, (const unsigned char *)out + header_len, CUCKOO_TABLE_SIZE + bytes);
+    return serial;
+}
+
+static PyObject *
+load_cuckoo(struct module_state *st, const struct filter_header *header, const char *data,
+    size_t len)
+{
+    CuckooFilter *self;
+    const char *table = data;
+    uint32_t buckets, count, victim_bucket;
+    uint16_t victim;
+    int victim_used;
+
+    if (len < CUCKOO_TABLE_SIZE) {
+        PyErr_SetString(st->error, "incomplete payload");
+        return NULL;
+    }
+    buckets = read_uint32(&table);
+    count = read_uint32(&table);
+    victim_bucket = read_uint32(&table);
+    victim = read_uint16(&table);
+    victim_used = read_uint8(&table);
+    if (buckets == 0 || (buckets & (buckets - 1)) != 0 || victim_bucket >= buckets ||
+            victim_used > 1 || (victim_used && victim == 0) ||
+            count > (uint64_t)buckets * CUCKOO_SLOTS + 1) {
+        PyErr_SetString(st->error, "invalid filter table");
+        return NULL;
+    }
+    if (cuckoo_bytes(buckets) != len - CUCKOO_TABLE_SIZE) {
+        PyErr_SetString(st->error, "invalid data length");
+        return NULL;
+    }
+
+    self = (CuckooFilter *)PyObject_CallFunction((PyObject *)st->cuckoo_type, "Iz",
+        header->cardinality, hash_names[header->hash]);
+    if (self == NULL) {
+        return NULL;
+    }
+    if (self->cuckoo.buckets != buckets) {
+        Py_DECREF(self);
+        PyErr_SetString(st->error, "invalid data length");
+        return NULL;
+    }
+    memcpy(self->cuckoo.table, data + CUCKOO_TABLE_SIZE, cuckoo_bytes(buckets));
+    self->cuckoo.count = count;
+    self->cuckoo.victim_used = victim_used;
+    self->cuckoo.victim_bucket = victim_bucket;
+    self->cuckoo.victim = victim;
+    return (PyObject *)self;
+}
+
+static PyMethodDef CuckooFilter_methods[] = {
+    {"add", (PyCFunction)CuckooFilter_add, METH_O,
+     "add a member to the filter, raises pyblossom.error once it is full"},
+    {"remove", (PyCFunction)CuckooFilter_remove, METH_O,
+     "remove a member added before, returns False if it was not in the filter"},
+    {"contains", (PyCFunction)CuckooFilter_check, METH_O,
+     "check if member exists the filter"},
+    {"contains_many", (PyCFunction)(void (*)(void))CuckooFilter_contains_many, METH_FASTCALL | METH_KEYWORDS,
+     "check an iterable of members, or a buffer of width sized keys, returns a list of bools"},
+    {NULL}
+};
+
+static void
+CuckooFilter_dealloc(CuckooFilter *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    free(self->cuckoo.table);
+    if (self->lock != NULL) {
+        PyThread_free_lock(self->lock);
+    }
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static PyObject *
+CuckooFilter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    CuckooFilter *self;
+
+    self = (CuckooFilter *)type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->lock = PyThread_allocate_lock();
+        if (self->lock == NULL) {
+            Py_DECREF(self);
+            return PyErr_NoMemory();
+        }
+    }
+
+    return (PyObject *)self;
+}
+
+static int
+CuckooFilter_init(CuckooFilter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"capacity", "hash", NULL};
+    unsigned int capacity;
+    int hash;
+    const char *hash_name = NULL;
+    unsigned char *table;
+    uint32_t buckets;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "I|z", kwlist, &capacity, &hash_name)) {
+        return -1;
+    }
+    hash = HASH_MURMUR2;
+    if (hash_name != NULL && (hash = find_name(hash_names, hash_name, "hash")) < 0) {
+        return -1;
+    }
+    if (capacity < 1 || capacity > 0x7FFFFFFF) {
+        PyErr_SetString(PyExc_ValueError, "capacity must be between 1 and 2147483647");
+        return -1;
+    }
+
+    buckets = cuckoo_buckets(capacity);
+    table = (unsigned char *)calloc(cuckoo_bytes(buckets), 1);
+    if (table == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    free(self->cuckoo.table);
+    memset(&self->cuckoo, 0, sizeof(struct cuckoo));
+    self->cuckoo.table = table;
+    self->cuckoo.buckets = buckets;
+    self->cuckoo.rng = 0x9E3779B97F4A7C15ULL;
+    self->capacity = capacity;
+    self->hash = hash;
+    return 0;
+}
+
+/* manifests: a table of filters u32, their layout u8, 3 reserved bytes and
+ * the length u64 of each filter's payload, followed by those payloads */
+#define MANIFEST_TABLE_SIZE 8
+#define MANIFEST_FILTER_SIZE 8
+#define MANIFEST_MAX_FILTERS 65536
+
+/* swaps *slot for filter, which must have the parameters of the one there;
+ * what names the filter in errors */
+static int
+manifest_adopt(struct module_state *st, PyObject **slot, int layout, int hash, PyObject *filter,
+    const char *what, uint32_t i)
+{
+    struct bloom *have, *want = ((Filter *)*slot)->_bloom_struct;
+
+    if (!PyObject_TypeCheck(filter, st->filter_type)) {
+        PyErr_Format(PyExc_TypeError, "%ss must be Filter objects", what);
+        return -1;
+    }
+    have = ((Filter *)filter)->_bloom_struct;
+    if (((Filter *)filter)->layout != layout || ((Filter *)filter)->hash != hash ||
+            have->entries != want->entries || have->bytes != want->bytes || have->hashes != want->hashes) {
+        PyErr_Format(st->error, "%s %u does not match the manifest", what, (unsigned int)i);
+        return -1;
+    }
+    Py_INCREF(filter);
+    Py_SETREF(*slot, filter);
+    return 0;
+}
+
+/* The list of payloads of count filters, starting at filters[first] and
+ * wrapping around, and the manifest in front of them. */
+static int
+manifest_dump_parts(PyObject **filters, uint32_t count, uint32_t first, int kind, int entries, double error,
+    int layout, int hash, size_t align, int compress, PyObject **manifest, PyObject **payloads)
+{
+    size_t header_len = HEADER_V2_SIZE, len = MANIFEST_TABLE_SIZE + count * MANIFEST_FILTER_SIZE;
+    PyObject *payload;
+    char *out, *table;
+    uint32_t i;
+
+    if (align > 0)
+        header_len = (header_len + align - 1) / align * align;
+
+    *payloads = PyList_New(count);
+    if (*payloads == NULL) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        payload = filter_dump((Filter *)filters[(first + i) % count], align, compress);
+        if (payload == NULL) {
+            Py_CLEAR(*payloads);
+            return -1;
+        }
+        PyList_SET_ITEM(*payloads, i, payload);
+    }
+
+    *manifest = PyBytes_FromStringAndSize(NULL, header_len + len);
+    if (*manifest == NULL) {
+        Py_CLEAR(*payloads);
+        return -1;
+    }
+    out = PyBytes_AS_STRING(*manifest);
+    table = out + header_len;
+    write_uint32(&table, count);
+    memset(table, 0, 4);
+    *table = (char)layout;
+    table += 4;
+    for (i = 0; i < count; i++) {
+        write_uint64(&table, PyBytes_GET_SIZE(PyList_GET_ITEM(*payloads, i)));
+    }
+    write_header_fields(out, header_len, entries, error, kind, hash, (const unsigned char *)out + header_len,
+        len);
+    return 0;
+}
+
+/* the manifest followed by all payloads, consumes both */
+static PyObject *
+manifest_join(PyObject *manifest, PyObject *payloads)
+{
+    PyObject *serial;
+    Py_ssize_t i, len;
+    char *out;
+
+    len = PyBytes_GET_SIZE(manifest);
+    for (i = 0; i < PyList_GET_SIZE(payloads); i++) {
+        len += PyBytes_GET_SIZE(PyList_GET_ITEM(payloads, i));
+    }
+    serial = PyBytes_FromStringAndSize(NULL, len);
+    if (serial != NULL) {
+        out = PyBytes_AS_STRING(serial);
+        memcpy(out, PyBytes_AS_STRING(manifest), PyBytes_GET_SIZE(manifest));
+        out += PyBytes_GET_SIZE(manifest);
+        /* the payloads are ours alone, nothing changes them without the GIL */
+        Py_BEGIN_ALLOW_THREADS
+        for (i = 0; i < PyList_GET_SIZE(payloads); i++) {
+            memcpy(out, PyBytes_AS_STRING(PyList_GET_ITEM(payloads, i)),
+                PyBytes_GET_SIZE(PyList_GET_ITEM(payloads, i)));
+            out += PyBytes_GET_SIZE(PyList_GET_ITEM(payloads, i));
+        }
+        Py_END_ALLOW_THREADS
+    }
+    Py_DECREF(manifest);
+    Py_DECREF(payloads);
+    return serial;
+}
+
+/* Validates the manifest of a payload parse_header found to hold one and
+ * reads its table. Points *lengths at the payload lengths and sets *offset
+ * to the offset of the first payload. */
+static int
+manifest_parse(struct module_state *st, const struct filter_header *header, const char *buffer,
+    size_t buflen, uint32_t *count, int *layout, const char **lengths, size_t *offset)
+{
+    const char *table = buffer + header->header_len;
+
+    if (buflen - header->header_len < MANIFEST_TABLE_SIZE) {
+        PyErr_SetString(st->error, "incomplete payload");
+        return -1;
+    }
+    *count = read_uint32(&table);
+    *layout = read_uint8(&table);
+    table += 3;
+    if (*count == 0 || *count > MANIFEST_MAX_FILTERS || *layout >= LAYOUTS) {
+        PyErr_SetString(st->error, "invalid manifest");
+        return -1;
+    }
+    *offset = header->header_len + MANIFEST_TABLE_SIZE + (size_t)*count * MANIFEST_FILTER_SIZE;
+    if (*offset > buflen) {
+        PyErr_SetString(st->error, "incomplete payload");
+        return -1;
+    }
+    /* the filters carry their own checksums, this one only covers the manifest */
+    if (compute_checksum(buffer + sizeof(struct serialized_filter_header),
+            *offset - sizeof(struct serialized_filter_header)) != header->checksum) {
+        PyErr_SetString(st->error, "checksum mismatch");
+        return -1;
+    }
+    *lengths = table;
+    return 0;
+}
+
+/* loads the count payloads behind a manifest into filters, which must
+ * match them */
+static int
+manifest_load(struct module_state *st, const char *buffer, size_t buflen, const char *lengths, size_t offset,
+    PyObject **filters, uint32_t count, int layout, int hash, const char *what, int verify)
+{
+    struct filter_header header;
+    PyObject *filter;
+    uint64_t len;
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        len = read_uint64(&lengths);
+        if (len > buflen - offset) {
+            PyErr_SetString(st->error, "invalid data length");
+            return -1;
+        }
+        if (parse_header(st, buffer + offset, len, &header) < 0 ||
+                verify_payload(st, buffer + offset, len, &header, verify) < 0) {
+            return -1;
+        }
+        filter = load_bits(st, &header, buffer + offset + header.header_len, len - header.header_len);
+        if (filter == NULL) {
+            return -1;
+        }
+        if (manifest_adopt(st, &filters[i], layout, hash, filter, what, i) < 0) {
+            Py_DECREF(filter);
+            return -1;
+        }
+        Py_DECREF(filter);
+        offset += len;
+    }
+    if (offset != buflen) {
+        PyErr_SetString(st->error, "invalid data length");
+        return -1;
+    }
+    return 0;
+}
+
+/* ShardedFilter */
+#define SHARDED_MAX_SHARDS MANIFEST_MAX_FILTERS
+
+/* The shard of a key. The digest goes through a 64 bit finalizer first, so
+ * the keys of one shard still spread over all the probes of its filter. */
+static uint32_t
+sharded_route(const struct digest *digest, uint32_t nshards)
+{
+    uint64_t h = pack_digest(digest);
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return fastrange32((uint32_t)(h >> 32), nshards);
+}
+
+static void
+sharded_clear(ShardedFilter *self)
+{
+    uint32_t i;
+
+    for (i = 0; i < self->nshards; i++) {
+        Py_XDECREF(self->shards[i]);
+    }
+    PyMem_Free(self->shards);
+    self->shards = NULL;
+    self->nshards = 0;
+}
+
+/* Marks the filter and its shards busy, or with delta -1 idle again, while
+ * a call uses them and may release the GIL midway. A busy filter cannot be
+ * re-initialized, which would drop the shards. */
+static void
+sharded_hold(ShardedFilter *self, int delta)
+{
+    uint32_t i;
+
+    self->busy += delta;
+    for (i = 0; i < self->nshards; i++) {
+        ((Filter *)self->shards[i])->busy += delta;
+    }
+}
+
+/* digests a key and returns the shard it goes to */
+static Filter *
+sharded_get_shard(ShardedFilter *self, PyObject *key, struct digest *digest)
+{
+    const char *buffer;
+    Py_ssize_t buflen;
+    uint64_t scratch;
+
+    if (check_init(self, self->shards) < 0 || get_key(key, &buffer, &buflen, &scratch) < 0) {
+        return NULL;
+    }
+    digest_key(self->hash, buffer, buflen, digest);
+    return (Filter *)self->shards[sharded_route(digest, self->nshards)];
+}
+
+/* swaps shard i for filter, which must have the parameters of the one there */
+static int
+sharded_adopt(struct module_state *st, ShardedFilter *self, uint32_t i, PyObject *filter)
+{
+    return manifest_adopt(st, &self->shards[i], self->layout, self->hash, filter, "shard", i);
+}
+
+static PyObject *
+ShardedFilter_add(ShardedFilter *self, PyObject *key)
+{
+    struct digest digest;
+    Filter *shard;
+
+    shard = sharded_get_shard(self, key, &digest);
+    if (shard == NULL) {
+        return NULL;
+    }
+
+    /* waiting for the lock releases the GIL, a re-init may drop the shard meanwhile */
+    Py_INCREF(shard);
+    ENTER_FILTER(shard);
+    if (filter_make_writable(shard) < 0) {
+        LEAVE_FILTER(shard);
+        Py_DECREF(shard);
+        return NULL;
+    }
+    filter_probe(shard, &digest, 1);
+    LEAVE_FILTER(shard);
+    Py_DECREF(shard);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+ShardedFilter_check(ShardedFilter *self, PyObject *key)
+{
+    struct digest digest;
+    Filter *shard;
+
+    shard = sharded_get_shard(self, key, &digest);
+    if (shard == NULL) {
+        return NULL;
+    }
+    if (filter_probe(shard, &digest, 0))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+/* Digests the keys of batch into sorted, grouped by shard: the digests of
+ * shard i end up in [starts[i], starts[i + 1]). */
+static void
+sharded_partition(ShardedFilter *self, const struct key_batch *batch, uint64_t *digests, uint32_t *routes,
+    uint64_t *sorted, Py_ssize_t *starts)
+{
+    struct digest digest;
+    Py_ssize_t i;
+
+    hash_keys(self->hash, batch, digests);
+    memset(starts, 0, (self->nshards + 1) * sizeof(Py_ssize_t));
+    for (i = 0; i < batch->count; i++) {
+        unpack_digest(digests[i], &digest);
+        routes[i] = sharded_route(&digest, self->nshards);
+        starts[routes[i] + 1]++;
+    }
+    for (i = 0; i < self->nshards; i++) {
+        starts[i + 1] += starts[i];
+    }
+    /* places each digest at its shard's cursor, leaving starts[i] at the end of shard i */
+    for (i = 0; i < batch->count; i++) {
+        sorted[starts[routes[i]]++] = digests[i];
+    }
+    memmove(starts + 1, starts, self->nshards * sizeof(Py_ssize_t));
+    starts[0] = 0;
+}
+
+static void
+sharded_add_digests(Filter *shard, const uint64_t *digests, Py_ssize_t count)
+{
+    struct digest digest;
+    Py_ssize_t i;
+
+    for (i = 0; i < count; i++) {
+        unpack_digest(digests[i], &digest);
+        filter_probe(shard, &digest, 1);
+    }
+}
+
+/* the grouped digests of a batch, for threads to take shards of */
+struct sharded_job {
+    ShardedFilter *self;
+    const uint64_t *sorted;
+    const Py_ssize_t *starts;
+    const struct key_batch *batch;
+    char *hits;
+};
+
+static void
+sharded_add_range(void *arg, size_t begin, size_t end)
+{
+    struct sharded_job *job = (struct sharded_job *)arg;
+    Filter *shard;
+    size_t i;
+
+    for (i = begin; i < end; i++) {
+        if (job->starts[i + 1] == job->starts[i])
+            continue;
+        shard = (Filter *)job->self->shards[i];
+        PyThread_acquire_lock(shard->lock, 1);
+        filter_wait_dump(shard);
+        sharded_add_digests(shard, job->sorted + job->starts[i], job->starts[i + 1] - job->starts[i]);
+        PyThread_release_lock(shard->lock);
+    }
+}
+
+/* Adds a batch one shard at a time, so each shard's lock is taken once and
+ * its keys land in its bit array back to back. threads=N spreads the
+ * shards over N threads. */
+static PyObject *
+ShardedFilter_add_many(ShardedFilter *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *keys;
+    Py_ssize_t width, *starts = NULL, count;
+    struct key_batch batch;
+    uint64_t *digests = NULL, *sorted = NULL;
+    uint32_t *routes = NULL, i;
+    struct sharded_job job;
+    Filter *shard;
+    int rc = -1, threads;
+
+    if (check_init(self, self->shards) < 0) {
+        return NULL;
+    }
+    if (parse_keys_args(args, nargs, kwnames, &keys, &width, &threads, NULL) < 0) {
+        return NULL;
+    }
+    if (collect_keys(OBJECT_STATE(self), keys, width, &batch) < 0) {
+        return NULL;
+    }
+    sharded_hold(self, 1);
+
+    digests = (uint64_t *)PyMem_Malloc((batch.count + 1) * sizeof(uint64_t));
+    sorted = (uint64_t *)PyMem_Malloc((batch.count + 1) * sizeof(uint64_t));
+    routes = (uint32_t *)PyMem_Malloc((batch.count + 1) * sizeof(uint32_t));
+    starts = (Py_ssize_t *)PyMem_Malloc((self->nshards + 1) * sizeof(Py_ssize_t));
+    if (digests == NULL || sorted == NULL || routes == NULL || starts == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (batch.count >= GIL_MINKEYS) {
+        Py_BEGIN_ALLOW_THREADS
+        sharded_partition(self, &batch, digests, routes, sorted, starts);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        sharded_partition(self, &batch, digests, routes, sorted, starts);
+    }
+
+    for (i = 0; i < self->nshards; i++) {
+        count = starts[i + 1] - starts[i];
+        if (count == 0)
+            continue;
+        shard = (Filter *)self->shards[i];
+        ENTER_FILTER(shard);
+        if (filter_make_writable(shard) < 0) {
+            LEAVE_FILTER(shard);
+            goto done;
+        }
+        if (threads > 1) {
+            /* the pool takes the shard's lock again */
+            LEAVE_FILTER(shard);
+            continue;
+        }
+        if (count >= GIL_MINKEYS) {
+            Py_BEGIN_ALLOW_THREADS
+            sharded_add_digests(shard, sorted + starts[i], count);
+            Py_END_ALLOW_THREADS
+        }
+        else {
+            sharded_add_digests(shard, sorted + starts[i], count);
+        }
+        LEAVE_FILTER(shard);
+    }
+    if (threads > 1) {
+        job.self = self;
+        job.sorted = sorted;
+        job.starts = starts;
+        Py_BEGIN_ALLOW_THREADS
+        pool_run(sharded_add_range, &job, self->nshards, 1, threads);
+        Py_END_ALLOW_THREADS
+    }
+    rc = 0;
+
+done:
+    sharded_hold(self, -1);
+    PyMem_Free(digests);
+    PyMem_Free(sorted);
+    PyMem_Free(routes);
+    PyMem_Free(starts);
+    release_keys(&batch);
+    if (rc < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static void
+sharded_check_range(void *arg, size_t begin, size_t end)
+{
+    struct sharded_job *job = (struct sharded_job *)arg;
+    ShardedFilter *self = job->self;
+    struct digest digest;
+    size_t i;
+
+    for (i = begin; i < end; i++) {
+        digest_key(self->hash, job->batch->ptrs[i], job->batch->lens[i], &digest);
+        job->hits[i] = filter_probe((Filter *)self->shards[sharded_route(&digest, self->nshards)], &digest, 0);
+    }
+}
+
+static PyObject *
+ShardedFilter_contains_many(ShardedFilter *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *keys, *result = NULL;
+    Py_ssize_t width;
+    struct key_batch batch;
+    struct sharded_job job;
+    char *hits;
+    int threads;
+
+    if (check_init(self, self->shards) < 0) {
+        return NULL;
+    }
+    if (parse_keys_args(args, nargs, kwnames, &keys, &width, &threads, NULL) < 0) {
+        return NULL;
+    }
+    if (collect_keys(OBJECT_STATE(self), keys, width, &batch) < 0) {
+        return NULL;
+    }
+    sharded_hold(self, 1);
+
+    hits = (char *)PyMem_Malloc(batch.count + 1);
+    if (hits == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    job.self = self;
+    job.batch = &batch;
+    job.hits = hits;
+    if (threads > 1 || batch.count >= GIL_MINKEYS) {
+        Py_BEGIN_ALLOW_THREADS
+        pool_run(sharded_check_range, &job, batch.count, POOL_GRAIN_KEYS, threads);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        sharded_check_range(&job, 0, batch.count);
+    }
+    result = hits_list(hits, batch.count);
+    PyMem_Free(hits);
+
+done:
+    sharded_hold(self, -1);
+    release_keys(&batch);
+    return result;
+}
+
+static PyObject *
+ShardedFilter_shards(ShardedFilter *self, PyObject *args)
+{
+    PyObject *result;
+    uint32_t i;
+
+    result = PyList_New(self->nshards);
+    if (result == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < self->nshards; i++) {
+        Py_INCREF(self->shards[i]);
+        PyList_SET_ITEM(result, i, self->shards[i]);
+    }
+    return result;
+}
+
+/* the list of shard payloads and the manifest in front of them */
+static int
+sharded_dump_parts(ShardedFilter *self, size_t align, int compress, PyObject **manifest, PyObject **payloads)
+{
+    int rc;
+
+    if (check_init(self, self->shards) < 0) {
+        return -1;
+    }
+    sharded_hold(self, 1);
+    rc = manifest_dump_parts(self->shards, self->nshards, 0, LAYOUT_SHARDED, self->entries, self->error,
+        self->layout, self->hash, align, compress, manifest, payloads);
+    sharded_hold(self, -1);
+    return rc;
+}
+
+static PyObject *
+ShardedFilter_dump_shards(ShardedFilter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"align", "compress", NULL};
+    PyObject *manifest, *payloads;
+    Py_ssize_t align = 0;
+    int compress = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|np", kwlist, &align, &compress)) {
+        return NULL;
+    }
+    if (align < 0 || align > HEADER_MAX_ALIGN) {
+        PyErr_Format(PyExc_ValueError, "align must be between 0 and %d", HEADER_MAX_ALIGN);
+        return NULL;
+    }
+    if (sharded_dump_parts(self, align, compress, &manifest, &payloads) < 0) {
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", manifest, payloads);
+}
+
+/* the manifest followed by all shard payloads */
+static PyObject *
+sharded_dump(ShardedFilter *self, size_t align, int compress)
+{
+    PyObject *manifest, *payloads;
+
+    if (sharded_dump_parts(self, align, compress, &manifest, &payloads) < 0) {
+        return NULL;
+    }
+    return manifest_join(manifest, payloads);
+}
+
+/* Validates the manifest of a payload parse_header found to be sharded and
+ * creates a ShardedFilter for it, with empty shards. Points *lengths at the
+ * table of payload lengths and returns the offset of the first payload. */
+static ShardedFilter *
+sharded_from_manifest(struct module_state *st, const struct filter_header *header, const char *buffer,
+    size_t buflen, const char **lengths, size_t *offset)
+{
+    uint32_t nshards;
+    int layout;
+
+    if (manifest_parse(st, header, buffer, buflen, &nshards, &layout, lengths, offset) < 0) {
+        return NULL;
+    }
+    return (ShardedFilter *)PyObject_CallFunction((PyObject *)st->sharded_type, "idIss",
+        header->cardinality, 1.0 / header->error_rate, nshards, layout_names[layout],
+        hash_names[header->hash]);
+}
+
+/* rebuilds a ShardedFilter from its manifest and the shard payloads behind it */
+static PyObject *
+load_sharded(struct module_state *st, const struct filter_header *header, const char *buffer,
+    size_t buflen, int verify)
+{
+    ShardedFilter *self;
+    const char *lengths;
+    size_t offset;
+
+    self = sharded_from_manifest(st, header, buffer, buflen, &lengths, &offset);
+    if (self == NULL) {
+        return NULL;
+    }
+    if (manifest_load(st, buffer, buflen, lengths, offset, self->shards, self->nshards, self->layout,
+            self->hash, "shard", verify) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+static PyObject *
+load_shards(PyObject *self, PyObject *args)
+{
+    struct module_state *st = get_state(self);
+    struct filter_header header;
+    ShardedFilter *sharded = NULL;
+    PyObject *shards, *seq = NULL;
+    const char *lengths;
+    size_t offset;
+    Py_buffer manifest;
+    uint32_t i;
+
+    if (!PyArg_ParseTuple(args, "y*O", &manifest, &shards)) {
+        return NULL;
+    }
+    if (parse_header(st, (const char *)manifest.buf, manifest.len, &header) < 0) {
+        goto done;
+    }
+    if (header.layout != LAYOUT_SHARDED) {
+        PyErr_SetString(st->error, "not a sharded filter manifest");
+        goto done;
+    }
+    seq = PySequence_Fast(shards, "shards must be an iterable");
+    if (seq == NULL) {
+        goto done;
+    }
+    sharded = sharded_from_manifest(st, &header, (const char *)manifest.buf, manifest.len, &lengths, &offset);
+    if (sharded == NULL) {
+        goto done;
+    }
+    if (PySequence_Fast_GET_SIZE(seq) != sharded->nshards) {
+        PyErr_Format(st->error, "expected %u shards", (unsigned int)sharded->nshards);
+        Py_CLEAR(sharded);
+        goto done;
+    }
+    for (i = 0; i < sharded->nshards; i++) {
+        if (sharded_adopt(st, sharded, i, PySequence_Fast_GET_ITEM(seq, i)) < 0) {
+            Py_CLEAR(sharded);
+            goto done;
+        }
+    }
+
+done:
+    Py_XDECREF(seq);
+    PyBuffer_Release(&manifest);
+    return (PyObject *)sharded;
+}
+
+static PyMethodDef ShardedFilter_methods[] = {
+    {"add", (PyCFunction)ShardedFilter_add, METH_O,
+     "add a member to the shard it hashes to"},
+    {"contains", (PyCFunction)ShardedFilter_check, METH_O,
+     "check if member exists the filter"},
+    {"add_many", (PyCFunction)(void (*)(void))ShardedFilter_add_many, METH_FASTCALL | METH_KEYWORDS,
+     "add an iterable of members, or a buffer of width sized keys, one shard at a time; "
+     "threads=N spreads the shards over N threads"},
+    {"contains_many", (PyCFunction)(void (*)(void))ShardedFilter_contains_many, METH_FASTCALL | METH_KEYWORDS,
+     "check an iterable of members, or a buffer of width sized keys, returns a list of bools; "
+     "threads=N checks them from N threads"},
+    {"shards", (PyCFunction)ShardedFilter_shards, METH_NOARGS,
+     "return the shards as a list of Filters"},
+    {"dump_shards", (PyCFunction)ShardedFilter_dump_shards, METH_VARARGS | METH_KEYWORDS,
+     "return (manifest, payloads): the manifest and a dump of each shard, which load() or "
+     "open_mmap can read on their own and load_shards puts back together"},
+    {NULL}
+};
+
+static void
+ShardedFilter_dealloc(ShardedFilter *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    sharded_clear(self);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static int
+ShardedFilter_init(ShardedFilter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"entries", "error", "shards", "layout", "hash", NULL};
+    int entries, layout, hash;
+    unsigned int nshards = 0, i;
+    double error;
+    const char *layout_name = NULL, *hash_name = NULL;
+    PyObject **shards;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "idI|zz", kwlist, &entries, &error, &nshards,
+            &layout_name, &hash_name)) {
+        return -1;
+    }
+    if (self->busy > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot re-initialize a filter while other calls use it");
+        return -1;
+    }
+    layout = LAYOUT_STANDARD;
+    if (layout_name != NULL && (layout = find_name(layout_names, layout_name, "layout")) < 0) {
+        return -1;
+    }
+    hash = HASH_MURMUR2;
+    if (hash_name != NULL && (hash = find_name(hash_names, hash_name, "hash")) < 0) {
+        return -1;
+    }
+    if (entries < 1 || error <= 0 || error >= 1) {
+        PyErr_SetString(PyExc_ValueError, "entries must be positive and error between 0 and 1");
+        return -1;
+    }
+    if (nshards < 1 || nshards > SHARDED_MAX_SHARDS) {
+        PyErr_Format(PyExc_ValueError, "shards must be between 1 and %d", SHARDED_MAX_SHARDS);
+        return -1;
+    }
+
+    /* a key is only ever probed in its own shard, so each gets the whole error */
+    shards = (PyObject **)PyMem_Calloc(nshards, sizeof(PyObject *));
+    if (shards == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < nshards; i++) {
+        shards[i] = PyObject_CallFunction((PyObject *)OBJECT_STATE(self)->filter_type, "idOsis",
+            (int)(((unsigned int)entries + nshards - 1) / nshards), error, Py_None, layout_names[layout], 0,
+            hash_names[hash]);
+        if (shards[i] == NULL) {
+            while (i-- > 0) {
+                Py_DECREF(shards[i]);
+            }
+            PyMem_Free(shards);
+            return -1;
+        }
+    }
+
+    sharded_clear(self);
+    self->shards = shards;
+    self->nshards = nshards;
+    self->entries = entries;
+    self->error = error;
+    self->layout = layout;
+    self->hash = hash;
+    return 0;
+}
+
+/* RotatingFilter */
+#define ROTATING_MAX_GENERATIONS MANIFEST_MAX_FILTERS
+
+static void
+rotating_clear(RotatingFilter *self)
+{
+    uint32_t i;
+
+    for (i = 0; i < self->ngenerations; i++) {
+        Py_XDECREF(self->generations[i]);
+    }
+    PyMem_Free(self->generations);
+    self->generations = NULL;
+    self->ngenerations = 0;
+    self->newest = 0;
+}
+
+/* sharded_hold for the generations */
+static void
+rotating_hold(RotatingFilter *self, int delta)
+{
+    uint32_t i;
+
+    self->busy += delta;
+    for (i = 0; i < self->ngenerations; i++) {
+        ((Filter *)self->generations[i])->busy += delta;
+    }
+}
+
+/* generation i, counting back from the newest */
+static Filter *
+rotating_generation(RotatingFilter *self, uint32_t i)
+{
+    return (Filter *)self->generations[(self->newest + self->ngenerations - i) % self->ngenerations];
+}
+
+/* Returns whether any generation holds digest. The bits of all of them are
+ * prefetched before the first is tested, so their misses overlap. */
+static int
+rotating_probe(RotatingFilter *self, struct digest *digest)
+{
+    uint32_t i;
+
+    for (i = 0; i < self->ngenerations; i++) {
+        filter_prefetch((Filter *)self->generations[i], digest, 0);
+    }
+    for (i = 0; i < self->ngenerations; i++) {
+        if (filter_probe(rotating_generation(self, i), digest, 0))
+            return 1;
+    }
+    return 0;
+}
+
+/* zeroes a filter's bits, for a generation that is reused */
+static int
+filter_reset(Filter *self)
+{
+    struct bloom *bloom_struct = self->_bloom_struct;
+
+    ENTER_FILTER(self);
+    if (filter_make_writable(self) < 0) {
+        LEAVE_FILTER(self);
+        return -1;
+    }
+    if (bloom_struct->bytes >= GIL_MINSIZE) {
+        BEGIN_FILTER_THREADS(self)
+        memset(bloom_struct->bf, 0, bloom_struct->bytes);
+        END_FILTER_THREADS(self)
+    }
+    else {
+        memset(bloom_struct->bf, 0, bloom_struct->bytes);
+    }
+    self->adds = 0;
+    self->delta_untracked = 1;
+    LEAVE_FILTER(self);
+    return 0;
+}
+
+static PyObject *
+RotatingFilter_add(RotatingFilter *self, PyObject *key)
+{
+    Filter *newest;
+    PyObject *result;
+
+    if (check_init(self, self->generations) < 0) {
+        return NULL;
+    }
+    newest = rotating_generation(self, 0);
+    Py_INCREF(newest);
+    result = Filter_add(newest, key);
+    Py_DECREF(newest);
+    return result;
+}
+
+static PyObject *
+RotatingFilter_check(RotatingFilter *self, PyObject *key)
+{
+    const char *buffer;
+    Py_ssize_t buflen;
+    uint64_t scratch;
+    struct digest digest;
+
+    if (check_init(self, self->generations) < 0 || get_key(key, &buffer, &buflen, &scratch) < 0) {
+        return NULL;
+    }
+    digest_key(self->hash, buffer, buflen, &digest);
+    if (rotating_probe(self, &digest))
+        Py_RETURN_TRUE;
+    else
+        Py_RETURN_FALSE;
+}
+
+static PyObject *
+RotatingFilter_add_many(RotatingFilter *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    Filter *newest;
+    PyObject *result;
+
+    if (check_init(self, self->generations) < 0) {
+        return NULL;
+    }
+    /* a rotation while the GIL is released must not free it */
+    newest = rotating_generation(self, 0);
+    Py_INCREF(newest);
+    result = Filter_add_many(newest, args, nargs, kwnames);
+    Py_DECREF(newest);
+    return result;
+}
+
+struct rotating_job {
+    RotatingFilter *self;
+    const struct key_batch *batch;
+    char *hits;
+};
+
+static void
+rotating_check_range(void *arg, size_t begin, size_t end)
+{
+    struct rotating_job *job = (struct rotating_job *)arg;
+    struct digest digest;
+    size_t i;
+
+    for (i = begin; i < end; i++) {
+        digest_key(job->self->hash, job->batch->ptrs[i], job->batch->lens[i], &digest);
+        job->hits[i] = rotating_probe(job->self, &digest);
+    }
+}
+
+static PyObject *
+RotatingFilter_contains_many(RotatingFilter *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *keys, *result = NULL;
+    Py_ssize_t width;
+    struct key_batch batch;
+    struct rotating_job job;
+    char *hits;
+    int threads;
+
+    if (check_init(self, self->generations) < 0) {
+        return NULL;
+    }
+    if (parse_keys_args(args, nargs, kwnames, &keys, &width, &threads, NULL) < 0) {
+        return NULL;
+    }
+    if (collect_keys(OBJECT_STATE(self), keys, width, &batch) < 0) {
+        return NULL;
+    }
+    rotating_hold(self, 1);
+
+    hits = (char *)PyMem_Malloc(batch.count + 1);
+    if (hits == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    job.self = self;
+    job.batch = &batch;
+    job.hits = hits;
+    if (threads > 1 || batch.count >= GIL_MINKEYS) {
+        Py_BEGIN_ALLOW_THREADS
+        pool_run(rotating_check_range, &job, batch.count, POOL_GRAIN_KEYS, threads);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        rotating_check_range(&job, 0, batch.count);
+    }
+    result = hits_list(hits, batch.count);
+    PyMem_Free(hits);
+
+done:
+    rotating_hold(self, -1);
+    release_keys(&batch);
+    return result;
+}
+
+/* clears the oldest generation and makes it the newest */
+static PyObject *
+RotatingFilter_rotate(RotatingFilter *self, PyObject *args)
+{
+    uint32_t oldest;
+    int rc;
+
+    if (check_init(self, self->generations) < 0) {
+        return NULL;
+    }
+    oldest = (self->newest + 1) % self->ngenerations;
+    rotating_hold(self, 1);
+    rc = filter_reset((Filter *)self->generations[oldest]);
+    rotating_hold(self, -1);
+    if (rc < 0) {
+        return NULL;
+    }
+    self->newest = oldest;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+RotatingFilter_generations(RotatingFilter *self, PyObject *args)
+{
+    PyObject *result;
+    uint32_t i;
+    Filter *generation;
+
+    result = PyList_New(self->ngenerations);
+    if (result == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < self->ngenerations; i++) {
+        generation = rotating_generation(self, self->ngenerations - 1 - i);
+        Py_INCREF(generation);
+        PyList_SET_ITEM(result, i, (PyObject *)generation);
+    }
+    return result;
+}
+
+/* the manifest and the generations behind it, oldest first */
+static PyObject *
+rotating_dump(RotatingFilter *self, size_t align, int compress)
+{
+    PyObject *manifest, *payloads;
+    int rc;
+
+    if (check_init(self, self->generations) < 0) {
+        return NULL;
+    }
+    rotating_hold(self, 1);
+    rc = manifest_dump_parts(self->generations, self->ngenerations, (self->newest + 1) % self->ngenerations,
+        LAYOUT_ROTATING, self->entries, self->error, self->layout, self->hash, align, compress, &manifest,
+        &payloads);
+    rotating_hold(self, -1);
+    if (rc < 0) {
+        return NULL;
+    }
+    return manifest_join(manifest, payloads);
+}
+
+static PyObject *
+load_rotating(struct module_state *st, const struct filter_header *header, const char *buffer,
+    size_t buflen, int verify)
+{
+    RotatingFilter *self;
+    const char *lengths;
+    size_t offset;
+    uint32_t count;
+    int layout;
+
+    if (manifest_parse(st, header, buffer, buflen, &count, &layout, &lengths, &offset) < 0) {
+        return NULL;
+    }
+    self = (RotatingFilter *)PyObject_CallFunction((PyObject *)st->rotating_type, "idIss",
+        header->cardinality, 1.0 / header->error_rate, count, layout_names[layout], hash_names[header->hash]);
+    if (self == NULL) {
+        return NULL;
+    }
+    if (manifest_load(st, buffer, buflen, lengths, offset, self->generations, self->ngenerations, self->layout,
+            self->hash, "generation", verify) < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    self->newest = self->ngenerations - 1;
+    return (PyObject *)self;
+}
+
+static PyMethodDef RotatingFilter_methods[] = {
+    {"add", (PyCFunction)RotatingFilter_add, METH_O,
+     "add a member to the newest generation"},
+    {"contains", (PyCFunction)RotatingFilter_check, METH_O,
+     "check if member exists in any generation"},
+    {"add_many", (PyCFunction)(void (*)(void))RotatingFilter_add_many, METH_FASTCALL | METH_KEYWORDS,
+     "add an iterable of members, or a buffer of width sized keys, to the newest generation; "
+     "threads=N adds them from N threads"},
+    {"contains_many", (PyCFunction)(void (*)(void))RotatingFilter_contains_many, METH_FASTCALL | METH_KEYWORDS,
+     "check an iterable of members, or a buffer of width sized keys, against all generations, "
+     "returns a list of bools; threads=N checks them from N threads"},
+    {"rotate", (PyCFunction)RotatingFilter_rotate, METH_NOARGS,
+     "clear the oldest generation and make it the newest"},
+    {"generations", (PyCFunction)RotatingFilter_generations, METH_NOARGS,
+     "return the generations as a list of Filters, oldest first"},
+    {NULL}
+};
+
+static void
+RotatingFilter_dealloc(RotatingFilter *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    rotating_clear(self);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static int
+RotatingFilter_init(RotatingFilter *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"entries", "error", "generations", "layout", "hash", NULL};
+    int entries, layout, hash;
+    unsigned int ngenerations = 2, i;
+    double error;
+    const char *layout_name = NULL, *hash_name = NULL;
+    PyObject **generations;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "id|Izz", kwlist, &entries, &error, &ngenerations,
+            &layout_name, &hash_name)) {
+        return -1;
+    }
+    if (self->busy > 0) {
+        PyErr_SetString(PyExc_RuntimeError, "cannot re-initialize a filter while other calls use it");
+        return -1;
+    }
+    layout = LAYOUT_STANDARD;
+    if (layout_name != NULL && (layout = find_name(layout_names, layout_name, "layout")) < 0) {
+        return -1;
+    }
+    hash = HASH_MURMUR2;
+    if (hash_name != NULL && (hash = find_name(hash_names, hash_name, "hash")) < 0) {
+        return -1;
+    }
+    if (entries < 1 || error <= 0 || error >= 1) {
+        PyErr_SetString(PyExc_ValueError, "entries must be positive and error between 0 and 1");
+        return -1;
+    }
+    if (ngenerations < 1 || ngenerations > ROTATING_MAX_GENERATIONS) {
+        PyErr_Format(PyExc_ValueError, "generations must be between 1 and %d", ROTATING_MAX_GENERATIONS);
+        return -1;
+    }
+
+    /* each generation holds a period's keys at the error given, as separate filters would */
+    generations = (PyObject **)PyMem_Calloc(ngenerations, sizeof(PyObject *));
+    if (generations == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < ngenerations; i++) {
+        generations[i] = PyObject_CallFunction((PyObject *)OBJECT_STATE(self)->filter_type, "idOsis",
+            entries, error, Py_None, layout_names[layout], 0, hash_names[hash]);
+        if (generations[i] == NULL) {
+            while (i-- > 0) {
+                Py_DECREF(generations[i]);
+            }
+            PyMem_Free(generations);
+            return -1;
+        }
+    }
+
+    rotating_clear(self);
+    self->generations = generations;
+    self->ngenerations = ngenerations;
+    self->newest = ngenerations - 1;
+    self->entries = entries;
+    self->error = error;
+    self->layout = layout;
+    self->hash = hash;
+    return 0;
+}
+
+/* FilterHandle */
+static int
+handle_check(struct module_state *st, PyObject *filter)
+{
+    if (!PyObject_TypeCheck(filter, st->filter_type)) {
+        PyErr_SetString(PyExc_TypeError, "a FilterHandle holds Filter objects");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+FilterHandle_check(FilterHandle *self, PyObject *key)
+{
+    PyObject *current = self->current, *result;
+
+    if (check_init(self, current) < 0) {
+        return NULL;
+    }
+    /* the key's __index__ may swap the filter out */
+    Py_INCREF(current);
+    result = Filter_check((Filter *)current, key);
+    Py_DECREF(current);
+    return result;
+}
+
+static PyObject *
+FilterHandle_contains_many(FilterHandle *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *current = self->current, *result;
+
+    if (check_init(self, current) < 0) {
+        return NULL;
+    }
+    /* the filter must outlive a swap while the call runs without the GIL */
+    Py_INCREF(current);
+    result = Filter_contains_many((Filter *)current, args, nargs, kwnames);
+    Py_DECREF(current);
+    return result;
+}
+
+static PyObject *
+FilterHandle_current(FilterHandle *self, PyObject *args)
+{
+    if (check_init(self, self->current) < 0) {
+        return NULL;
+    }
+    Py_INCREF(self->current);
+    return self->current;
+}
+
+/* makes filter the current one and returns the one it replaced */
+static PyObject *
+FilterHandle_swap(FilterHandle *self, PyObject *filter)
+{
+    PyObject *old = self->current;
+
+    if (check_init(self, old) < 0 || handle_check(OBJECT_STATE(self), filter) < 0) {
+        return NULL;
+    }
+    Py_INCREF(filter);
+    self->current = filter;
+    return old;
+}
+
+static PyMethodDef FilterHandle_methods[] = {
+    {"contains", (PyCFunction)FilterHandle_check, METH_O,
+     "check if member exists in the current filter"},
+    {"contains_many", (PyCFunction)(void (*)(void))FilterHandle_contains_many, METH_FASTCALL | METH_KEYWORDS,
+     "Filter.contains_many on the current filter, which swap() does not wait for"},
+    {"current", (PyCFunction)FilterHandle_current, METH_NOARGS,
+     "return the current filter"},
+    {"swap", (PyCFunction)FilterHandle_swap, METH_O,
+     "make a Filter, e.g. one mapped with open_mmap or loaded with copy=False, the current one "
+     "without copying it; calls still running keep the previous one, which is returned"},
+    {NULL}
+};
+
+static void
+FilterHandle_dealloc(FilterHandle *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    Py_XDECREF(self->current);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static int
+FilterHandle_init(FilterHandle *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"filter", NULL};
+    PyObject *filter;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &filter)) {
+        return -1;
+    }
+    if (handle_check(OBJECT_STATE(self), filter) < 0) {
+        return -1;
+    }
+    Py_INCREF(filter);
+    Py_XSETREF(self->current, filter);
+    return 0;
+}
+
+#ifdef Py_TPFLAGS_IMMUTABLETYPE
+#define TYPE_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_IMMUTABLETYPE)
+#else
+#define TYPE_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE)
+#endif
+
+static PyType_Slot Filter_slots[] = {
+    {Py_tp_doc, "Filter objects"},
+    {Py_tp_dealloc, Filter_dealloc},
+    {Py_tp_new, Filter_new},
+    {Py_tp_init, Filter_init},
+    {Py_tp_methods, Filter_methods},
+    {Py_nb_or, Filter_or},
+    {Py_nb_and, Filter_and},
+    {Py_nb_inplace_or, Filter_ior},
+    {Py_nb_inplace_and, Filter_iand},
+    {Py_bf_getbuffer, Filter_getbuffer},
+    {Py_bf_releasebuffer, Filter_releasebuffer},
+    {0, NULL}
+};
+
+static PyType_Spec Filter_spec = {
+    "pyblossom.Filter", sizeof(Filter), 0, TYPE_FLAGS, Filter_slots
+};
+
+static PyType_Slot CountingFilter_slots[] = {
+    {Py_tp_doc, "CountingFilter objects"},
+    {Py_tp_dealloc, CountingFilter_dealloc},
+    {Py_tp_new, CountingFilter_new},
+    {Py_tp_init, CountingFilter_init},
+    {Py_tp_methods, CountingFilter_methods},
+    {0, NULL}
+};
+
+static PyType_Spec CountingFilter_spec = {
+    "pyblossom.CountingFilter", sizeof(CountingFilter), 0, TYPE_FLAGS, CountingFilter_slots
+};
+
+static PyType_Slot ScalableFilter_slots[] = {
+    {Py_tp_doc, "ScalableFilter objects"},
+    {Py_tp_dealloc, ScalableFilter_dealloc},
+    {Py_tp_new, ScalableFilter_new},
+    {Py_tp_init, ScalableFilter_init},
+    {Py_tp_methods, ScalableFilter_methods},
+    {Py_sq_length, ScalableFilter_length},
+    {0, NULL}
+};
+
+static PyType_Spec ScalableFilter_spec = {
+    "pyblossom.ScalableFilter", sizeof(ScalableFilter), 0, TYPE_FLAGS, ScalableFilter_slots
+};
+
+static PyType_Slot StaticFilter_slots[] = {
+    {Py_tp_doc, "StaticFilter objects"},
+    {Py_tp_dealloc, StaticFilter_dealloc},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, StaticFilter_init},
+    {Py_tp_methods, StaticFilter_methods},
+    {Py_sq_length, StaticFilter_length},
+    {0, NULL}
+};
+
+static PyType_Spec StaticFilter_spec = {
+    "pyblossom.StaticFilter", sizeof(StaticFilter), 0, TYPE_FLAGS, StaticFilter_slots
+};
+
+static PyType_Slot CuckooFilter_slots[] = {
+    {Py_tp_doc, "CuckooFilter objects"},
+    {Py_tp_dealloc, CuckooFilter_dealloc},
+    {Py_tp_new, CuckooFilter_new},
+    {Py_tp_init, CuckooFilter_init},
+    {Py_tp_methods, CuckooFilter_methods},
+    {Py_sq_length, CuckooFilter_length},
+    {0, NULL}
+};
+
+static PyType_Spec CuckooFilter_spec = {
+    "pyblossom.CuckooFilter", sizeof(CuckooFilter), 0, TYPE_FLAGS, CuckooFilter_slots
+};
+
+static PyType_Slot ShardedFilter_slots[] = {
+    {Py_tp_doc, "ShardedFilter objects"},
+    {Py_tp_dealloc, ShardedFilter_dealloc},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, ShardedFilter_init},
+    {Py_tp_methods, ShardedFilter_methods},
+    {0, NULL}
+};
+
+static PyType_Spec ShardedFilter_spec = {
+    "pyblossom.ShardedFilter", sizeof(ShardedFilter), 0, TYPE_FLAGS, ShardedFilter_slots
+};
+
+static PyType_Slot RotatingFilter_slots[] = {
+    {Py_tp_doc, "RotatingFilter objects"},
+    {Py_tp_dealloc, RotatingFilter_dealloc},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, RotatingFilter_init},
+    {Py_tp_methods, RotatingFilter_methods},
+    {0, NULL}
+};
+
+static PyType_Spec RotatingFilter_spec = {
+    "pyblossom.RotatingFilter", sizeof(RotatingFilter), 0, TYPE_FLAGS, RotatingFilter_slots
+};
+
+static PyType_Slot FilterHandle_slots[] = {
+    {Py_tp_doc, "FilterHandle objects"},
+    {Py_tp_dealloc, FilterHandle_dealloc},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, FilterHandle_init},
+    {Py_tp_methods, FilterHandle_methods},
+    {0, NULL}
+};
+
+static PyType_Spec FilterHandle_spec = {
+    "pyblossom.FilterHandle", sizeof(FilterHandle), 0, TYPE_FLAGS, FilterHandle_slots
+};
+
+/* creates a type of the module and adds it under its short name */
+static PyTypeObject *
+add_type(PyObject *m, PyType_Spec *spec)
+{
+    PyObject *type;
+
+    type = PyType_FromModuleAndSpec(m, spec, NULL);
+    if (type == NULL) {
+        return NULL;
+    }
+    if (PyModule_AddObject(m, strrchr(spec->name, '.') + 1, type) < 0) {
+        Py_DECREF(type);
+        return NULL;
+    }
+    Py_INCREF(type);
+    return (PyTypeObject *)type;
+}
+
+static int
+pyblossom_exec(PyObject *m)
+{
+    struct module_state *st = get_state(m);
+
+    crc32_init();
+    select_split_kernel();
+    select_bitops_kernel();
+
+    if ((st->filter_type = add_type(m, &Filter_spec)) == NULL ||
+            (st->counting_type = add_type(m, &CountingFilter_spec)) == NULL ||
+            (st->scalable_type = add_type(m, &ScalableFilter_spec)) == NULL ||
+            (st->static_type = add_type(m, &StaticFilter_spec)) == NULL ||
+            (st->cuckoo_type = add_type(m, &CuckooFilter_spec)) == NULL ||
+            (st->sharded_type = add_type(m, &ShardedFilter_spec)) == NULL ||
+            (st->rotating_type = add_type(m, &RotatingFilter_spec)) == NULL ||
+            (st->handle_type = add_type(m, &FilterHandle_spec)) == NULL) {
+        return -1;
+    }
+
+    if (PyModule_AddStringConstant(m, "simd", split_kernel) < 0) {
+        return -1;
+    }
+
+    st->error = PyErr_NewException("pyblossom.error", NULL, NULL);
+    if (st->error == NULL) {
+        return -1;
+    }
+    Py_INCREF(st->error);
+    if (PyModule_AddObject(m, "error", st->error) < 0) {
+        Py_DECREF(st->error);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+pyblossom_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    struct module_state *st = get_state(m);
+
+    Py_VISIT(st->error);
+    Py_VISIT(st->filter_type);
+    Py_VISIT(st->counting_type);
+    Py_VISIT(st->scalable_type);
+    Py_VISIT(st->static_type);
+    Py_VISIT(st->cuckoo_type);
+    Py_VISIT(st->sharded_type);
+    Py_VISIT(st->rotating_type);
+    Py_VISIT(st->handle_type);
+    return 0;
+}
+
+static int
+pyblossom_clear(PyObject *m)
+{
+    struct module_state *st = get_state(m);
+
+    Py_CLEAR(st->error);
+    Py_CLEAR(st->filter_type);
+    Py_CLEAR(st->counting_type);
+    Py_CLEAR(st->scalable_type);
+    Py_CLEAR(st->static_type);
+    Py_CLEAR(st->cuckoo_type);
+    Py_CLEAR(st->sharded_type);
+    Py_CLEAR(st->rotating_type);
+    Py_CLEAR(st->handle_type);
+    return 0;
+}
+
+static void
+pyblossom_free(void *m)
+{
+    pyblossom_clear((PyObject *)m);
+}
+
+static PyModuleDef_Slot pyblossom_slots[] = {
+    {Py_mod_exec, pyblossom_exec},
+    {0, NULL}
+};
+
+static struct PyModuleDef pyblossom_module = {
+    PyModuleDef_HEAD_INIT,
+    "pyblossom",
+    module_docstring,
+    sizeof(struct module_state),
+    module_methods,
+    pyblossom_slots,
+    pyblossom_traverse,
+    pyblossom_clear,
+    pyblossom_free
+};
+
+PyMODINIT_FUNC
+PyInit_pyblossom(void)
+{
+    return PyModuleDef_Init(&pyblossom_module);
 }
@@ -0,0 +1,62 @@
+/*
+ * Splits the key files of build_from_file into records: text lines, native
+ * 64 bit integers as add() hashes ints, or keys each behind a big endian
+ * u32 length.
+ */
+
+#define RECORDS_LINES 0         /* a trailing \r is dropped, empty lines skipped */
+#define RECORDS_U64 1
+#define RECORDS_LEN_PREFIXED 2
+
+static const char *record_formats[] = {"lines", "u64", "len-prefixed", NULL};
+
+/* Splits up to max records off data from *pos on into ptrs and lens and
+ * moves *pos past them. Returns the number of records, 0 at the end of the
+ * data, -1 if the data ends inside a record. */
+static Py_ssize_t
+split_records(int format, const char *data, size_t len, size_t *pos, const char **ptrs, Py_ssize_t *lens,
+    Py_ssize_t max)
+{
+    const char *end;
+    size_t p = *pos, stop, keylen;
+    Py_ssize_t count = 0;
+
+    switch (format) {
+    case RECORDS_U64:
+        if ((len - p) % sizeof(uint64_t))
+            return -1;
+        for (; count < max && p < len; count++, p += sizeof(uint64_t)) {
+            ptrs[count] = data + p;
+            lens[count] = sizeof(uint64_t);
+        }
+        break;
+    case RECORDS_LEN_PREFIXED:
+        for (; count < max && p < len; count++, p += keylen) {
+            if (len - p < 4)
+                return -1;
+            keylen = (size_t)(unsigned char)data[p] << 24 | (size_t)(unsigned char)data[p + 1] << 16 |
+                (size_t)(unsigned char)data[p + 2] << 8 | (unsigned char)data[p + 3];
+            p += 4;
+            if (keylen > len - p)
+                return -1;
+            ptrs[count] = data + p;
+            lens[count] = keylen;
+        }
+        break;
+    default:
+        while (count < max && p < len) {
+            end = (const char *)memchr(data + p, '\n', len - p);
+            stop = end != NULL ? (size_t)(end - data) : len;
+            keylen = stop - p;
+            if (keylen > 0 && data[stop - 1] == '\r')
+                keylen--;
+            if (keylen > 0) {
+                ptrs[count] = data + p;
+                lens[count++] = keylen;
+            }
+            p = end != NULL ? stop + 1 : len;
+        }
+    }
+    *pos = p;
+    return count;
+}
@@ -0,0 +1,191 @@
+/*
+ * Compressed bit arrays for sparse filters. The positions of the set bits
+ * are stored as the gaps between them, Golomb-Rice coded: the gap shifted
+ * right by k in unary (that many 1 bits and a 0), then its low k bits. At
+ * fill f the gaps are about geometric and k near log2(ln 2 / f) keeps the
+ * code within a few percent of their entropy. Bits are packed most
+ * significant first and bit x of the array is bit x & 7 of byte x >> 3,
+ * as libblossom addresses them.
+ */
+
+#define RICE_MAX_K 31
+
+/* the Rice parameter for set bits out of nbits */
+static int
+rice_parameter(uint64_t nbits, uint64_t set)
+{
+    double mean;
+    int k = 0;
+
+    if (set == 0)
+        return RICE_MAX_K;
+    mean = (double)(nbits - set) / set * 0.6931471805599453;
+    while (k < RICE_MAX_K && (double)((uint64_t)2 << k) <= mean)
+        k++;
+    return k;
+}
+
+/* an upper bound on the bytes rice_encode writes for set bits out of nbits */
+static uint64_t
+rice_bound(uint64_t nbits, uint64_t set, int k)
+{
+    return (set * (k + 1) + (nbits >> k) + 7) / 8 + 1;
+}
+
+struct rice_writer {
+    unsigned char *out;
+    size_t pos;
+    uint64_t acc;
+    int n;
+};
+
+/* appends the low count bits of value, count at most 32 */
+static void
+rice_put(struct rice_writer *w, uint32_t value, int count)
+{
+    w->acc = (w->acc << count) | value;
+    w->n += count;
+    while (w->n >= 8) {
+        w->n -= 8;
+        w->out[w->pos++] = (unsigned char)(w->acc >> w->n);
+    }
+}
+
+static void
+rice_put_gap(struct rice_writer *w, uint64_t gap, int k)
+{
+    uint64_t q = gap >> k;
+
+    for (; q >= 31; q -= 31)
+        rice_put(w, 0x7FFFFFFFU, 31);
+    rice_put(w, (uint32_t)(((1U << q) - 1) << 1), (int)q + 1);
+    if (k > 0)
+        rice_put(w, (uint32_t)(gap & ((1ULL << k) - 1)), k);
+}
+
+/* Codes the first count set bits of len bytes into out, which has room for
+ * rice_bound bytes. Stores how many it found in *coded and returns the bytes
+ * written. */
+static size_t
+rice_encode(const unsigned char *bf, size_t len, uint64_t count, int k, unsigned char *out, uint64_t *coded)
+{
+    struct rice_writer w;
+    uint64_t word, next = 0, x;
+    uint64_t found = 0;
+    size_t i = 0;
+    int bit;
+
+    w.out = out;
+    w.pos = 0;
+    w.acc = 0;
+    w.n = 0;
+    while (i < len && found < count) {
+        if (i + 8 <= len) {
+            memcpy(&word, bf + i, 8);
+            if (word == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        for (bit = 0; (bf[i] >> bit) && found < count; bit++) {
+            if (bf[i] & (1 << bit)) {
+                x = (uint64_t)i * 8 + bit;
+                rice_put_gap(&w, x - next, k);
+                next = x + 1;
+                found++;
+            }
+        }
+        i++;
+    }
+    if (w.n > 0)
+        w.out[w.pos++] = (unsigned char)(w.acc << (8 - w.n));
+    *coded = found;
+    return w.pos;
+}
+
+struct rice_reader {
+    const unsigned char *in;
+    size_t len, pos;
+    uint64_t acc;               /* the next n bits, most significant first */
+    int n;
+};
+
+static void
+rice_refill(struct rice_reader *r)
+{
+    while (r->n <= 56 && r->pos < r->len) {
+        r->acc |= (uint64_t)r->in[r->pos++] << (56 - r->n);
+        r->n += 8;
+    }
+}
+
+static int
+rice_leading_ones(uint64_t x)
+{
+#if defined(__GNUC__)
+    return ~x ? __builtin_clzll(~x) : 64;
+#else
+    int n = 0;
+
+    while (n < 64 && (x & 0x8000000000000000ULL)) {
+        x <<= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* Reads count gaps from len bytes at in and sets their bits in bf, which
+ * holds bytes zeroed bytes. Returns -1 on a truncated stream or a bit past
+ * the end of bf. */
+static int
+rice_decode(const unsigned char *in, size_t len, uint64_t count, int k, unsigned char *bf, size_t bytes)
+{
+    struct rice_reader r;
+    uint64_t nbits = (uint64_t)bytes * 8, next = 0, q, x;
+    int ones;
+
+    r.in = in;
+    r.len = len;
+    r.pos = 0;
+    r.acc = 0;
+    r.n = 0;
+    while (count--) {
+        q = 0;
+        for (;;) {
+            rice_refill(&r);
+            if (r.n == 0)
+                return -1;
+            ones = rice_leading_ones(r.acc);
+            if (ones >= r.n) {
+                q += r.n;
+                r.acc = 0;
+                r.n = 0;
+            }
+            else {
+                q += ones;
+                r.acc = (r.acc << ones) << 1;
+                r.n -= ones + 1;
+                break;
+            }
+            if (q > nbits >> k)
+                return -1;
+        }
+        if (q > nbits >> k)
+            return -1;
+        x = next + (q << k);
+        if (k > 0) {
+            rice_refill(&r);
+            if (r.n < k)
+                return -1;
+            x += r.acc >> (64 - k);
+            r.acc <<= k;
+            r.n -= k;
+        }
+        if (x >= nbits)
+            return -1;
+        bf[x >> 3] |= 1 << (x & 7);
+        next = x + 1;
+    }
+    return 0;
+}
@@ -0,0 +1,342 @@
+/*
+ * Storage for bit arrays that pyblossom manages itself instead of leaving
+ * them to libblossom's calloc/free pair.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+    #include <malloc.h>
+    #include <windows.h>
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <time.h>
+    #include <unistd.h>
+#endif
+
+#define STORAGE_LIBBLOOM 0      /* allocated by bloom_init, freed by bloom_free */
+#define STORAGE_ALIGNED 1       /* allocated by aligned_calloc */
+#define STORAGE_BUFFER 2        /* borrowed from a caller's buffer, read-only */
+#define STORAGE_MAPPED 3        /* inside a file mapping owned by the filter */
+#define STORAGE_SHARED 4        /* an anonymous mapping shared with forked children */
+
+static void *
+aligned_calloc(size_t size, size_t alignment)
+{
+    void *ptr;
+#ifdef _WIN32
+    ptr = _aligned_malloc(size, alignment);
+#else
+    if (posix_memalign(&ptr, alignment, size) != 0)
+        ptr = NULL;
+#endif
+    if (ptr != NULL)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+static void
+aligned_free(void *ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+#ifndef _WIN32
+/* runs a cleanup call without clobbering the errno being reported */
+#define preserve_errno(call) do { int saved_errno = errno; (void)(call); errno = saved_errno; } while (0)
+
+static int
+map_fd(int fd, int writable, void **addr, size_t *len)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    if (st.st_size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    *addr = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (*addr == MAP_FAILED)
+        return -1;
+    *len = st.st_size;
+    return 0;
+}
+#endif
+
+/* Maps all of the file at path, shared with every other process mapping
+ * it. Returns -1 with errno (GetLastError on Windows) set on failure. */
+static int
+map_file(const char *path, int writable, void **addr, size_t *len)
+{
+#ifdef _WIN32
+    HANDLE file, mapping;
+    LARGE_INTEGER size;
+
+    file = CreateFileA(path, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return -1;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        SetLastError(ERROR_INVALID_DATA);
+        return -1;
+    }
+    mapping = CreateFileMappingA(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL)
+        return -1;
+    *addr = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (*addr == NULL)
+        return -1;
+    *len = (size_t)size.QuadPart;
+    return 0;
+#else
+    int fd, rc;
+
+    fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return -1;
+    rc = map_fd(fd, writable, addr, len);
+    preserve_errno(close(fd));
+    return rc;
+#endif
+}
+
+/* whether path is an empty file, which map_file refuses to map */
+static int
+file_empty(const char *path)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+
+    return GetFileAttributesExA(path, GetFileExInfoStandard, &data) &&
+        !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && data.nFileSizeHigh == 0 && data.nFileSizeLow == 0;
+#else
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0;
+#endif
+}
+
+#ifndef _WIN32
+/* flushes the directory entry of path, so a rename into it survives a crash */
+static int
+sync_parent(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    size_t n = slash == NULL || slash == path ? 1 : (size_t)(slash - path);
+    char *dir;
+    int fd, rc;
+
+    dir = (char *)malloc(n + 1);
+    if (dir == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(dir, slash == NULL ? "." : path, n);
+    dir[n] = '\0';
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0)
+        return -1;
+    rc = fsync(fd);
+    /* some file systems cannot sync a directory, there is nothing more to do there */
+    if (rc < 0 && errno == EINVAL)
+        rc = 0;
+    preserve_errno(close(fd));
+    return rc;
+}
+#endif
+
+/* Writes len bytes to path through a temporary file next to it, renamed
+ * over it once complete, so readers see the old file or all of the new one.
+ * Each call gets a temporary file of its own, so concurrent writers of the
+ * same path do not mix their data; the last rename wins. Returns -1 with
+ * errno (GetLastError on Windows) set on failure. */
+static int
+replace_file(const char *path, const char *data, size_t len)
+{
+    static unsigned int counter;
+    size_t n = strlen(path) + 48;
+    char *tmp;
+#ifdef _WIN32
+    HANDLE file;
+    DWORD written, error;
+    int ok;
+#else
+    ssize_t written;
+    int fd;
+#endif
+
+    tmp = (char *)malloc(n);
+    if (tmp == NULL) {
+#ifdef _WIN32
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+#else
+        errno = ENOMEM;
+#endif
+        return -1;
+    }
+#ifdef _WIN32
+    do {
+        snprintf(tmp, n, "%s.%lu.%ld.tmp", path, (unsigned long)GetCurrentProcessId(),
+            (long)InterlockedIncrement((LONG volatile *)&counter));
+        file = CreateFileA(tmp, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    } while (file == INVALID_HANDLE_VALUE && GetLastError() == ERROR_FILE_EXISTS);
+    if (file == INVALID_HANDLE_VALUE) {
+        free(tmp);
+        return -1;
+    }
+    while (len > 0 && WriteFile(file, data, len > 0x40000000 ? 0x40000000 : (DWORD)len, &written, NULL)) {
+        data += written;
+        len -= written;
+    }
+    ok = len == 0 && FlushFileBuffers(file);
+    error = GetLastError();
+    CloseHandle(file);
+    if (!ok || !MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        if (ok)
+            error = GetLastError();
+        DeleteFileA(tmp);
+        free(tmp);
+        SetLastError(error);
+        return -1;
+    }
+#else
+    do {
+        snprintf(tmp, n, "%s.%ld.%u.tmp", path, (long)getpid(), __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+        fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    } while (fd < 0 && errno == EEXIST);
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+    while (len > 0) {
+        written = write(fd, data, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            break;
+        data += written;
+        len -= written;
+    }
+    if (len > 0 || fsync(fd) < 0) {
+        preserve_errno(close(fd));
+        preserve_errno(unlink(tmp));
+        free(tmp);
+        return -1;
+    }
+    if (close(fd) < 0 || rename(tmp, path) < 0) {
+        preserve_errno(unlink(tmp));
+        free(tmp);
+        return -1;
+    }
+    if (sync_parent(path) < 0) {
+        free(tmp);
+        return -1;
+    }
+#endif
+    free(tmp);
+    return 0;
+}
+
+#ifndef _WIN32
+#define HAVE_SHARED_MEMORY 1
+
+/* Zeroed anonymous memory that stays shared with children forked later. */
+static void *
+map_anonymous(size_t len)
+{
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+#define SHM_WAIT_TRIES 2000       /* 1 ms pauses an opener waits for its creator */
+
+static void
+shm_pause(void)
+{
+    struct timespec pause = {0, 1000000};
+
+    nanosleep(&pause, NULL);
+}
+
+/* Maps the POSIX shared memory object name. If len is non-zero the object is
+ * created with that size and *created says whether this call created it;
+ * an existing object is mapped at its current size, once its creator has
+ * sized it. */
+static int
+map_shm(const char *name, size_t len, void **addr, size_t *map_len, int *created)
+{
+    struct stat st;
+    int fd, rc, tries;
+
+    *created = 0;
+    fd = -1;
+    if (len > 0) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            *created = 1;
+            if (ftruncate(fd, len) < 0) {
+                preserve_errno(close(fd));
+                preserve_errno(shm_unlink(name));
+                return -1;
+            }
+        }
+        else if (errno != EEXIST) {
+            return -1;
+        }
+    }
+    if (fd < 0) {
+        fd = shm_open(name, O_RDWR, 0600);
+        if (fd < 0)
+            return -1;
+        for (tries = 0; fstat(fd, &st) == 0 && st.st_size == 0 && tries < SHM_WAIT_TRIES; tries++)
+            shm_pause();
+    }
+    rc = map_fd(fd, 1, addr, map_len);
+    preserve_errno(close(fd));
+    if (rc < 0 && *created)
+        preserve_errno(shm_unlink(name));
+    return rc;
+}
+#endif
+
+static int
+sync_mapping(void *addr, size_t len)
+{
+#ifdef _WIN32
+    return FlushViewOfFile(addr, len) ? 0 : -1;
+#else
+    return msync(addr, len, MS_SYNC);
+#endif
+}
+
+/* tells the kernel a mapping is about to be read front to back */
+static void
+advise_sequential(void *addr, size_t len)
+{
+#if !defined(_WIN32) && defined(MADV_SEQUENTIAL)
+    madvise(addr, len, MADV_SEQUENTIAL);
+#endif
+}
+
+static void
+unmap_file(void *addr, size_t len)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(addr);
+#else
+    munmap(addr, len);
+#endif
+}
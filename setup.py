@@ -9,6 +9,8 @@ contents = lambda f: open(pwd(f)).read().strip()
 kwargs = {}
 if sys.platform == 'win32':
     kwargs['libraries'] = ['ws2_32']
+elif sys.platform.startswith('linux'):
+    kwargs['libraries'] = ['rt']
 module = Extension('pyblossom',
     ['pyblossom/pyblossom.c', 'libblossom/bloom.c', 'libblossom/murmur2/MurmurHash2.c'],
     include_dirs=['libblossom/murmur2'],
@@ -24,5 +26,6 @@ setup(
     version=contents('VERSION'),
     url='https://github.com/meridianz/pyblossom',
     ext_modules=[module],
+    python_requires='>=3.9',
     license='BSD'
 )
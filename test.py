@@ -1,9 +1,17 @@
 # -*- coding: utf-8 -*-
 
-from __future__ import absolute_import, division
+import array
+import asyncio
+import ctypes
+import os
+import struct
+import tempfile
+import threading
 import unittest
+import zlib
 import pyblossom
-# from binascii import hexlify
+from binascii import hexlify, unhexlify
+from io import BytesIO
 
 class PyBloomTestCase(unittest.TestCase):
 
@@ -15,8 +23,8 @@ class PyBloomTestCase(unittest.TestCase):
 
         entries, error, buf = pyblossom.dump_ex(bloom)
         # print entries, error, buf, len(buf)
-        self.assertEquals(entries, 1000)
-        self.assertEquals(error, 0.001)
+        self.assertEqual(entries, 1000)
+        self.assertEqual(error, 0.001)
 
         bloom = pyblossom.Filter(entries=entries, error=error, data=buf)
         self.assertTrue(bloom.contains('test'))
@@ -30,8 +38,8 @@ class PyBloomTestCase(unittest.TestCase):
 
         entries, error, buf = pyblossom.dump_ex(bloom)
         # print entries, error, buf, len(buf)
-        self.assertEquals(entries, 1000)
-        self.assertEquals(error, 0.001)
+        self.assertEqual(entries, 1000)
+        self.assertEqual(error, 0.001)
         buf = buf.tobytes()
 
         bloom = pyblossom.Filter(entries=entries, error=error, data=buf)
@@ -53,6 +61,907 @@ class PyBloomTestCase(unittest.TestCase):
         self.assertTrue(bloom.contains('test'))
         self.assertFalse(bloom.contains('fail'))
 
+    def test_buffer_protocol(self):
+        bloom = pyblossom.Filter(entries=1000, error=0.001)
+        bloom.add('test')
+
+        # views keep the filter alive and see later adds
+        view = memoryview(bloom)
+        bits = bloom.get_buffer()
+        bloom.add('later')
+        serialized = pyblossom.dump(bloom)
+        del bloom
+        self.assertEqual(view.tobytes(), serialized[8:])
+        self.assertEqual(bits.tobytes(), serialized[8:])
+
+        loaded = pyblossom.load(serialized, copy=False)
+        view = memoryview(loaded)
+        self.assertTrue(view.readonly)
+        self.assertEqual(bytes(loaded), serialized[8:])
+        self.assertRaises(BufferError, loaded.add, 'other')
+        self.assertRaises(BufferError, loaded.__init__, 10, 0.1)
+        del view
+        loaded.add('other')
+        self.assertTrue(memoryview(loaded).readonly)
+        self.assertFalse(loaded.get_buffer().readonly)
+        self.assertTrue(loaded.contains('other'))
+
+    def test_reinit_while_busy(self):
+        keys = ['key%d' % i for i in range(20000)]
+        cases = [
+            (pyblossom.Filter(entries=1000000, error=0.01), ((100, 0.5), (1000000, 0.01))),
+            (pyblossom.ShardedFilter(1000000, 0.01, shards=4), ((100, 0.5, 2), (1000000, 0.01, 4))),
+            (pyblossom.RotatingFilter(1000000, 0.01, generations=3), ((100, 0.5, 2), (1000000, 0.01, 3))),
+        ]
+        for bf, args in cases:
+            done = []
+
+            def read():
+                while not done:
+                    bf.contains_many(keys)
+                    bf.add_many(keys, threads=2)
+
+            reader = threading.Thread(target=read)
+            reader.start()
+            refused = 0
+            try:
+                for i in range(200):
+                    try:
+                        bf.__init__(*args[i % 2])
+                    except RuntimeError:
+                        refused += 1
+            finally:
+                done.append(1)
+                reader.join()
+            self.assertGreater(refused, 0)
+
+    def test_add_contains_many(self):
+        bloom = pyblossom.Filter(entries=1000, error=0.001)
+        keys = ['key%d' % i for i in range(100)]
+        bloom.add_many(keys)
+        self.assertEqual(bloom.contains_many(keys), [True] * len(keys))
+        self.assertEqual(bloom.contains_many(('fail', 'test')), [False, False])
+        self.assertEqual(bloom.contains_many(iter(keys[:3])), [True] * 3)
+        for key in keys:
+            self.assertTrue(bloom.contains(key))
+
+    def test_add_contains_many_width(self):
+        bloom = pyblossom.Filter(entries=1000, error=0.001)
+        bloom.add_many(b'aaaabbbbcccc', width=4)
+        self.assertTrue(bloom.contains(b'bbbb'))
+        self.assertEqual(bloom.contains_many(b'ccccdddd', width=4), [True, False])
+        self.assertRaises(pyblossom.error, bloom.add_many, b'abcde', width=4)
+
+    def test_concurrent_add_many(self):
+        bloom = pyblossom.Filter(entries=100000, error=0.001)
+        chunks = [['t%d-%d' % (t, i) for i in range(5000)] for t in range(4)]
+        threads = [threading.Thread(target=bloom.add_many, args=(chunk,)) for chunk in chunks]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        for chunk in chunks:
+            self.assertTrue(all(bloom.contains_many(chunk)))
+
+        bloom = pyblossom.load(pyblossom.dump(bloom))
+        for chunk in chunks:
+            self.assertTrue(all(bloom.contains_many(chunk)))
+
+    def test_dump_load_wire_format(self):
+        payload = b'620d006400000014000000000020001000080000000000002000100008000400'
+        bloom = pyblossom.Filter(entries=20, error=0.01)
+        bloom.add('abc')
+        self.assertEqual(hexlify(pyblossom.dump(bloom)), payload)
+        self.assertEqual(hexlify(pyblossom.dump(pyblossom.load(unhexlify(payload)))), payload)
+
+    def test_blocked_layout(self):
+        bloom = pyblossom.Filter(entries=1000, error=0.001, layout='blocked')
+        keys = ['key%d' % i for i in range(1000)]
+        bloom.add_many(keys)
+        self.assertTrue(all(bloom.contains_many(keys)))
+        self.assertEqual(len(bloom.get_buffer()) % 64, 0)
+        misses = bloom.contains_many(['miss%d' % i for i in range(10000)])
+        self.assertTrue(sum(misses) < 100)
+
+        data = pyblossom.dump(bloom)
+        self.assertEqual(data[2:4], b'\0\0')
+        loaded = pyblossom.load(data)
+        self.assertTrue(all(loaded.contains_many(keys)))
+        self.assertEqual(pyblossom.dump(loaded), data)
+
+        data = data[:20] + bytes([data[20] ^ 1]) + data[21:]
+        with self.assertRaisesRegex(pyblossom.error, 'checksum mismatch'):
+            pyblossom.load(data)
+        self.assertRaises(ValueError, pyblossom.Filter, 1000, 0.001, layout='striped')
+
+    def test_split_layout(self):
+        self.assertTrue(pyblossom.simd in ('avx2', 'sse4.1', 'neon', 'scalar'))
+        bloom = pyblossom.Filter(entries=1000, error=0.01, layout='split')
+        keys = ['key%d' % i for i in range(1000)]
+        bloom.add_many(keys)
+        self.assertTrue(all(bloom.contains_many(keys)))
+        self.assertFalse(bloom.contains('fail'))
+        self.assertEqual(len(bloom.get_buffer()) % 32, 0)
+        misses = bloom.contains_many(['miss%d' % i for i in range(10000)])
+        self.assertTrue(sum(misses) < 300)
+
+        loaded = pyblossom.load(pyblossom.dump(bloom))
+        self.assertTrue(all(loaded.contains_many(keys)))
+
+    def test_checksum_large_filter(self):
+        bloom = pyblossom.Filter(entries=100000, error=0.01)
+        bloom.add_many(['key%d' % i for i in range(1000)])
+        data = pyblossom.dump(bloom)
+        crc = zlib.crc32(data[8:]) & 0xffffffff
+        self.assertEqual(struct.unpack('!H', data[:2])[0], (crc & 0xffff) ^ (crc >> 16))
+        self.assertEqual(pyblossom.dump(pyblossom.load(data)), data)
+
+    def test_load_zero_copy(self):
+        bloom = pyblossom.Filter(entries=1000, error=0.001)
+        bloom.add('test')
+        data = pyblossom.dump(bloom)
+        payload = bytearray(data)
+
+        borrowed = pyblossom.load(payload, copy=False)
+        self.assertTrue(borrowed.contains('test'))
+        self.assertFalse(borrowed.contains('fail'))
+        self.assertRaises(BufferError, payload.extend, b'x')
+
+        # writes go to a private copy, the payload stays untouched
+        borrowed.add('fail')
+        self.assertTrue(borrowed.contains('fail'))
+        self.assertEqual(bytes(payload), data)
+        self.assertFalse(pyblossom.load(bytes(payload)).contains('fail'))
+
+        self.assertTrue(pyblossom.load(data, copy=False, verify=False).contains('test'))
+        corrupt = data[:10] + bytes([data[10] ^ 1]) + data[11:]
+        with self.assertRaisesRegex(pyblossom.error, 'checksum mismatch'):
+            pyblossom.load(corrupt, copy=False)
+
+    def test_open_mmap(self):
+        bloom = pyblossom.Filter(entries=1000, error=0.001)
+        bloom.add('test')
+        data = pyblossom.dump(bloom, align=4096)
+        self.assertEqual(data[4096:], bloom.get_buffer().tobytes())
+        self.assertTrue(pyblossom.load(data).contains('test'))
+
+        fd, path = tempfile.mkstemp()
+        self.addCleanup(os.remove, path)
+        os.write(fd, data)
+        os.close(fd)
+
+        mapped = pyblossom.open_mmap(path, verify=True)
+        self.assertTrue(mapped.contains('test'))
+        mapped.add('fail')
+        self.assertTrue(mapped.contains('fail'))
+        del mapped
+        with open(path, 'rb') as f:
+            self.assertEqual(f.read(), data)
+
+        mapped = pyblossom.open_mmap(path, writable=True)
+        mapped.add_many(['key%d' % i for i in range(100)])
+        mapped.flush()
+        del mapped
+        with open(path, 'rb') as f:
+            loaded = pyblossom.load(f.read())
+        self.assertTrue(all(loaded.contains_many(['key%d' % i for i in range(100)])))
+        self.assertTrue(loaded.contains('test'))
+
+        self.assertRaises(IOError, pyblossom.open_mmap, path + '.missing')
+
+    @unittest.skipUnless(hasattr(pyblossom, 'open_shm'), 'no shared memory support')
+    def test_shared_filter_fork(self):
+        for layout in ('standard', 'blocked', 'split'):
+            bloom = pyblossom.Filter(entries=10000, error=0.001, layout=layout, shared=True)
+            bloom.add('parent')
+            children = []
+            for child in range(4):
+                pid = os.fork()
+                if pid == 0:
+                    bloom.add_many(['child%d-%d' % (child, i) for i in range(1000)])
+                    os._exit(0)
+                children.append(pid)
+            for pid in children:
+                os.waitpid(pid, 0)
+            for child in range(4):
+                self.assertTrue(all(bloom.contains_many(['child%d-%d' % (child, i) for i in range(1000)])))
+            self.assertTrue(pyblossom.load(pyblossom.dump(bloom)).contains('parent'))
+
+    @unittest.skipUnless(hasattr(pyblossom, 'open_shm'), 'no shared memory support')
+    def test_open_shm(self):
+        name = '/pyblossom-test-%d' % os.getpid()
+        self.addCleanup(pyblossom.unlink_shm, name)
+        writer = pyblossom.open_shm(name, entries=1000, error=0.001, layout='blocked')
+        reader = pyblossom.open_shm(name)
+        again = pyblossom.open_shm(name, entries=1000, error=0.001, layout='blocked')
+        writer.add('test')
+        self.assertTrue(again.contains('test'))
+        self.assertRaises(pyblossom.error, pyblossom.open_shm, name, entries=500, error=0.001, layout='blocked')
+        self.assertRaises(pyblossom.error, pyblossom.open_shm, name, entries=1000, error=0.001)
+        self.assertTrue(reader.contains('test'))
+        self.assertFalse(reader.contains('fail'))
+        writer.flush()
+        self.assertTrue(pyblossom.load(pyblossom.dump(reader)).contains('test'))
+        self.assertRaises(OSError, pyblossom.open_shm, name + '-missing')
+
+    def test_dump_to_load_from(self):
+        bloom = pyblossom.Filter(entries=1000, error=0.001)
+        bloom.add('test')
+        blocked = pyblossom.Filter(entries=1000, error=0.001, layout='blocked')
+        blocked.add('test')
+
+        stream = BytesIO()
+        pyblossom.dump_to(bloom, stream, chunk_size=100)
+        pyblossom.dump_to(blocked, stream, chunk_size=7, align=512)
+        self.assertEqual(stream.getvalue(),
+                          pyblossom.dump(bloom) + pyblossom.dump(blocked, align=512))
+
+        # write() may read the filter, adds from it fail and other threads' wait
+        class AddingStream(BytesIO):
+            def write(self, data):
+                if not self.tell():
+                    self.refused = self.raises(bloom.add, 'written')
+                    self.writer = threading.Thread(target=bloom.add, args=('threaded',))
+                    self.writer.start()
+                    self.writer.join(0.05)
+                self.alive = self.writer.is_alive()
+                pyblossom.dump(bloom)
+                return BytesIO.write(self, data)
+
+            def raises(self, function, *args):
+                try:
+                    function(*args)
+                except RuntimeError:
+                    return True
+                return False
+
+        before = pyblossom.dump(bloom)
+        adding = AddingStream()
+        pyblossom.dump_to(bloom, adding, chunk_size=100)
+        adding.writer.join()
+        self.assertTrue(adding.refused)
+        self.assertTrue(adding.alive)
+        self.assertEqual(adding.getvalue(), before)
+        self.assertFalse(bloom.contains('written'))
+        self.assertTrue(bloom.contains('threaded'))
+        bloom = pyblossom.load(before)
+
+        stream.seek(0)
+        for expected in (bloom, blocked):
+            loaded = pyblossom.load_from(stream, chunk_size=64)
+            self.assertTrue(loaded.contains('test'))
+            self.assertFalse(loaded.contains('fail'))
+            self.assertEqual(pyblossom.dump(loaded), pyblossom.dump(expected))
+
+        data = pyblossom.dump(bloom)
+        with self.assertRaisesRegex(pyblossom.error, 'incomplete payload'):
+            pyblossom.load_from(BytesIO(data[:-1]))
+        corrupt = data[:10] + bytes([data[10] ^ 1]) + data[11:]
+        with self.assertRaisesRegex(pyblossom.error, 'checksum mismatch'):
+            pyblossom.load_from(BytesIO(corrupt))
+
+    def test_union_intersection(self):
+        first = pyblossom.Filter(entries=1000, error=0.001)
+        second = pyblossom.Filter(entries=1000, error=0.001)
+        first.add_many(['a%d' % i for i in range(100)] + ['both'])
+        second.add_many(['b%d' % i for i in range(100)] + ['both'])
+
+        union = first.union(second)
+        self.assertTrue(all(union.contains_many(['a%d' % i for i in range(100)])))
+        self.assertTrue(all(union.contains_many(['b%d' % i for i in range(100)])))
+        self.assertEqual(pyblossom.dump(union), pyblossom.dump(first | second))
+        self.assertEqual(pyblossom.dump(union), pyblossom.dump(pyblossom.merge([first, second])))
+
+        intersection = first & second
+        self.assertTrue(intersection.contains('both'))
+        self.assertEqual(sum(intersection.contains_many(['a%d' % i for i in range(100)])), 0)
+        self.assertFalse(first.contains('b1'))
+
+        first |= second
+        self.assertEqual(pyblossom.dump(first), pyblossom.dump(union))
+        first &= intersection
+        self.assertEqual(pyblossom.dump(first), pyblossom.dump(intersection))
+
+        other = pyblossom.Filter(entries=1000, error=0.01)
+        with self.assertRaisesRegex(pyblossom.error, 'different parameters'):
+            first.union(other)
+        self.assertRaises(pyblossom.error, pyblossom.merge, [first, other])
+        self.assertRaises(TypeError, lambda: first | 'fail')
+
+    def test_merge_shards(self):
+        shards = [pyblossom.Filter(entries=10000, error=0.01, layout='split') for _ in range(8)]
+        for n, shard in enumerate(shards):
+            shard.add_many(['s%d-%d' % (n, i) for i in range(500)])
+        merged = pyblossom.merge(iter(shards))
+        for n in range(8):
+            self.assertTrue(all(merged.contains_many(['s%d-%d' % (n, i) for i in range(500)])))
+
+    def test_hash_functions(self):
+        keys = ['key%d' % i for i in range(2000)] + ['', 'x', 'abcd', 'a' * 300]
+        for hash in ('murmur2', 'xxh3', 'wyhash'):
+            for layout in ('standard', 'blocked', 'split'):
+                bf = pyblossom.Filter(entries=3000, error=0.01, layout=layout, hash=hash)
+                bf.add_many(keys)
+                self.assertTrue(all(bf.contains_many(keys)))
+                self.assertLess(sum(bf.contains_many(['miss%d' % i for i in range(2000)])), 100)
+
+                loaded = pyblossom.load(pyblossom.dump(bf))
+                self.assertTrue(all(loaded.contains_many(keys)))
+                self.assertEqual(pyblossom.dump(loaded), pyblossom.dump(bf))
+
+        # murmur2 stays the default and keeps the inbloom wire format
+        bf = pyblossom.Filter(entries=20, error=0.01, hash='murmur2')
+        bf.add('abc')
+        self.assertEqual(hexlify(pyblossom.dump(bf)),
+            b'620d006400000014000000000020001000080000000000002000100008000400')
+
+        xxh3 = pyblossom.Filter(entries=20, error=0.01, hash='xxh3')
+        serialized = pyblossom.dump(xxh3)
+        self.assertEqual(struct.unpack('>BBB', serialized[8:11]), (2, 0, 1))
+        self.assertRaises(pyblossom.error, lambda: xxh3 | bf)
+        self.assertRaises(ValueError, pyblossom.Filter, entries=20, error=0.01, hash='md5')
+
+        corrupt = serialized[:10] + b'\x07' + serialized[11:]
+        self.assertRaises(pyblossom.error, pyblossom.load, corrupt, verify=False)
+
+    def test_prehashed(self):
+        keys = ['tenant%d' % i for i in range(500)]
+        for hash in ('murmur2', 'xxh3', 'wyhash'):
+            filters = [pyblossom.Filter(entries=1000, error=0.01, layout=layout, hash=hash)
+                       for layout in ('standard', 'blocked', 'split')]
+            for bf in filters:
+                for key in keys[:50]:
+                    bf.add_hashed(pyblossom.hash(key, hash=hash))
+                self.assertTrue(all(bf.contains_many(keys[:50])))
+
+                digests = pyblossom.hash_many(keys, hash=hash)
+                self.assertEqual(len(digests), 8 * len(keys))
+                self.assertEqual(struct.unpack('=Q', digests[8:16])[0], pyblossom.hash(keys[1], hash=hash))
+                bf.add_hashed_many(array.array('Q', digests))
+                self.assertTrue(all(bf.contains_hashed_many(digests)))
+                self.assertTrue(all(bf.contains_many(keys)))
+                self.assertTrue(bf.contains_hashed(pyblossom.hash(keys[7], hash=hash)))
+                self.assertFalse(bf.contains_hashed(pyblossom.hash('missing', hash=hash)))
+
+        # a prehashed murmur2 add matches libblossom's own
+        bf = pyblossom.Filter(entries=20, error=0.01)
+        bf.add_hashed(pyblossom.hash('abc'))
+        self.assertEqual(hexlify(pyblossom.dump(bf)),
+            b'620d006400000014000000000020001000080000000000002000100008000400')
+
+        self.assertRaises(OverflowError, bf.contains_hashed, -1)
+        self.assertRaises(OverflowError, bf.contains_hashed, 1 << 64)
+        self.assertRaises(TypeError, bf.contains_hashed, 1.5)
+        self.assertRaises(TypeError, bf.add_hashed, 1.5)
+        self.assertRaises(pyblossom.error, bf.contains_hashed_many, b'x' * 9)
+
+    def test_int_keys(self):
+        bf = pyblossom.Filter(entries=10000, error=0.001)
+        bf.add(12345)
+        bf.add(-1)
+        bf.add(2 ** 64 - 2)
+        self.assertTrue(bf.contains(12345))
+        self.assertTrue(bf.contains(struct.pack('=q', 12345)))
+        self.assertTrue(bf.contains(struct.pack('=Q', 2 ** 64 - 1)))
+        self.assertTrue(bf.contains(-2))
+        self.assertFalse(bf.contains(54321))
+        self.assertEqual(pyblossom.hash(12345), pyblossom.hash(struct.pack('=q', 12345)))
+        self.assertRaises(OverflowError, bf.add, 2 ** 64)
+        self.assertRaises(OverflowError, bf.contains, -2 ** 63 - 1)
+
+        ids = list(range(1000, 3000))
+        bf.add_many(ids[:1000] + ['mixed'])
+        self.assertTrue(all(bf.contains_many(ids[:1000])))
+        self.assertTrue(bf.contains('mixed'))
+
+        typed = (ctypes.c_int64 * 1000)(*ids[1000:])
+        for layout in ('standard', 'blocked', 'split'):
+            other = pyblossom.Filter(entries=10000, error=0.001, layout=layout, hash='xxh3')
+            other.add_many(typed)
+            self.assertTrue(all(other.contains_many(ids[1000:])))
+            self.assertTrue(all(other.contains_many(typed)))
+            self.assertEqual(sum(other.contains_many(ids[:1000])), 0)
+        self.assertEqual(pyblossom.hash_many(typed), pyblossom.hash_many(ids[1000:]))
+
+    def test_counting_filter(self):
+        cf = pyblossom.CountingFilter(entries=1000, error=0.01)
+        keys = ['session%d' % i for i in range(1000)]
+        for key in keys:
+            cf.add(key)
+        self.assertTrue(all(cf.contains(key) for key in keys))
+
+        for key in keys[:500]:
+            self.assertTrue(cf.remove(key))
+        self.assertTrue(all(cf.contains(key) for key in keys[500:]))
+        self.assertLess(sum(cf.contains(key) for key in keys[:500]), 25)
+        self.assertFalse(cf.remove('never added'))
+
+        # collapsing gives the filter the remaining keys would have built
+        plain = pyblossom.Filter(entries=1000, error=0.01)
+        plain.add_many(keys[500:])
+        self.assertEqual(pyblossom.dump(cf.to_filter()), pyblossom.dump(plain))
+
+        serialized = pyblossom.dump(cf)
+        # two 4 bit counters per byte
+        self.assertLessEqual(len(serialized), 16 + 4 * len(plain.get_buffer()))
+        self.assertGreater(len(serialized), 16 + 4 * (len(plain.get_buffer()) - 1))
+        loaded = pyblossom.load(serialized)
+        self.assertTrue(isinstance(loaded, pyblossom.CountingFilter))
+        self.assertEqual(pyblossom.dump(loaded), serialized)
+        self.assertTrue(loaded.remove(keys[600]))
+        self.assertRaises(pyblossom.error, pyblossom.load_from, BytesIO(serialized))
+
+        # saturated counters are never decremented
+        cf = pyblossom.CountingFilter(entries=10, error=0.01, hash='xxh3')
+        for _ in range(20):
+            cf.add(7)
+        for _ in range(20):
+            cf.remove(7)
+        self.assertTrue(cf.contains(7))
+        self.assertTrue(cf.to_filter().contains(7))
+        bare = pyblossom.CountingFilter.__new__(pyblossom.CountingFilter)
+        self.assertRaises(ValueError, bare.add, 'test')
+        self.assertRaises(ValueError, bare.remove, 'test')
+        self.assertRaises(ValueError, bare.contains, 'test')
+        self.assertRaises(ValueError, bare.to_filter)
+        self.assertRaises(ValueError, pyblossom.dump, bare)
+
+    def test_scalable_filter(self):
+        sf = pyblossom.ScalableFilter(entries=1000, error=0.01)
+        keys = ['user%d' % i for i in range(20000)]
+        for key in keys:
+            sf.add(key)
+        sf.add(keys[0])
+        # keys that already look present are not added again
+        self.assertLessEqual(len(sf), 20000)
+        self.assertGreater(len(sf), 19700)
+        self.assertTrue(all(sf.contains(key) for key in keys))
+
+        # capacity doubles and the error halves with every slice
+        table = sf.slices()
+        self.assertEqual([entries for entries, _, _ in table], [1000, 2000, 4000, 8000, 16000])
+        self.assertEqual(sum(count for _, _, count in table), len(sf))
+        self.assertAlmostEqual(table[0][1], 0.005)
+        self.assertAlmostEqual(table[1][1], 0.0025)
+        self.assertLess(sum(error for _, error, _ in table), 0.01)
+
+        misses = sum(sf.contains('miss%d' % i) for i in range(20000))
+        self.assertLess(misses, 20000 * 0.01 * 1.5)
+
+        loaded = pyblossom.load(pyblossom.dump(sf))
+        self.assertTrue(isinstance(loaded, pyblossom.ScalableFilter))
+        self.assertEqual(loaded.slices(), table)
+        self.assertEqual(pyblossom.dump(loaded), pyblossom.dump(sf))
+        self.assertTrue(all(loaded.contains(key) for key in keys))
+        loaded.add('one more')
+        self.assertTrue(loaded.contains('one more'))
+
+        corrupt = pyblossom.dump(sf)[:-1]
+        self.assertRaises(pyblossom.error, pyblossom.load, corrupt, verify=False)
+        for ratio in (1, 1.5, -0.5, 0.999999, float('nan')):
+            self.assertRaises(ValueError, pyblossom.ScalableFilter, entries=10, error=0.01, ratio=ratio)
+        bare = pyblossom.ScalableFilter.__new__(pyblossom.ScalableFilter)
+        self.assertRaises(ValueError, bare.add, 'test')
+        self.assertRaises(ValueError, bare.contains, 'test')
+        self.assertRaises(ValueError, pyblossom.dump, bare)
+
+    def test_static_filter(self):
+        keys = ['user%d' % i for i in range(20000)]
+        sf = pyblossom.StaticFilter.build(keys + keys[:100])
+        self.assertEqual(len(sf), 20000)
+        self.assertTrue(all(sf.contains_many(keys)))
+        self.assertTrue(sf.contains(keys[0]))
+        misses = sum(sf.contains_many(['miss%d' % i for i in range(20000)]))
+        self.assertLess(misses, 20000 / 256.0 * 2)
+        # about 9 bits per key with 8 bit fingerprints
+        self.assertLess(len(pyblossom.dump(sf)), 20000 * 10 / 8)
+
+        wide = pyblossom.StaticFilter(range(1000), fingerprint=16, hash='xxh3')
+        self.assertTrue(all(wide.contains_many(range(1000))))
+        self.assertFalse(any(wide.contains_many(range(1000, 2000))))
+
+        for f in (sf, wide, pyblossom.StaticFilter([])):
+            loaded = pyblossom.load(pyblossom.dump(f))
+            self.assertTrue(isinstance(loaded, pyblossom.StaticFilter))
+            self.assertEqual(pyblossom.dump(loaded), pyblossom.dump(f))
+        self.assertTrue(all(pyblossom.load(pyblossom.dump(sf)).contains_many(keys)))
+        self.assertRaises(ValueError, pyblossom.StaticFilter, keys, fingerprint=12)
+        bare = pyblossom.StaticFilter.__new__(pyblossom.StaticFilter)
+        self.assertRaises(ValueError, bare.contains, 'test')
+        self.assertRaises(ValueError, bare.contains_many, ['test'])
+        self.assertRaises(ValueError, pyblossom.dump, bare)
+
+    def test_cuckoo_filter(self):
+        cf = pyblossom.CuckooFilter(1000)
+        keys = ['user%d' % i for i in range(1000)]
+        for key in keys:
+            cf.add(key)
+        self.assertEqual(len(cf), 1000)
+        self.assertTrue(all(cf.contains_many(keys)))
+        self.assertLess(sum(cf.contains_many(['miss%d' % i for i in range(10000)])), 10)
+
+        loaded = pyblossom.load(pyblossom.dump(cf))
+        self.assertTrue(isinstance(loaded, pyblossom.CuckooFilter))
+        self.assertEqual(pyblossom.dump(loaded), pyblossom.dump(cf))
+
+        for key in keys[:500]:
+            self.assertTrue(cf.remove(key))
+        self.assertFalse(cf.remove('never added'))
+        self.assertEqual(len(cf), 500)
+        self.assertTrue(all(cf.contains_many(keys[500:])))
+        self.assertLess(sum(cf.contains_many(keys[:500])), 5)
+        self.assertTrue(all(loaded.contains_many(keys)))
+
+        # fills up past its capacity, then refuses adds without losing keys
+        full = pyblossom.CuckooFilter(100)
+        added = []
+        with self.assertRaises(pyblossom.error):
+            for i in range(1000):
+                full.add(i)
+                added.append(i)
+        self.assertGreater(len(added), 100)
+        self.assertTrue(all(full.contains_many(added)))
+
+        bare = pyblossom.CuckooFilter.__new__(pyblossom.CuckooFilter)
+        for method in (bare.add, bare.remove, bare.contains):
+            self.assertRaises(ValueError, method, 'test')
+        self.assertRaises(ValueError, bare.contains_many, ['test'])
+        self.assertRaises(ValueError, pyblossom.dump, bare)
+
+    def test_stats(self):
+        bf = pyblossom.Filter(entries=10000, error=0.01, layout='blocked')
+        self.assertEqual(bf.stats()['estimated_entries'], 0)
+        bf.add_many(['key%d' % i for i in range(5000)])
+        bf.add('one more')
+        bf.contains_many(['key1', 'miss'])
+        bf.contains('key2')
+
+        stats = bf.stats(reset=True)
+        self.assertEqual(stats['set_bits'], sum(bin(b).count('1') for b in bf.get_buffer().tobytes()))
+        self.assertEqual(stats['fill'], stats['set_bits'] / stats['bits'])
+        self.assertLess(abs(stats['estimated_entries'] - 5001), 250)
+        self.assertLess(stats['estimated_error'], 0.01)
+        self.assertEqual((stats['layout'], stats['bytes']), ('blocked', len(bf.get_buffer())))
+        self.assertEqual((stats['adds'], stats['positives'], stats['negatives']), (5001, 2, 1))
+        self.assertEqual(bf.stats()['adds'], 0)
+
+    def test_delta(self):
+        primary = pyblossom.Filter(entries=100000, error=0.01, layout='blocked')
+        replica = pyblossom.Filter(entries=100000, error=0.01, layout='blocked')
+        primary.add_many(['key%d' % i for i in range(10000)])
+        token, delta = primary.dump_delta()
+        replica.apply_delta(delta)
+
+        primary.add_many(['new%d' % i for i in range(100)])
+        token, delta = primary.dump_delta(token)
+        self.assertLess(len(delta), 100 * 72 + 34)
+        replica.apply_delta(delta)
+        self.assertEqual(pyblossom.dump(replica), pyblossom.dump(primary))
+        self.assertTrue(all(replica.contains_many(['new%d' % i for i in range(100)])))
+
+        # nothing changed, or changed through a view
+        token, delta = primary.dump_delta(token)
+        self.assertEqual(len(delta), 34)
+        replica.apply_delta(delta)
+        view = memoryview(primary)
+        token, delta = primary.dump_delta(token)
+        self.assertEqual(len(delta), 34)
+        replica.apply_delta(delta)
+        del view
+        primary.get_buffer()[0] = 0xff
+        token, delta = primary.dump_delta(token)
+        replica.apply_delta(delta)
+        self.assertEqual(pyblossom.dump(replica), pyblossom.dump(primary))
+
+        self.assertRaises(pyblossom.error, primary.dump_delta, token - 1)
+        self.assertRaises(pyblossom.error, replica.apply_delta, delta)
+        corrupt = delta[:-1] + bytes([delta[-1] ^ 1])
+        with self.assertRaisesRegex(pyblossom.error, 'checksum mismatch'):
+            replica.apply_delta(corrupt)
+        other = pyblossom.Filter(entries=100000, error=0.01)
+        self.assertRaises(pyblossom.error, other.apply_delta, primary.dump_delta()[1])
+
+    def test_compressed_dump(self):
+        for layout in ('standard', 'blocked', 'split'):
+            bf = pyblossom.Filter(entries=100000, error=0.01, layout=layout)
+            bf.add_many(['key%d' % i for i in range(500)])
+            raw = pyblossom.dump(bf)
+            packed = pyblossom.dump(bf, compress=True)
+            self.assertLess(len(packed), len(raw) // 10)
+            for loaded in (pyblossom.load(packed), pyblossom.load(packed, copy=False),
+                           pyblossom.load_from(BytesIO(packed))):
+                self.assertEqual(pyblossom.dump(loaded), raw)
+
+            corrupt = packed[:-1] + bytes([packed[-1] ^ 1])
+            with self.assertRaisesRegex(pyblossom.error, 'checksum mismatch'):
+                pyblossom.load(corrupt)
+            self.assertRaises(pyblossom.error, pyblossom.load, packed[:-4], verify=False)
+
+        # empty filters shrink to the header, full ones stay raw and inbloom readable
+        empty = pyblossom.Filter(entries=100000, error=0.01)
+        self.assertLess(len(pyblossom.dump(empty, compress=True)), 40)
+        full = pyblossom.Filter(entries=100, error=0.01)
+        full.add_many(['key%d' % i for i in range(100)])
+        self.assertEqual(pyblossom.dump(full, compress=True), pyblossom.dump(full))
+
+    def test_sharded_filter(self):
+        sf = pyblossom.ShardedFilter(20000, 0.01, shards=4, layout='blocked')
+        keys = ['key%d' % i for i in range(10000)]
+        sf.add_many(keys[:5000])
+        for key in keys[5000:]:
+            sf.add(key)
+        self.assertTrue(all(sf.contains_many(keys)))
+        self.assertTrue(sf.contains(keys[0]))
+        self.assertEqual(len(sf.shards()), 4)
+        self.assertTrue(all(0.2 < shard.stats()['fill'] < 0.4 for shard in sf.shards()))
+
+        data = pyblossom.dump(sf)
+        self.assertEqual(pyblossom.dump(pyblossom.load(data)), data)
+        manifest, payloads = sf.dump_shards()
+        self.assertEqual(manifest + b''.join(payloads), data)
+        rebuilt = pyblossom.load_shards(manifest, [pyblossom.load(p) for p in payloads])
+        self.assertEqual(pyblossom.dump(rebuilt), data)
+
+        self.assertRaises(pyblossom.error, pyblossom.load, data[:-1])
+        self.assertRaises(pyblossom.error, pyblossom.load_shards, manifest,
+                          [pyblossom.load(p) for p in payloads[1:]])
+        other = pyblossom.Filter(5000, 0.01)
+        self.assertRaises(pyblossom.error, pyblossom.load_shards, manifest, [other] * 4)
+        self.assertRaises(ValueError, pyblossom.ShardedFilter, 100, 0.01, shards=0)
+        bare = pyblossom.ShardedFilter.__new__(pyblossom.ShardedFilter)
+        for method in (bare.add, bare.contains, bare.add_many, bare.contains_many):
+            self.assertRaises(ValueError, method, ['test'])
+        self.assertRaises(ValueError, pyblossom.dump, bare)
+
+    def test_rotating_filter(self):
+        rf = pyblossom.RotatingFilter(1000, 0.001, generations=3, layout='blocked')
+        hours = [['h%d-%d' % (hour, i) for i in range(500)] for hour in range(4)]
+        for hour, keys in enumerate(hours):
+            if hour:
+                rf.rotate()
+            rf.add_many(keys[:250])
+            for key in keys[250:]:
+                rf.add(key)
+        self.assertLess(sum(rf.contains_many(hours[0])), 10)
+        for keys in hours[1:]:
+            self.assertTrue(all(rf.contains_many(keys, threads=2)))
+            self.assertTrue(rf.contains(keys[0]))
+        generations = rf.generations()
+        self.assertEqual(len(generations), 3)
+        self.assertTrue(all(generations[-1].contains_many(hours[3])))
+        self.assertLess(sum(generations[-1].contains_many(hours[2])), 10)
+
+        data = pyblossom.dump(rf)
+        loaded = pyblossom.load(data)
+        self.assertEqual(pyblossom.dump(loaded), data)
+        self.assertEqual(pyblossom.dump(loaded, compress=True), pyblossom.dump(rf, compress=True))
+        loaded.rotate()
+        self.assertLess(sum(loaded.contains_many(hours[1])), 10)
+        self.assertTrue(all(loaded.contains_many(hours[3])))
+        self.assertRaises(pyblossom.error, pyblossom.load, data[:-1])
+        self.assertRaises(ValueError, pyblossom.RotatingFilter, 100, 0.01, generations=0)
+        bare = pyblossom.RotatingFilter.__new__(pyblossom.RotatingFilter)
+        for method in (bare.add, bare.contains, bare.add_many, bare.contains_many):
+            self.assertRaises(ValueError, method, ['test'])
+        self.assertRaises(ValueError, bare.rotate)
+        self.assertRaises(ValueError, pyblossom.dump, bare)
+
+    def test_async_io(self):
+        bf = pyblossom.Filter(entries=100000, error=0.01, layout='blocked')
+        bf.add_many(['key%d' % i for i in range(50000)])
+        rf = pyblossom.RotatingFilter(1000, 0.01, generations=3)
+        rf.add('key')
+        directory = tempfile.mkdtemp()
+        path = os.path.join(directory, 'filter.bin')
+
+        async def roundtrip(filter, **kwargs):
+            ticks = []
+
+            async def tick():
+                while True:
+                    ticks.append(1)
+                    await asyncio.sleep(0)
+
+            ticker = asyncio.ensure_future(tick())
+            await pyblossom.dump_async(filter, path, **kwargs)
+            loaded = await pyblossom.load_async(path)
+            ticker.cancel()
+            return loaded, ticks
+
+        try:
+            loaded, ticks = asyncio.run(roundtrip(bf, align=4096))
+            self.assertEqual(pyblossom.dump(loaded), pyblossom.dump(bf))
+            self.assertTrue(ticks)
+            with open(path, 'rb') as f:
+                self.assertEqual(f.read(), pyblossom.dump(bf, align=4096))
+            loaded, _ = asyncio.run(roundtrip(rf, compress=True))
+            self.assertTrue(loaded.contains('key'))
+
+            async def dump_all(filters):
+                await asyncio.gather(*[pyblossom.dump_async(f, path) for f in filters])
+
+            # concurrent dumps of one path each write a file of their own
+            asyncio.run(dump_all([bf, rf] * 4))
+            self.assertEqual(os.listdir(directory), ['filter.bin'])
+            with open(path, 'rb') as f:
+                self.assertIn(f.read(), (pyblossom.dump(bf), pyblossom.dump(rf)))
+
+            async def call(function, *args):
+                return await function(*args)
+
+            missing = os.path.join(directory, 'missing.bin')
+            self.assertRaises(OSError, asyncio.run, call(pyblossom.load_async, missing))
+            with open(path, 'r+b') as f:
+                f.truncate(100)
+            self.assertRaises(pyblossom.error, asyncio.run, call(pyblossom.load_async, path))
+            self.assertRaises(TypeError, asyncio.run, call(pyblossom.dump_async, object(), path))
+            self.assertRaises(RuntimeError, pyblossom.load_async, path)
+        finally:
+            for name in os.listdir(directory):
+                os.unlink(os.path.join(directory, name))
+            os.rmdir(directory)
+
+    def test_filter_handle(self):
+        keys = ['key%d' % i for i in range(20000)]
+        versions = []
+        for version in range(4):
+            bf = pyblossom.Filter(entries=20000, error=0.01, layout=('standard', 'blocked')[version % 2])
+            bf.add_many(keys)
+            bf.add('version%d' % version)
+            versions.append(bf)
+        handle = pyblossom.FilterHandle(versions[0])
+        failures = []
+
+        def read():
+            for _ in range(20):
+                if not all(handle.contains_many(keys)):
+                    failures.append(1)
+
+        readers = [threading.Thread(target=read) for _ in range(3)]
+        for reader in readers:
+            reader.start()
+        for i in range(200):
+            old = handle.swap(versions[(i + 1) % 4])
+            self.assertIs(old, versions[i % 4])
+        for reader in readers:
+            reader.join()
+        self.assertEqual(failures, [])
+        self.assertIs(handle.current(), versions[0])
+
+        fd, path = tempfile.mkstemp()
+        try:
+            os.write(fd, pyblossom.dump(versions[3], align=4096))
+            os.close(fd)
+            mapped = pyblossom.open_mmap(path)
+            handle.swap(mapped)
+            self.assertTrue(handle.contains('version3'))
+            self.assertFalse(handle.contains('version0'))
+            self.assertTrue(all(handle.contains_many(keys, threads=2)))
+            del mapped
+            handle.swap(versions[0])
+        finally:
+            os.unlink(path)
+        self.assertRaises(TypeError, handle.swap, pyblossom.CountingFilter(10, 0.01))
+        self.assertRaises(TypeError, pyblossom.FilterHandle, None)
+        bare = pyblossom.FilterHandle.__new__(pyblossom.FilterHandle)
+        self.assertRaises(ValueError, bare.contains, 'test')
+        self.assertRaises(ValueError, bare.contains_many, ['test'])
+        self.assertRaises(ValueError, bare.current)
+        self.assertRaises(ValueError, bare.swap, versions[0])
+
+        # a key swapping the last reference to the current filter away
+        class SwappingKey(object):
+            def __index__(self):
+                handle.swap(versions[1])
+                return 12345
+
+        handle = pyblossom.FilterHandle(pyblossom.load(pyblossom.dump(versions[0])))
+        self.assertFalse(handle.contains(SwappingKey()))
+        self.assertIs(handle.current(), versions[1])
+
+    def test_threads(self):
+        keys = ['key%d' % i for i in range(50000)]
+        dumps = set()
+        for threads in (0, 1, 3, 8):
+            for layout in ('standard', 'blocked', 'split'):
+                bf = pyblossom.Filter(entries=50000, error=0.01, layout=layout)
+                bf.add_many(keys, threads=threads)
+                self.assertTrue(all(bf.contains_many(keys, threads=threads)))
+                dumps.add(pyblossom.dump(bf))
+            sf = pyblossom.ShardedFilter(50000, 0.01, shards=5)
+            sf.add_many(keys, threads=threads)
+            self.assertTrue(all(sf.contains_many(keys, threads=threads)))
+            dumps.add(pyblossom.dump(sf))
+        self.assertEqual(len(dumps), 4)
+
+        parts = [pyblossom.Filter(entries=50000, error=0.01) for _ in range(3)]
+        for i, part in enumerate(parts):
+            part.add_many(keys[i::3])
+        self.assertEqual(pyblossom.dump(pyblossom.merge(parts, threads=4)),
+                         pyblossom.dump(pyblossom.merge(parts)))
+        self.assertRaises(ValueError, parts[0].add_many, keys, threads=-1)
+        self.assertRaises(TypeError, pyblossom.CuckooFilter(10).contains_many, keys, threads=2)
+
+    def test_probe_kernels(self):
+        keys = ['key%d' % i for i in range(300)]
+        seen = set()
+        for error in (0.5, 0.1, 0.05, 0.01, 0.002, 0.0005, 0.0001, 0.00001, 0.000001):
+            bf = pyblossom.Filter(entries=300, error=error)
+            bf.add_many(keys)
+            bits = bf.stats()['bits']
+            hashes = bf.stats()['hashes']
+            seen.add(hashes)
+            expected = bytearray(len(bf.get_buffer()))
+            for key in keys:
+                digest = pyblossom.hash(key)
+                a, b = digest & 0xFFFFFFFF, digest >> 32
+                for i in range(hashes):
+                    x = (a + i * b) % 2 ** 32 % bits
+                    expected[x >> 3] |= 1 << (x & 7)
+            self.assertEqual(bytes(bf.get_buffer()), bytes(expected))
+            blocked = pyblossom.Filter(entries=300, error=error, layout='blocked')
+            blocked.add_many(keys)
+            self.assertTrue(all(blocked.contains_many(keys)))
+            self.assertLessEqual(blocked.stats()['set_bits'], hashes * len(keys))
+        self.assertTrue(min(seen) < 3 and max(seen) > 12)
+
+    def test_prefetch(self):
+        keys = ['key%d' % i for i in range(3000)]
+        for layout in ('standard', 'blocked', 'split'):
+            for hash in ('murmur2', 'xxh3'):
+                bf = pyblossom.Filter(entries=2000, error=0.01, layout=layout, hash=hash)
+                bf.add_many(keys[:2000])
+                expected = bf.contains_many(keys, prefetch=0)
+                self.assertTrue(all(expected[:2000]))
+                for prefetch in (-1, 1, 7, 64):
+                    self.assertEqual(bf.contains_many(keys, prefetch=prefetch), expected)
+                self.assertEqual(bf.contains_many(keys, threads=3, prefetch=16), expected)
+        self.assertRaises(ValueError, bf.contains_many, keys, prefetch=65)
+        self.assertRaises(TypeError, bf.add_many, keys, prefetch=16)
+
+    def test_build_from_file(self):
+        keys = [b'key%d' % i for i in range(5000)]
+        numbers = list(range(-2500, 2500))
+        files = {
+            'lines': b'\r\n'.join(keys) + b'\n\n',
+            'u64': b''.join(struct.pack('=q', n) for n in numbers),
+            'len-prefixed': b''.join(struct.pack('>I', len(k)) + k for k in keys),
+        }
+        for format, data in files.items():
+            with tempfile.NamedTemporaryFile(delete=False) as f:
+                f.write(data)
+            try:
+                for layout, threads in (('standard', 0), ('blocked', 0), ('split', 4)):
+                    expected = pyblossom.Filter(entries=5000, error=0.01, layout=layout)
+                    expected.add_many(numbers if format == 'u64' else keys)
+                    bf = pyblossom.Filter(entries=5000, error=0.01, layout=layout)
+                    self.assertEqual(bf.build_from_file(f.name, format=format, threads=threads), 5000)
+                    self.assertEqual(pyblossom.dump(bf), pyblossom.dump(expected))
+                with open(f.name, 'ab') as out:
+                    out.write(b'\0\0\0')
+                if format != 'lines':
+                    self.assertRaises(pyblossom.error, pyblossom.Filter(10, 0.01).build_from_file, f.name, format)
+            finally:
+                os.unlink(f.name)
+        with tempfile.NamedTemporaryFile() as f:
+            for format in files:
+                self.assertEqual(pyblossom.Filter(10, 0.01).build_from_file(f.name, format=format), 0)
+        self.assertRaises(ValueError, pyblossom.Filter(10, 0.01).build_from_file, __file__, format='csv')
+
+    def test_str_keys_and_subclasses(self):
+        bf = pyblossom.Filter(entries=1000, error=0.001)
+        bf.add(u'h\xe9llo')
+        self.assertTrue(bf.contains(u'h\xe9llo'.encode('utf-8')))
+        self.assertFalse(bf.contains(u'hello'))
+
+        class Tagged(pyblossom.Filter):
+            pass
+        tagged = Tagged(1000, 0.001)
+        tagged.add_many(['a', 'b'])
+        self.assertEqual(pyblossom.dump(tagged | bf), pyblossom.dump(bf | tagged))
+        self.assertTrue(pyblossom.load(pyblossom.dump(tagged)).contains('a'))
+        self.assertRaises(TypeError, lambda: bf | 1)
+
 '''
 class InBloomTestCase(TestCase):
     def test_functionality(self):